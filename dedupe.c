@@ -0,0 +1,526 @@
+/*
+ *  dedupe.c  find files with the same content  (pwalk --dedupe-scan)
+
+Copyright (C) (2013-2016) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+/*
+
+Three stages, each only looks at what the one before could not rule out.
+
+1. While walking every walker keeps a list of the regular files it found:
+   size, dev, inode and the name, the path of the directory is kept once
+   per directory. When the walk is done the lists are joined and sorted by
+   size. Hard links of one inode are one file. A size only one inode has
+   can not be a duplicate and is dropped, which is most files.
+2. The first and last DUP_BLOCK bytes of what is left are hashed on a
+   pool of threads. Files that differ there are dropped. A file no bigger
+   than 2 * DUP_BLOCK has been read whole and is done.
+3. The others are hashed whole on the pool with DUP_READ byte reads into
+   page aligned buffers, POSIX_FADV_SEQUENTIAL before and
+   POSIX_FADV_DONTNEED after, so a scan does not push everything else out
+   of the page cache.
+
+Files with the same size and the same 64 bit XXH64 of their content are a
+group. The groups go to stdout, the most bytes to reclaim first:
+
+    group,files,size,reclaimable,xxh64,path
+
+reclaimable is (files - 1) * size. A file that changed size or could not
+be read is left out with a message on stderr.
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pwalk.h"
+#include "pipeline.h"
+
+extern int HEADER;
+
+#define DUP_BLOCK 4096          /* stage 2 reads this at both ends */
+#define DUP_READ  (1024*1024)   /* stage 3 read size */
+
+struct dupFile {
+    off_t  size;
+    dev_t  dev;
+    ino_t  ino;
+    uintptr_t dir, name;        /* offsets in dupSlot names while walking,
+                                   pointers once the lists are joined */
+    };
+
+struct dupSlot {
+    struct dupFile *rec;
+    long   n, max;
+    char  *names;
+    size_t nameLen, nameMax;
+    long   lastId;              /* directory whose path is at lastDir */
+    size_t lastDir;
+    struct dupSlot *next;
+    };
+
+struct dupCand {                /* a file that may have a duplicate */
+    struct dupFile *f;
+    uint64_t part, full;        /* stage 2 and 3 hashes */
+    int    done;                /* read whole in stage 2 */
+    int    bad;                 /* changed or unreadable, left out */
+    };
+
+static struct dupSlot *dupSlots;        /* every walker that recorded */
+static pthread_mutex_t dupLock = PTHREAD_MUTEX_INITIALIZER;
+static char **dupBuf;                   /* stage 3 buffer of each worker */
+
+static void *
+xrealloc( void *p, size_t n )
+{
+    if ( (p = realloc( p, n )) == NULL ) {
+        fprintf( stderr, "dedupe: out of memory\n" );
+        exit( 1 );
+    }
+    return p;
+}
+
+/* XXH64, https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md */
+
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+struct xxh64 {
+    uint64_t v[4], total;
+    unsigned char mem[32];
+    size_t memLen;
+    };
+
+static uint64_t
+rotl( uint64_t x, int r )
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t
+xxRound( uint64_t acc, uint64_t in )
+{
+    return rotl( acc + in * P2, 31 ) * P1;
+}
+
+static uint64_t
+xxMerge( uint64_t acc, uint64_t v )
+{
+    return (acc ^ xxRound( 0, v )) * P1 + P4;
+}
+
+static uint64_t
+read64( const unsigned char *p )
+{
+    uint64_t v;
+
+    memcpy( &v, p, 8 );
+    return v;
+}
+
+static void
+xxInit( struct xxh64 *s )
+{
+    s->v[0] = P1 + P2;
+    s->v[1] = P2;
+    s->v[2] = 0;
+    s->v[3] = -P1;
+    s->total = 0;
+    s->memLen = 0;
+}
+
+static void
+xxStripes( struct xxh64 *s, const unsigned char *p, size_t n )
+{
+    for ( ; n >= 32; n -= 32, p += 32 ) {
+        s->v[0] = xxRound( s->v[0], read64( p ) );
+        s->v[1] = xxRound( s->v[1], read64( p + 8 ) );
+        s->v[2] = xxRound( s->v[2], read64( p + 16 ) );
+        s->v[3] = xxRound( s->v[3], read64( p + 24 ) );
+    }
+}
+
+static void
+xxUpdate( struct xxh64 *s, const void *buf, size_t len )
+{
+    const unsigned char *p = buf;
+    size_t n;
+
+    s->total += len;
+    if ( s->memLen ) {
+        n = 32 - s->memLen < len ? 32 - s->memLen : len;
+        memcpy( s->mem + s->memLen, p, n );
+        s->memLen += n;
+        p += n;
+        len -= n;
+        if ( s->memLen < 32 )
+            return;
+        xxStripes( s, s->mem, 32 );
+        s->memLen = 0;
+    }
+    n = len & ~(size_t)31;
+    xxStripes( s, p, n );
+    memcpy( s->mem, p + n, len - n );
+    s->memLen = len - n;
+}
+
+static uint64_t
+xxDigest( struct xxh64 *s )
+{
+    const unsigned char *p = s->mem, *end = s->mem + s->memLen;
+    uint64_t h;
+    uint32_t k;
+
+    if ( s->total >= 32 ) {
+        h = rotl( s->v[0], 1 ) + rotl( s->v[1], 7 ) + rotl( s->v[2], 12 ) +
+            rotl( s->v[3], 18 );
+        h = xxMerge( h, s->v[0] );
+        h = xxMerge( h, s->v[1] );
+        h = xxMerge( h, s->v[2] );
+        h = xxMerge( h, s->v[3] );
+    } else
+        h = P5;
+    h += s->total;
+    for ( ; p + 8 <= end; p += 8 )
+        h = rotl( h ^ xxRound( 0, read64( p ) ), 27 ) * P1 + P4;
+    if ( p + 4 <= end ) {
+        memcpy( &k, p, 4 );
+        h = rotl( h ^ (uint64_t)k * P1, 23 ) * P2 + P3;
+        p += 4;
+    }
+    for ( ; p < end; p++ )
+        h = rotl( h ^ *p * P5, 11 ) * P1;
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* fileProcess for --dedupe-scan; stage 1, no lock */
+void
+dedupeEntry( struct threadData *cur, char *exten, struct stat *f,
+             long fileCnt, long dirSz )
+{
+    struct dupSlot *s = cur->dup;
+    struct dirFrame *fr = curFrame(cur);
+    struct dupFile *r;
+    size_t nlen, dlen, need;
+    char *path;
+
+    if ( fileCnt != -1 || !S_ISREG(f->st_mode) || f->st_size == 0 )
+        return;
+    if ( s == NULL ) {
+        s = cur->dup = calloc( 1, sizeof(struct dupSlot) );
+        if ( s == NULL ) {
+            fprintf( stderr, "dedupe: out of memory\n" );
+            exit( 1 );
+        }
+        s->lastId = -1;
+        pthread_mutex_lock( &dupLock );
+        s->next = dupSlots;
+        dupSlots = s;
+        pthread_mutex_unlock( &dupLock );
+    }
+    /* the directory part of the path is kept once per directory */
+    path = pwPath( cur );
+    dlen = cur->pathLen;
+    nlen = strlen( cur->ename );
+    need = nlen + 1 + (s->lastId != fr->id ? dlen + 1 : 0);
+    if ( s->nameLen + need > s->nameMax ) {
+        while ( s->nameLen + need > s->nameMax )
+            s->nameMax = s->nameMax ? s->nameMax * 2 : 65536;
+        s->names = xrealloc( s->names, s->nameMax );
+    }
+    if ( s->lastId != fr->id ) {
+        s->lastId = fr->id;
+        s->lastDir = s->nameLen;
+        memcpy( s->names + s->nameLen, path, dlen );
+        s->names[s->nameLen + dlen] = '\0';
+        s->nameLen += dlen + 1;
+    }
+    if ( s->n == s->max ) {
+        s->max = s->max ? s->max * 2 : 1024;
+        s->rec = xrealloc( s->rec, s->max * sizeof(struct dupFile) );
+    }
+    r = &s->rec[s->n++];
+    r->size = f->st_size;
+    r->dev = f->st_dev;
+    r->ino = f->st_ino;
+    r->dir = s->lastDir;
+    r->name = s->nameLen;
+    memcpy( s->names + s->nameLen, cur->ename, nlen + 1 );
+    s->nameLen += nlen + 1;
+}
+
+static int
+bySize( const void *a, const void *b )
+{
+    const struct dupFile *x = a, *y = b;
+
+    if ( x->size != y->size )
+        return x->size < y->size ? -1 : 1;
+    if ( x->dev != y->dev )
+        return x->dev < y->dev ? -1 : 1;
+    return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+static int
+byPart( const void *a, const void *b )
+{
+    const struct dupCand *x = a, *y = b;
+
+    if ( x->f->size != y->f->size )
+        return x->f->size < y->f->size ? -1 : 1;
+    return (x->part > y->part) - (x->part < y->part);
+}
+
+static int
+byFull( const void *a, const void *b )
+{
+    const struct dupCand *x = a, *y = b;
+
+    if ( x->f->size != y->f->size )
+        return x->f->size < y->f->size ? -1 : 1;
+    return (x->full > y->full) - (x->full < y->full);
+}
+
+/* sort c by cmp and keep the runs of at least two good files; new count */
+static long
+keepGroups( struct dupCand *c, long n, int (*cmp)( const void *, const void * ) )
+{
+    long i, j, k, out = 0;
+
+    for ( i = j = 0; i < n; i++ )       /* drop the bad ones first */
+        if ( !c[i].bad )
+            c[j++] = c[i];
+    n = j;
+    qsort( c, n, sizeof(*c), cmp );
+    for ( i = 0; i < n; i = j ) {
+        for ( j = i + 1; j < n && !cmp( &c[i], &c[j] ); j++ )
+            ;
+        if ( j - i > 1 )
+            for ( k = i; k < j; k++ )
+                c[out++] = c[k];
+    }
+    return out;
+}
+
+/* open c read only, checking it is still the file that was walked */
+static int
+dupOpen( struct dupCand *c )
+{
+    struct stat f;
+    char *path;
+    int fd;
+
+    if ( asprintf( &path, "%s/%s", (char *)c->f->dir, (char *)c->f->name ) == -1 ) {
+        fprintf( stderr, "dedupe: out of memory\n" );
+        exit( 1 );
+    }
+    if ( (fd = open( path, O_RDONLY|O_NOATIME )) == -1 && errno == EPERM )
+        fd = open( path, O_RDONLY );
+    if ( fd == -1 )
+        fprintf( stderr, "dedupe: %s: %s\n", path, strerror(errno) );
+    else if ( fstat( fd, &f ) || f.st_ino != c->f->ino || f.st_dev != c->f->dev ||
+              f.st_size != c->f->size ) {
+        fprintf( stderr, "dedupe: %s: changed since the walk\n", path );
+        close( fd );
+        fd = -1;
+    }
+    free( path );
+    if ( fd == -1 )
+        c->bad = 1;
+    return fd;
+}
+
+/* stage 2 worker: hash both ends, or the whole file if that is all of it */
+static void
+hashEnds( void *item, int worker )
+{
+    struct dupCand *c = item;
+    char buf[2 * DUP_BLOCK];
+    struct xxh64 s;
+    off_t size = c->f->size;
+    int fd;
+
+    if ( (fd = dupOpen( c )) == -1 )
+        return;
+    if ( size <= 2 * DUP_BLOCK ) {
+        if ( pread( fd, buf, size, 0 ) != size )
+            c->bad = 1;
+        c->done = 1;
+    } else if ( pread( fd, buf, DUP_BLOCK, 0 ) != DUP_BLOCK ||
+                pread( fd, buf + DUP_BLOCK, DUP_BLOCK, size - DUP_BLOCK ) != DUP_BLOCK )
+        c->bad = 1;
+    close( fd );
+    if ( c->bad ) {
+        fprintf( stderr, "dedupe: %s/%s: short read\n", (char *)c->f->dir,
+                 (char *)c->f->name );
+        return;
+    }
+    xxInit( &s );
+    xxUpdate( &s, buf, size < 2 * DUP_BLOCK ? size : 2 * DUP_BLOCK );
+    c->part = c->full = xxDigest( &s );
+}
+
+/* stage 3 worker: hash the whole file */
+static void
+hashAll( void *item, int worker )
+{
+    struct dupCand *c = item;
+    struct xxh64 s;
+    off_t total = 0;
+    ssize_t n;
+    int fd;
+
+    if ( (fd = dupOpen( c )) == -1 )
+        return;
+    posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+    xxInit( &s );
+    while ( (n = read( fd, dupBuf[worker], DUP_READ )) > 0 ) {
+        xxUpdate( &s, dupBuf[worker], n );
+        total += n;
+    }
+    posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+    close( fd );
+    if ( n == -1 || total != c->f->size ) {
+        fprintf( stderr, "dedupe: %s/%s: %s\n", (char *)c->f->dir,
+                 (char *)c->f->name, n == -1 ? strerror(errno) : "changed size" );
+        c->bad = 1;
+        return;
+    }
+    c->full = xxDigest( &s );
+}
+
+struct dupGroup {
+    long   first, n;
+    off_t  reclaim;
+    };
+
+static int
+byReclaim( const void *a, const void *b )
+{
+    const struct dupGroup *x = a, *y = b;
+
+    return (x->reclaim < y->reclaim) - (x->reclaim > y->reclaim);
+}
+
+/* stages 2 and 3 after the walk; the groups go to stdout */
+void
+dedupeReport( int threads )
+{
+    struct dupSlot *s;
+    struct dupFile *all = NULL;
+    struct dupCand *c = NULL;
+    struct dupGroup *g = NULL;
+    struct pipeline *pl;
+    long n = 0, nsize, npart, nfull, ng = 0, i, j, k;
+    off_t reclaim = 0;
+    char *out = NULL, *path;
+    size_t outMax = 0;
+
+    for ( s = dupSlots; s; s = s->next ) {
+        all = xrealloc( all, (n + s->n + 1) * sizeof(struct dupFile) );
+        for ( i = 0; i < s->n; i++ ) {
+            all[n] = s->rec[i];
+            all[n].dir += (uintptr_t)s->names;
+            all[n++].name += (uintptr_t)s->names;
+        }
+        free( s->rec );
+    }
+    /* stage 1: sizes with at least two inodes, one name per inode */
+    qsort( all, n, sizeof(struct dupFile), bySize );
+    for ( i = 0; i < n; i = j ) {
+        for ( j = i + 1, k = 1; j < n && all[j].size == all[i].size; j++ )
+            if ( all[j].dev != all[j-1].dev || all[j].ino != all[j-1].ino )
+                k++;
+        if ( k < 2 )
+            continue;
+        c = xrealloc( c, (ng + k) * sizeof(struct dupCand) );
+        for ( k = i; k < j; k++ )
+            if ( k == i || all[k].dev != all[k-1].dev || all[k].ino != all[k-1].ino ) {
+                memset( &c[ng], 0, sizeof(*c) );
+                c[ng++].f = &all[k];
+            }
+    }
+    nsize = ng;
+    /* stage 2 */
+    pl = pipelineStart( threads, threads * 4, hashEnds );
+    for ( i = 0; i < nsize; i++ )
+        pipelinePut( pl, &c[i] );
+    pipelineFinish( pl );
+    npart = keepGroups( c, nsize, byPart );
+    /* stage 3 */
+    dupBuf = xrealloc( NULL, threads * sizeof(char *) );
+    for ( i = 0; i < threads; i++ )
+        if ( posix_memalign( (void **)&dupBuf[i], 4096, DUP_READ ) ) {
+            fprintf( stderr, "dedupe: out of memory\n" );
+            exit( 1 );
+        }
+    pl = pipelineStart( threads, threads * 4, hashAll );
+    for ( i = 0; i < npart; i++ )
+        if ( !c[i].done )
+            pipelinePut( pl, &c[i] );
+    pipelineFinish( pl );
+    for ( i = 0; i < threads; i++ )
+        free( dupBuf[i] );
+    free( dupBuf );
+    nfull = keepGroups( c, npart, byFull );
+    /* groups, the most to reclaim first */
+    for ( ng = 0, i = 0; i < nfull; i = j ) {
+        for ( j = i + 1; j < nfull && !byFull( &c[i], &c[j] ); j++ )
+            ;
+        g = xrealloc( g, (ng + 1) * sizeof(struct dupGroup) );
+        g[ng].first = i;
+        g[ng].n = j - i;
+        g[ng].reclaim = (j - i - 1) * c[i].f->size;
+        reclaim += g[ng++].reclaim;
+    }
+    qsort( g, ng, sizeof(struct dupGroup), byReclaim );
+    if ( HEADER )
+        printf( "group,files,size,reclaimable,xxh64,path\n" );
+    for ( i = 0; i < ng; i++ )
+        for ( k = g[i].first; k < g[i].first + g[i].n; k++ ) {
+            if ( asprintf( &path, "%s/%s", (char *)c[k].f->dir, (char *)c[k].f->name ) == -1 ) {
+                fprintf( stderr, "dedupe: out of memory\n" );
+                exit( 1 );
+            }
+            if ( 2 * strlen( path ) + 1 > outMax )
+                out = xrealloc( out, outMax = 2 * strlen( path ) + 1 );
+            csv_escape( path, out );
+            printf( "%ld,%ld,%ld,%ld,%016llx,\"%s\"\n", i + 1, g[i].n,
+                    (long)c[k].f->size, (long)g[i].reclaim,
+                    (unsigned long long)c[k].full, out );
+            free( path );
+        }
+    fprintf( stderr, "dedupe: %ld files, %ld share a size, %ld share both ends,"
+             " %ld in %ld groups, %ld bytes reclaimable\n", n, nsize, npart,
+             nfull, ng, (long)reclaim );
+    free( out ); free( g ); free( c ); free( all );
+}
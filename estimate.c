@@ -0,0 +1,564 @@
+/*
+ *  estimate.c  approximate totals from random probes  (pwalk --estimate)
+
+Copyright (C) (2013-2016) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+/*
+
+The root directory is read completely; every subdirectory of the root is a
+stratum. A probe (Knuth) starts at a stratum, reads one directory, adds
+its entries times the weight of the directory and goes on into one of its
+subdirectories until a directory without subdirectories. The subdirectory
+is picked in proportion to its fan-out, st_nlink - 1, and the weight
+grows by the inverse of the chance it had; with k equal subdirectories
+that is k. Big subtrees are probed more often and count less each time,
+which takes most of the skew out of the probes. The sum is an unbiased
+estimate of the stratum's files, directories, bytes and bytes per uid.
+
+The estimate is what was read completely plus the mean of the probes of
+every stratum, its variance the sum of s^2/n of the strata, s^2 at least
+m^2/n. Every stratum gets a probe, then probes go in proportion to the
+fan-out of the stratum. A stratum whose probe never had a choice to make
+is exact and gets no more probes. A stratum with SPLIT_AT probes is
+split: its directory is read completely and its subdirectories become
+strata, so as time allows the estimate is refined stratum by stratum and
+turns into a full walk if there is time for it. Probes run on MAXTHRDS
+threads until --estimate-time seconds are up or the 95% interval of the
+files and bytes is within --estimate-error percent, but never before
+every stratum had a probe.
+
+Directories are read like fileDir reads them: fstatat without following
+links relative to the directory fd, --one-file-system, --NoSnap, --exclude
+and --depth.
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "pwalk.h"
+
+extern int SNAPSHOT, DEPTH, ONE_FS;
+extern dev_t ST_DEV;
+extern char *exclude_list[];
+int check_exclude_list( char *fname );
+
+#define Z95 1.96
+#define NVAL 3                  /* files, dirs, bytes */
+#define TOP_UIDS 10
+#define SPLIT_AT 8              /* probes before a stratum is split */
+
+struct uidSum {
+    uid_t  uid;
+    double sum, sq;             /* of the probe estimates; a probe, x only */
+    };
+
+struct uidTab {
+    struct uidSum *u;
+    int    n, max;
+    };
+
+struct stratum {
+    char   *path;
+    long   depth;
+    double fan;                 /* st_nlink - 1, probes go by it */
+    long   n;                   /* probes done */
+    int    busy;                /* probes running */
+    int    exact;               /* a probe had no choice, n is 1 */
+    int    split;               /* read completely, its children are strata */
+    double sum[NVAL], sq[NVAL];
+    struct uidTab uid;
+    };
+
+struct probe {                  /* one probe in progress */
+    double val[NVAL];
+    struct uidTab uid;
+    char   *path;
+    size_t pathMax;
+    char   **sub;               /* subdirectories of a split */
+    double *subFan;
+    long   nsub, maxsub;
+    };
+
+/* strata move when they grow; hold an index, not a pointer, unlocked */
+static struct stratum *strata;
+static long nStrata, maxStrata;
+static double exactVal[NVAL];   /* directories read completely */
+static struct uidTab exactUid;
+static long probes, splits;
+static int splitting;           /* splits running, their strata are missing */
+static int done;
+static double budget, maxError;
+static long tStart;
+static pthread_mutex_t estLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+xrealloc( void *p, size_t n )
+{
+    if ( (p = realloc( p, n )) == NULL ) {
+        fprintf( stderr, "estimate: out of memory\n" );
+        exit( 1 );
+    }
+    return p;
+}
+
+static struct uidSum *
+uidFind( struct uidTab *t, uid_t uid )
+{
+    int i;
+
+    for ( i = 0; i < t->n; i++ )
+        if ( t->u[i].uid == uid )
+            return &t->u[i];
+    if ( t->n == t->max ) {
+        t->max = t->max ? t->max * 2 : 16;
+        t->u = xrealloc( t->u, t->max * sizeof(struct uidSum) );
+    }
+    memset( &t->u[t->n], 0, sizeof(struct uidSum) );
+    t->u[t->n].uid = uid;
+    return &t->u[t->n++];
+}
+
+/*
+ * read directory path (open as dfd) with weight w into p; returns the
+ * number of subdirectories and leaves a random one in *pick, picked in
+ * proportion to its st_nlink, and the inverse of that chance in *inv.
+ * Subdirectories are left out unless descend, like pwalk leaves them out
+ * of its records.  With collect their paths are left in p->sub.
+ */
+static long
+readDir( int dfd, struct probe *p, size_t plen, double w, char **pick,
+         double *inv, unsigned short *seed, int descend, int collect )
+{
+    double q, qsum = 0, qpick = 1;
+    DIR *dirp;
+    struct dirent *d;
+    struct stat f;
+    struct uidSum *u = NULL;
+    size_t nlen;
+    long k = 0;
+
+    if ( (dirp = fdopendir( dfd )) == NULL ) {
+        fprintf( stderr, "Locked Dir: %s\n", p->path );
+        close( dfd );
+        return 0;
+    }
+    while ( (d = readdir( dirp )) != NULL ) {
+        if ( d->d_name[0] == '.' &&
+             (!d->d_name[1] || (d->d_name[1]=='.' && !d->d_name[2]))) continue;
+        if ( fstatat( dirfd(dirp), d->d_name, &f, AT_SYMLINK_NOFOLLOW ) == -1 )
+            continue;
+        if ( ONE_FS && f.st_dev != ST_DEV )
+            continue;
+        if ( S_ISDIR(f.st_mode) ) {
+            if ( !descend || (SNAPSHOT && !strcmp( ".snapshot", d->d_name )) )
+                continue;
+            nlen = strlen( d->d_name );
+            if ( plen + nlen + 2 > p->pathMax ) {
+                p->pathMax = (plen + nlen + 2) * 2;
+                p->path = xrealloc( p->path, p->pathMax );
+            }
+            p->path[plen] = '/';
+            memcpy( p->path + plen + 1, d->d_name, nlen + 1 );
+            if ( exclude_list[0] && check_exclude_list( p->path ) )
+                continue;
+        }
+        p->val[S_ISDIR(f.st_mode) ? 1 : 0] += w;
+        p->val[2] += w * f.st_size;
+        if ( u == NULL || u->uid != f.st_uid )
+            u = uidFind( &p->uid, f.st_uid );
+        u->sum += w * f.st_size;
+        if ( !S_ISDIR(f.st_mode) )
+            continue;
+        k++;
+        /* st_nlink - 1 is 1 + subdirectories on most file systems, 1 where
+           directories have no count */
+        q = f.st_nlink > 2 ? f.st_nlink - 1 : 1;
+        if ( collect ) {
+            if ( p->nsub == p->maxsub ) {
+                p->maxsub = p->maxsub ? p->maxsub * 2 : 256;
+                p->sub = xrealloc( p->sub, p->maxsub * sizeof(char *) );
+                p->subFan = xrealloc( p->subFan, p->maxsub * sizeof(double) );
+            }
+            p->subFan[p->nsub] = q;
+            p->sub[p->nsub++] = strdup( p->path );
+        } else if ( pick ) {
+            /* weighted reservoir of one */
+            qsum += q;
+            if ( erand48( seed ) * qsum < q ) {
+                free( *pick );
+                *pick = strdup( d->d_name );
+                qpick = q;
+            }
+        }
+    }
+    if ( inv )
+        *inv = qsum / qpick;
+    closedir( dirp );
+    p->path[plen] = '\0';
+    return k;
+}
+
+/* start p at path, nothing counted yet */
+static void
+probeStart( struct probe *p, const char *path )
+{
+    size_t plen = strlen( path );
+
+    memset( p->val, 0, sizeof(p->val) );
+    p->uid.n = 0;
+    p->nsub = 0;
+    if ( plen + 1 > p->pathMax ) {
+        p->pathMax = (plen + 1) * 2;
+        p->path = xrealloc( p->path, p->pathMax );
+    }
+    memcpy( p->path, path, plen + 1 );
+}
+
+/* one probe from the stratum at path into p; 1 if it never had a choice */
+static int
+probe( const char *path, long depth, struct probe *p, unsigned short *seed )
+{
+    char *pick = NULL;
+    double w = 1.0, inv;
+    size_t plen = strlen( path );
+    long k;
+    int dfd, sub, exact = 1;
+
+    probeStart( p, path );
+    if ( (dfd = open( p->path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW )) == -1 )
+        return 1;
+    for ( ;; ) {
+        k = readDir( dup( dfd ), p, plen, w, &pick, &inv, seed,
+                     !(DEPTH && DEPTH == depth), 0 );
+        if ( k == 0 )
+            break;
+        if ( k > 1 )
+            exact = 0;
+        w *= inv;
+        if ( (sub = openat( dfd, pick, O_RDONLY|O_DIRECTORY|O_NOFOLLOW )) == -1 )
+            break;      /* gone since readdir; the probe stops here */
+        close( dfd );
+        dfd = sub;
+        /* readDir made room for every subdirectory name */
+        plen += sprintf( p->path + plen, "/%s", pick );
+        depth++;
+    }
+    close( dfd );
+    free( pick );
+    return exact;
+}
+
+/*
+ * read stratum h completely: its directory is added to exactVal and its
+ * subdirectories become strata.  Called and returns under estLock.
+ */
+static void
+splitStratum( long h, struct probe *p )
+{
+    struct uidSum *u;
+    char *path = strata[h].path;
+    long depth = strata[h].depth, i;
+    int dfd, v;
+
+    strata[h].split = 1;
+    splits++;
+    splitting++;
+    pthread_mutex_unlock( &estLock );
+    probeStart( p, path );
+    /* the walk root may be a link, nothing below it is followed */
+    dfd = open( path, O_RDONLY|O_DIRECTORY|(depth ? O_NOFOLLOW : 0) );
+    if ( dfd == -1 )
+        fprintf( stderr, "Locked Dir: %s\n", path );
+    else
+        readDir( dfd, p, strlen( path ), 1.0, NULL, NULL, NULL,
+                 !(DEPTH && DEPTH == depth), 1 );
+    pthread_mutex_lock( &estLock );
+    for ( v = 0; v < NVAL; v++ )
+        exactVal[v] += p->val[v];
+    for ( i = 0; i < p->uid.n; i++ ) {
+        u = uidFind( &exactUid, p->uid.u[i].uid );
+        u->sum += p->uid.u[i].sum;
+    }
+    for ( i = 0; i < p->nsub; i++ ) {
+        if ( nStrata == maxStrata ) {
+            maxStrata = maxStrata ? maxStrata * 2 : 256;
+            strata = xrealloc( strata, maxStrata * sizeof(struct stratum) );
+        }
+        memset( &strata[nStrata], 0, sizeof(struct stratum) );
+        strata[nStrata].path = p->sub[i];
+        strata[nStrata].fan = p->subFan[i];
+        strata[nStrata++].depth = depth + 1;
+    }
+    splitting--;
+}
+
+/*
+ * s^2 of n probes adding up to sum and sq, but not less than m^2/n: a few
+ * probes of a skewed tree often agree and all miss the big subtree
+ */
+static double
+spread( long n, double sum, double sq )
+{
+    double m = sum / n, s2 = n > 1 ? (sq - n * m * m) / (n - 1) : 0;
+
+    return s2 > m * m / n ? s2 : m * m / n;
+}
+
+/* estimate of value v and its variance; uid >= 0 for the bytes of uid */
+static double
+total( int v, long uid, double *var )
+{
+    struct uidSum *u;
+    double t, m, sum, sq;
+    long h;
+    int i;
+
+    t = 0; *var = 0;
+    if ( uid < 0 )
+        t = exactVal[v];
+    else
+        for ( i = 0; i < exactUid.n; i++ )
+            if ( exactUid.u[i].uid == uid )
+                t = exactUid.u[i].sum;
+    for ( h = 0; h < nStrata; h++ ) {
+        if ( strata[h].n == 0 || strata[h].split )
+            continue;
+        if ( uid < 0 ) {
+            sum = strata[h].sum[v]; sq = strata[h].sq[v];
+        } else {
+            for ( sum = sq = 0, i = 0; i < strata[h].uid.n; i++ )
+                if ( (u = &strata[h].uid.u[i])->uid == uid ) {
+                    sum = u->sum; sq = u->sq;
+                }
+        }
+        m = sum / strata[h].n;
+        t += m;
+        if ( strata[h].exact )
+            continue;
+        *var += spread( strata[h].n, sum, sq ) / strata[h].n;
+    }
+    if ( *var < 0 )             /* rounding */
+        *var = 0;
+    return t;
+}
+
+/*
+ * the stratum with the fewest probes for its fan-out, -1 if none.  What
+ * the probes found is not used: a stratum whose first probes came out low
+ * would get fewer and stay low.  Under estLock.
+ */
+static long
+nextStratum( )
+{
+    double load, best = HUGE_VAL;
+    long h, pick = -1;
+    struct stratum *s;
+
+    for ( h = 0; h < nStrata; h++ ) {
+        s = &strata[h];
+        if ( s->split || (s->exact && (s->n || s->busy)) )
+            continue;
+        if ( s->n + s->busy == 0 )
+            return h;
+        load = (s->n + s->busy) / s->fan;
+        if ( load < best ) {
+            best = load;
+            pick = h;
+        }
+    }
+    return pick;
+}
+
+/* enough; under estLock */
+static int
+finished( )
+{
+    double t, var;
+    long h;
+    int v;
+
+    /* a stratum being split or without a probe would count as empty */
+    if ( splitting )
+        return 0;
+    for ( h = 0; h < nStrata; h++ )
+        if ( !strata[h].split && strata[h].n == 0 )
+            return 0;
+    if ( profileNow( ) - tStart >= budget * 1e6 )
+        return 1;
+    for ( h = 0; h < nStrata; h++ )
+        if ( !strata[h].split && !strata[h].exact && strata[h].n < 2 )
+            return 0;
+    for ( v = 0; v < NVAL; v += 2 ) {           /* files and bytes */
+        t = total( v, -1, &var );
+        if ( Z95 * sqrt( var ) > maxError / 100 * t )
+            return 0;
+    }
+    return 1;
+}
+
+static void *
+estThread( void *arg )
+{
+    struct probe p;
+    struct stratum *s;
+    struct uidSum *u;
+    unsigned short seed[3];
+    char *path;
+    long h, depth, id = (long) arg, now = profileNow( );
+    int i, v, exact;
+
+    memset( &p, 0, sizeof(p) );
+    seed[0] = id; seed[1] = now; seed[2] = now >> 16;
+    pthread_mutex_lock( &estLock );
+    while ( !done && (h = nextStratum( )) >= 0 ) {
+        s = &strata[h];
+        if ( s->n >= SPLIT_AT ) {
+            splitStratum( h, &p );
+            continue;
+        }
+        s->busy++;
+        path = s->path;
+        depth = s->depth;
+        pthread_mutex_unlock( &estLock );
+        exact = probe( path, depth, &p, seed );
+        pthread_mutex_lock( &estLock );
+        s = &strata[h];
+        s->busy--;
+        /* an exact stratum keeps one probe, a second one would match it;
+           the probes of a stratum split meanwhile are not needed */
+        if ( !s->split && !(s->exact && s->n) ) {
+            s->n++;
+            s->exact = exact;
+            for ( v = 0; v < NVAL; v++ ) {
+                s->sum[v] += p.val[v];
+                s->sq[v] += p.val[v] * p.val[v];
+            }
+            for ( i = 0; i < p.uid.n; i++ ) {
+                u = uidFind( &s->uid, p.uid.u[i].uid );
+                u->sum += p.uid.u[i].sum;
+                u->sq += p.uid.u[i].sum * p.uid.u[i].sum;
+            }
+            probes++;
+        }
+        if ( finished( ) )
+            done = 1;
+    }
+    pthread_mutex_unlock( &estLock );
+    free( p.path );
+    free( p.uid.u );
+    free( p.sub );
+    free( p.subFan );
+    return NULL;
+}
+
+static int
+byBytes( const void *a, const void *b )
+{
+    const struct uidSum *x = a, *y = b;
+
+    return (x->sum < y->sum) - (x->sum > y->sum);
+}
+
+static void
+report( const char *label, double t, double var )
+{
+    double ci = Z95 * sqrt( var );
+
+    printf( "%-8s %18.0f +- %.0f (%.2f%%)\n", label, t, ci, t > 0 ? 100 * ci / t : 0.0 );
+}
+
+/*
+ * pwalk --estimate; totals of root with 95% intervals in about seconds
+ * or when within error percent
+ */
+void
+estimate( const char *root, double seconds, double error )
+{
+    struct probe p;
+    struct uidTab all;
+    pthread_t tid[MAXTHRDS];
+    double t, var, bytes, bvar;
+    long h, i, sampled = 0, exact = 0;
+    int dfd;
+
+    budget = seconds;
+    maxError = error;
+    tStart = profileNow( );
+    if ( (dfd = open( root, O_RDONLY|O_DIRECTORY )) == -1 ) {
+        fprintf( stderr, "open: '%s' %s\n", root, strerror(errno) );
+        exit( 1 );
+    }
+    close( dfd );
+    /* the root is the first stratum and is split right away */
+    memset( &p, 0, sizeof(p) );
+    strata = xrealloc( NULL, sizeof(struct stratum) );
+    memset( strata, 0, sizeof(struct stratum) );
+    strata[0].path = strdup( root );
+    nStrata = maxStrata = 1;
+    pthread_mutex_lock( &estLock );
+    splitStratum( 0, &p );
+    pthread_mutex_unlock( &estLock );
+    free( p.path ); free( p.uid.u ); free( p.sub ); free( p.subFan );
+    for ( i = 0; i < MAXTHRDS; i++ )
+        pthread_create( &tid[i], NULL, estThread, (void *) i );
+    for ( i = 0; i < MAXTHRDS; i++ )
+        pthread_join( tid[i], NULL );
+
+    for ( h = 0; h < nStrata; h++ )
+        if ( !strata[h].split ) {
+            sampled++;
+            exact += strata[h].exact;
+        }
+    printf( "estimate of %s: %ld directories read, %ld probes of %ld subtrees"
+            " (%ld exact) in %.1f s, 95%% intervals\n", root, splits, probes,
+            sampled, exact, (profileNow( ) - tStart) / 1e6 );
+    t = total( 0, -1, &var );
+    report( "files", t, var );
+    t = total( 1, -1, &var );
+    report( "dirs", t, var );
+    bytes = total( 2, -1, &bvar );
+    report( "bytes", bytes, bvar );
+    /* every uid seen; the top ones by estimated bytes */
+    memset( &all, 0, sizeof(all) );
+    for ( i = 0; i < exactUid.n; i++ )
+        uidFind( &all, exactUid.u[i].uid );
+    for ( h = 0; h < nStrata; h++ )
+        for ( i = 0; i < strata[h].uid.n; i++ )
+            uidFind( &all, strata[h].uid.u[i].uid );
+    for ( i = 0; i < all.n; i++ )
+        all.u[i].sum = total( 2, all.u[i].uid, &all.u[i].sq );
+    qsort( all.u, all.n, sizeof(struct uidSum), byBytes );
+    printf( "%-8s %18s    %-12s %s\n", "uid", "bytes", "+-", "share" );
+    for ( i = 0; i < all.n && i < TOP_UIDS; i++ ) {
+        t = all.u[i].sum;
+        printf( "%-8ld %18.0f +- %-12.0f %.1f%%\n", (long) all.u[i].uid, t,
+                Z95 * sqrt( all.u[i].sq ), bytes > 0 ? 100 * t / bytes : 0.0 );
+    }
+    free( all.u );
+}
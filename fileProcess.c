@@ -27,6 +27,7 @@ keep the same arguments as defined by the prototype fileProcess()
 
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,62 +35,161 @@ keep the same arguments as defined by the prototype fileProcess()
 #include <time.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include "pwalk.h"
+#include "pipeline.h"
+#include "journal.h"
+#include "perf.h"
 
 /* conditioanally change file ownership --chown_from --chown_to */
 extern uid_t UID_orig, UID_new;
 extern gid_t GID_new;
 extern int chown_flag;
-
-/* Escape CSV delimeters */
-void
-csv_escape(char *in, char *out)
-{
-   char *t, *orig;
-   int cnt = 0;
-
-   t = out;
-   orig = in;
-   while ( *in ) {
-      if ( *in == '"' )
-          *out++ = '"';
-      if ( (unsigned char)*in < 32 ) {
-          in++;
-          cnt++;
-      } else
-          *out++ = *in++;
-   *out = '\0';
-   }
-   if ( cnt )
-       fprintf( stderr, "Bad File: %s\n", orig);
-}
-
+extern int DRY_RUN;
 
 /*
  * conditionally change file ownership
  * if file owned by UID_orig chown UID_new:GID_new
+ *
+ * The walker only queues the change. A pool of mutator threads runs
+ * fchownat relative to a dup of the directory fd, so changeOwner does
+ * not need the print lock and NFS round trips overlap.
  */
+struct chownOp {
+    struct dirRef *dir;
+    char *name;         /* entry in dir, NULL for the directory itself */
+    char *path;         /* for the changed file log */
+    struct stat old;    /* for the journal */
+    };
+
+struct mutLog {         /* one per mutator, written with a single write() */
+    char buf[PIPE_BUF];
+    size_t len;
+    };
+
+struct pipeline *Mutator;
+struct mutLog *MutLog;
+long mutChanged, mutFailed;
+long mutErrno[256];     /* failures by errno */
+
+void
+mutLogFlush( struct mutLog *l )
+{
+    if ( l->len && write( STDOUT_FILENO, l->buf, l->len ) == -1 )
+        fprintf(stderr, "changed file log: %s\n", strerror(errno));
+    l->len = 0;
+}
+
+void
+chownWork( void *item, int worker )
+{
+    struct chownOp *op = (struct chownOp *) item;
+    struct mutLog *l = &MutLog[worker];
+    char *fname;
+    size_t len;
+    int err = 0;
+    long t0;
+
+    journalHold(worker);
+    if ( !DRY_RUN ) {
+        t0 = perfStart( );
+        if ( op->name )
+            err = fchownat(op->dir->fd, op->name, UID_new, GID_new,
+                           AT_SYMLINK_NOFOLLOW);
+        else
+            err = fchownat(op->dir->fd, "", UID_new, GID_new, AT_EMPTY_PATH);
+        err = err ? errno : 0;
+        perfAdd(PERF_CHANGE, t0, -1, 0);
+        if ( !err )
+            journalAdd(worker, op->path, &op->old, op->old.st_mode, UID_new, GID_new);
+    }
+    journalRelease(worker);
+    fname = malloc(2*strlen(op->path)+2);
+    csv_escape(op->path, fname);
+    if ( err ) {
+        __sync_fetch_and_add(&mutFailed, 1);
+        __sync_fetch_and_add(&mutErrno[err < 256 ? err : 0], 1);
+        fprintf(stderr, "could not chown %s: %s\n", fname, strerror(err));
+    } else {
+        __sync_fetch_and_add(&mutChanged, 1);
+        len = strlen(fname);
+        fname[len++] = '\n';
+        if ( l->len + len > sizeof(l->buf) )
+            mutLogFlush(l);
+        if ( len > sizeof(l->buf) ) {
+            if ( write(STDOUT_FILENO, fname, len) == -1 )
+                fprintf(stderr, "changed file log: %s\n", strerror(errno));
+        } else {
+            memcpy(l->buf + l->len, fname, len);
+            l->len += len;
+        }
+    }
+    free(fname);
+    dirRefRelease(op->dir);
+    free(op->name);
+    free(op->path);
+    free(op);
+}
+
 void
 changeOwner( struct threadData *cur, char *exten, struct stat *f, 
         long fileCnt, /* directory only - count files in directory */
         long dirSz )  /* directory only - sum of files within directory */
 {
-   int stat;
-   char fname[FILENAME_MAX];
-
-   if ( f->st_uid == UID_orig ) {
-      csv_escape(cur->dname, fname);
-      if (stat = lchown(cur->dname, UID_new, GID_new))
-         fprintf(stderr, "could not chown %s\n", fname);
-      else {
-         fputs(fname, stdout);
-         fputc('\n', stdout);
-      }
+   struct dirFrame *fr = curFrame(cur);
+   struct chownOp *op;
+
+   if ( f->st_uid != UID_orig )
+      return;
+   if ( fr->ref == NULL && (fr->ref = dirRefOpen(fr->fd)) == NULL ) {
+      fprintf(stderr, "could not chown %s: %s\n", pwPath(cur), strerror(errno));
+      __sync_fetch_and_add(&mutFailed, 1);
+      return;
+   }
+   if ( (op = malloc(sizeof(struct chownOp))) == NULL ) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+   op->dir = dirRefHold(fr->ref);
+   op->name = cur->ename ? strdup(cur->ename) : NULL;
+   op->path = strdup(pwPath(cur));
+   op->old = *f;
+   pipelinePut(Mutator, op);
+}
+
+/* start the mutator pool; nthreads workers, at most inflight queued ops */
+void
+mutateStart( int nthreads, int inflight )
+{
+   if ( (MutLog = calloc(nthreads, sizeof(struct mutLog))) == NULL ) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
    }
+   Mutator = pipelineStart(nthreads, inflight, chownWork);
+}
+
+/* drain the mutators, flush the changed file log and report the counts */
+void
+mutateFinish( )
+{
+   int i;
+
+   pipelineFinish(Mutator);
+   for ( i = 0; i < Mutator->nthreads; i++ )
+      mutLogFlush(&MutLog[i]);
+   journalClose();
+   fprintf(stderr, "chown%s: %ld changed, %ld failed, walkers waited %ld times\n",
+           DRY_RUN ? " (dry run)" : "", mutChanged, mutFailed, Mutator->blocked);
+   for ( i = 0; i < 256; i++ )
+      if ( mutErrno[i] )
+         fprintf(stderr, "   %ld x %s\n", mutErrno[i], i ? strerror(i) : "other");
 }
 
 /*
  *  printStat this needs to be in a crital secion  (and it is!)
+ *  unless the output is --sorted, then records go to per walker buffers
  */
 void
 printStat( struct threadData *cur, char *exten, struct stat *f, 
@@ -97,27 +197,233 @@ printStat( struct threadData *cur, char *exten, struct stat *f,
         long dirSz )  /* directory only - sum of files within directory */
 {
    char out[FILENAME_MAX+FILENAME_MAX];
-   char fname[FILENAME_MAX];
-   char exten_csv[FILENAME_MAX];
+   char *path, *o;
+   struct dirFrame *fr = curFrame(cur);
    ino_t ino, pino;
    long depth;
+   size_t len, need;
 
-   csv_escape(cur->dname, fname);
-   if ( exten )
-      csv_escape(exten, exten_csv);
-   else
-      exten_csv[0] = '\0';
+   path = pwPath(cur);
+   /* paths have no length limit, only go to the heap for long ones */
+   need = PW_RECORD_MAX(strlen(path), exten ? strlen(exten) : 0);
+   o = ( need <= sizeof(out) ) ? out : malloc(need);
    if ( fileCnt != -1 ) {  /* directory */
-      ino = f->st_ino; pino = cur->pinode; depth = cur->depth - 1;}
+      ino = f->st_ino; pino = fr->pinode; depth = fr->depth - 1;}
    else {  /* Not a directory */
-      ino = f->st_ino; pino = cur->pstat.st_ino; depth = cur->depth; }
-   sprintf ( out, "%ju,%ju,%ld,\"%s\",\"%s\",%ld,%ld,%ld,%ld,%ld,%d,\"%07o\",%ld,%ld,%ld,%ld,%ld\n",
-            (uintmax_t)ino, (uintmax_t)pino, depth,
-            fname, exten_csv, (long)f->st_uid,
-            (long)f->st_gid, (long)f->st_size, (long)f->st_dev,
-            (long)f->st_blocks, (int)f->st_nlink,
-            (int)f->st_mode,
-            (long)f->st_atime, (long)f->st_mtime, (long)f->st_ctime, 
-            fileCnt, dirSz );
-    fputs( out, stdout );
+      ino = f->st_ino; pino = fr->st.ino; depth = fr->depth; }
+   len = pwRecord( o, ino, pino, depth, path, exten, f, fileCnt, dirSz,
+                   ROOT_ID ? fr->root : -1, NULL );
+   outputRecord( &cur->run, o, len, path, ino, f->st_dev );
+   if ( o != out )
+      free( o );
+}
+
+/*
+ * PostgreSQL binary COPY  --format=pgcopy
+ * Names are written as bytea with their exact bytes, nothing is escaped
+ * or dropped. Numbers are big endian int8, st_mode is int4.
+ */
+static void
+pgInt8( unsigned char **p, int64_t v )
+{
+   int i;
+
+   *(*p)++ = 0; *(*p)++ = 0; *(*p)++ = 0; *(*p)++ = 8;
+   for ( i = 56; i >= 0; i -= 8 )
+      *(*p)++ = (unsigned char)(v >> i);
+}
+
+static void
+pgBytes( unsigned char **p, const char *s, uint32_t len )
+{
+   *(*p)++ = len >> 24; *(*p)++ = len >> 16; *(*p)++ = len >> 8; *(*p)++ = len;
+   memcpy( *p, s, len );
+   *p += len;
+}
+
+void
+pgcopyHeader( )
+{
+   static const char sig[] = "PGCOPY\n\377\r\n";
+
+   fwrite( sig, 1, 11, stdout );
+   fwrite( "\0\0\0\0\0\0\0\0", 1, 8, stdout );  /* flags, extension length */
+}
+
+void
+pgcopyTrailer( )
+{
+   fwrite( "\377\377", 1, 2, stdout );
+}
+
+void
+printPgCopy( struct threadData *cur, char *exten, struct stat *f,
+        long fileCnt, /* directory only - count files in directory */
+        long dirSz )  /* directory only - sum of files within directory */
+{
+   unsigned char buf[FILENAME_MAX+512], *p, *o;
+   struct dirFrame *fr = curFrame(cur);
+   char *path = pwPath(cur);
+   size_t plen = strlen(path), elen = exten ? strlen(exten) : 0;
+   int64_t pino, depth;
+
+   if ( fileCnt != -1 ) {  /* directory */
+      pino = fr->pinode; depth = fr->depth - 1; }
+   else {
+      pino = fr->st.ino; depth = fr->depth; }
+   o = p = ( plen + elen + 256 < sizeof(buf) ) ? buf : malloc(plen + elen + 256);
+   *p++ = 0; *p++ = 17 + ROOT_ID;     /* field count */
+   pgInt8( &p, (int64_t)f->st_ino );
+   pgInt8( &p, pino );
+   pgInt8( &p, depth );
+   pgBytes( &p, path, plen );
+   pgBytes( &p, exten ? exten : "", elen );
+   pgInt8( &p, f->st_uid );
+   pgInt8( &p, f->st_gid );
+   pgInt8( &p, f->st_size );
+   pgInt8( &p, f->st_dev );
+   pgInt8( &p, f->st_blocks );
+   pgInt8( &p, f->st_nlink );
+   *p++ = 0; *p++ = 0; *p++ = 0; *p++ = 4;
+   *p++ = f->st_mode >> 24; *p++ = f->st_mode >> 16;
+   *p++ = f->st_mode >> 8;  *p++ = f->st_mode;
+   pgInt8( &p, f->st_atime );
+   pgInt8( &p, f->st_mtime );
+   pgInt8( &p, f->st_ctime );
+   pgInt8( &p, fileCnt );
+   pgInt8( &p, dirSz );
+   if ( ROOT_ID )
+      pgInt8( &p, fr->root );
+   outputRecord( &cur->run, o, p - o, path, f->st_ino, f->st_dev );
+   if ( o != buf )
+      free( o );
+}
+
+#ifdef HAVE_SQLITE
+/*
+ * SQLite  --format=sqlite DB
+ * Walkers queue a copy of each record; one writer thread owns the database
+ * and inserts through a prepared statement, committing every SQL_BATCH rows.
+ */
+#include <sqlite3.h>
+
+#define SQL_BATCH 200000
+
+struct sqlRec {
+   int64_t v[16];       /* every column except the names, in table order */
+   int  plen, elen;
+   char name[];         /* path then extension */
+   };
+
+static sqlite3 *sqlDB;
+static sqlite3_stmt *sqlInsert;
+static struct pipeline *sqlWriter;
+static long sqlRows;
+
+static void
+sqlExec( const char *sql )
+{
+   char *err = NULL;
+
+   if ( sqlite3_exec(sqlDB, sql, NULL, NULL, &err) != SQLITE_OK ) {
+      fprintf(stderr, "sqlite: %s: %s\n", sql, err);
+      exit(1);
+   }
+}
+
+static void
+sqlWork( void *item, int worker )
+{
+   struct sqlRec *r = (struct sqlRec *) item;
+   int i, col;
+
+   if ( sqlRows % SQL_BATCH == 0 ) {
+      if ( sqlRows )
+         sqlExec("COMMIT");
+      sqlExec("BEGIN");
+   }
+   for ( i = 0, col = 1; i < 15 + ROOT_ID; i++, col++ ) {
+      if ( col == 4 ) col = 6;    /* filename, fileExtension */
+      sqlite3_bind_int64(sqlInsert, col, r->v[i]);
+   }
+   sqlite3_bind_text(sqlInsert, 4, r->name, r->plen, SQLITE_STATIC);
+   sqlite3_bind_text(sqlInsert, 5, r->name + r->plen, r->elen, SQLITE_STATIC);
+   if ( sqlite3_step(sqlInsert) != SQLITE_DONE )
+      fprintf(stderr, "sqlite insert: %s\n", sqlite3_errmsg(sqlDB));
+   sqlite3_reset(sqlInsert);
+   sqlRows++;
+   free(r);
+}
+
+void
+sqliteOpen( const char *db )
+{
+   char sql[512];
+
+   if ( sqlite3_open(db, &sqlDB) != SQLITE_OK ) {
+      fprintf(stderr, "sqlite: could not open %s: %s\n", db, sqlite3_errmsg(sqlDB));
+      exit(1);
+   }
+   sqlExec("PRAGMA journal_mode=OFF");
+   sqlExec("PRAGMA synchronous=OFF");
+   sprintf(sql, "CREATE TABLE IF NOT EXISTS pwalk (inode INTEGER, "
+           "parent_inode INTEGER, directory_depth INTEGER, filename TEXT, "
+           "fileExtension TEXT, UID INTEGER, GID INTEGER, st_size INTEGER, "
+           "st_dev INTEGER, st_blocks INTEGER, st_nlink INTEGER, "
+           "st_mode INTEGER, st_atime INTEGER, st_mtime INTEGER, "
+           "st_ctime INTEGER, pw_fcount INTEGER, pw_dirsum INTEGER%s)",
+           ROOT_ID ? ", root INTEGER" : "");
+   sqlExec(sql);
+   sprintf(sql, "INSERT INTO pwalk VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?%s)",
+           ROOT_ID ? ",?" : "");
+   if ( sqlite3_prepare_v2(sqlDB, sql, -1, &sqlInsert, NULL) != SQLITE_OK ) {
+      fprintf(stderr, "sqlite: %s\n", sqlite3_errmsg(sqlDB));
+      exit(1);
+   }
+   sqlWriter = pipelineStart(1, 65536, sqlWork);
+}
+
+void
+sqliteClose( )
+{
+   pipelineFinish(sqlWriter);
+   if ( sqlRows )
+      sqlExec("COMMIT");
+   sqlite3_finalize(sqlInsert);
+   sqlite3_close(sqlDB);
+   fprintf(stderr, "sqlite: %ld rows\n", sqlRows);
+}
+
+void
+printSqlite( struct threadData *cur, char *exten, struct stat *f,
+        long fileCnt, /* directory only - count files in directory */
+        long dirSz )  /* directory only - sum of files within directory */
+{
+   struct dirFrame *fr = curFrame(cur);
+   char *path = pwPath(cur);
+   int plen = strlen(path), elen = exten ? strlen(exten) : 0;
+   struct sqlRec *r;
+
+   if ( (r = malloc(sizeof(struct sqlRec) + plen + elen)) == NULL ) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+   r->v[0] = f->st_ino;
+   if ( fileCnt != -1 ) {  /* directory */
+      r->v[1] = fr->pinode; r->v[2] = fr->depth - 1; }
+   else {
+      r->v[1] = fr->st.ino; r->v[2] = fr->depth; }
+   r->v[3] = f->st_uid;     r->v[4] = f->st_gid;
+   r->v[5] = f->st_size;    r->v[6] = f->st_dev;
+   r->v[7] = f->st_blocks;  r->v[8] = f->st_nlink;
+   r->v[9] = f->st_mode;    r->v[10] = f->st_atime;
+   r->v[11] = f->st_mtime;  r->v[12] = f->st_ctime;
+   r->v[13] = fileCnt;      r->v[14] = dirSz;
+   r->v[15] = fr->root;
+   r->plen = plen; r->elen = elen;
+   memcpy(r->name, path, plen);
+   if ( elen )
+      memcpy(r->name + plen, exten, elen);
+   pipelinePut(sqlWriter, r);
 }
+#endif /* HAVE_SQLITE */
@@ -0,0 +1,415 @@
+/*
+ *  filter.c  select records inside pwalk with --where and --prune
+
+Copyright (C) (2013-2016) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+/*
+
+A filter expression is compiled once into a small stack program and run
+for every entry found by fileDir().
+
+    expr   := term { or term }
+    term   := factor { and factor }
+    factor := not factor | ( expr ) | field op value | field in ( value, ... )
+    op     := = != < <= > >=
+
+Numeric fields: uid gid size blocks nlink ino dev mode depth atime mtime ctime
+String fields:  name ext path type     (= and != match shell globs)
+
+Sizes take K M G T P suffixes (powers of 1024). A time field compared with
+a duration (s m h d w y suffix) compares the age of the file:
+"mtime > 90d" is true for files modified more than 90 days ago.
+
+    --where 'uid=1234 and mtime > 90d and size > 1G'
+    --where 'ext in (bam,cram)'
+    --prune 'name = .git or path = /proj/x/tmp*'
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "pwalk.h"
+
+enum { F_UID, F_GID, F_SIZE, F_BLOCKS, F_NLINK, F_INO, F_DEV, F_MODE,
+       F_DEPTH, F_ATIME, F_MTIME, F_CTIME, F_AAGE, F_MAGE, F_CAGE,
+       F_NAME, F_EXT, F_PATH, F_TYPE };
+
+static struct { char *name; int field; } fieldNames[] = {
+    {"uid", F_UID}, {"gid", F_GID}, {"size", F_SIZE}, {"blocks", F_BLOCKS},
+    {"nlink", F_NLINK}, {"ino", F_INO}, {"inode", F_INO}, {"dev", F_DEV},
+    {"mode", F_MODE}, {"depth", F_DEPTH}, {"atime", F_ATIME},
+    {"mtime", F_MTIME}, {"ctime", F_CTIME}, {"name", F_NAME},
+    {"ext", F_EXT}, {"path", F_PATH}, {"type", F_TYPE}, {NULL, 0} };
+
+enum { C_EQ, C_NE, C_LT, C_LE, C_GT, C_GE };
+
+enum { OP_TEST,         /* push result of a comparison */
+       OP_NOT,          /* invert top of stack */
+       OP_AND,          /* top false: jump, else pop and continue */
+       OP_OR };         /* top true: jump, else pop and continue */
+
+struct insn {
+    char op, field, cmp;
+    int  jump;          /* OP_AND, OP_OR target */
+    long long num;      /* numeric operand */
+    char *str;          /* string operand */
+    };
+
+struct filter {
+    struct insn *code;
+    int ncode, maxcode;
+    int depth;          /* stack needed to run the program */
+    };
+
+/* compiler state */
+static const char *expr, *pos;
+static struct filter *fp;
+static time_t now;
+
+static void
+fail( const char *msg )
+{
+    fprintf( stderr, "filter: %s at offset %d: '%s'\n", msg,
+             (int)(pos - expr), expr );
+    exit( 1 );
+}
+
+static int
+emit( int op )
+{
+    if ( fp->ncode == fp->maxcode ) {
+        fp->maxcode = fp->maxcode ? fp->maxcode * 2 : 32;
+        fp->code = realloc( fp->code, fp->maxcode * sizeof(struct insn) );
+        if ( fp->code == NULL )
+            fail( "out of memory" );
+    }
+    memset( &fp->code[fp->ncode], 0, sizeof(struct insn) );
+    fp->code[fp->ncode].op = op;
+    return fp->ncode++;
+}
+
+static void
+skipSpace( )
+{
+    while ( isspace( (unsigned char)*pos ) )
+        pos++;
+}
+
+/* next token is keyword kw (followed by a non word character) */
+static int
+keyword( const char *kw )
+{
+    size_t n = strlen( kw );
+
+    skipSpace( );
+    if ( strncasecmp( pos, kw, n ) || isalnum( (unsigned char)pos[n] ) ||
+         pos[n] == '_' )
+        return 0;
+    pos += n;
+    return 1;
+}
+
+static int
+punct( const char *p )
+{
+    size_t n = strlen( p );
+
+    skipSpace( );
+    if ( strncmp( pos, p, n ) )
+        return 0;
+    pos += n;
+    return 1;
+}
+
+/* a value; quoted string or a run of characters up to space , or ) */
+static char *
+word( )
+{
+    const char *s;
+    char *w, quote = 0;
+
+    skipSpace( );
+    if ( *pos == '"' || *pos == '\'' )
+        quote = *pos++;
+    s = pos;
+    if ( quote ) {
+        while ( *pos && *pos != quote )
+            pos++;
+        if ( !*pos )
+            fail( "unterminated string" );
+    } else
+        while ( *pos && !isspace( (unsigned char)*pos ) && *pos != ',' &&
+                *pos != '(' && *pos != ')' )
+            pos++;
+    if ( pos == s && !quote )
+        fail( "value expected" );
+    w = strndup( s, pos - s );
+    if ( quote )
+        pos++;
+    return w;
+}
+
+static int
+cmpOp( )
+{
+    if ( punct( "==" ) || punct( "=" ) ) return C_EQ;
+    if ( punct( "!=" ) ) return C_NE;
+    if ( punct( "<=" ) ) return C_LE;
+    if ( punct( ">=" ) ) return C_GE;
+    if ( punct( "<" ) )  return C_LT;
+    if ( punct( ">" ) )  return C_GT;
+    fail( "comparison expected" );
+    return -1;
+}
+
+/* compile one comparison; time fields compared with a duration become ages */
+static void
+compare( int field, int cmp )
+{
+    struct insn *in;
+    char *w, *end;
+    long long v;
+    int i;
+
+    w = word( );
+    i = emit( OP_TEST );
+    in = &fp->code[i];
+    in->cmp = cmp;
+    in->field = field;
+    if ( field >= F_NAME ) {
+        if ( cmp != C_EQ && cmp != C_NE )
+            fail( "only = and != compare names" );
+        if ( field == F_TYPE ) {
+            switch ( w[0] ) {
+            case 'f': in->num = S_IFREG; break;
+            case 'd': in->num = S_IFDIR; break;
+            case 'l': in->num = S_IFLNK; break;
+            case 'p': in->num = S_IFIFO; break;
+            case 's': in->num = S_IFSOCK; break;
+            case 'c': in->num = S_IFCHR; break;
+            case 'b': in->num = S_IFBLK; break;
+            default:  fail( "type is one of f d l p s c b" );
+            }
+            free( w );
+        } else
+            in->str = w;
+        return;
+    }
+    v = strtoll( w, &end, field == F_MODE ? 8 : 0 );
+    if ( end == w )
+        fail( "number expected" );
+    switch ( *end ) {
+    case '\0': break;
+    case 'K': v <<= 10; break;
+    case 'M': v <<= 20; break;
+    case 'G': v <<= 30; break;
+    case 'T': v <<= 40; break;
+    case 'P': v <<= 50; break;
+    case 's': case 'm': case 'h': case 'd': case 'w': case 'y':
+        if ( field < F_ATIME || field > F_CTIME )
+            fail( "durations only compare with atime mtime ctime" );
+        v *= *end == 's' ? 1 : *end == 'm' ? 60 : *end == 'h' ? 3600 :
+             *end == 'd' ? 86400 : *end == 'w' ? 7*86400 : 365*86400;
+        in->field = field - F_ATIME + F_AAGE;
+        break;
+    default:
+        fail( "bad number suffix" );
+    }
+    if ( *end && end[1] )
+        fail( "bad number suffix" );
+    in->num = v;
+    free( w );
+}
+
+static void orExpr( );
+
+static void
+factor( )
+{
+    int i, field = -1, j, n;
+
+    if ( keyword( "not" ) || punct( "!" ) ) {
+        factor( );
+        emit( OP_NOT );
+        return;
+    }
+    if ( punct( "(" ) ) {
+        orExpr( );
+        if ( !punct( ")" ) )
+            fail( "')' expected" );
+        return;
+    }
+    skipSpace( );
+    for ( i = 0; fieldNames[i].name; i++ )
+        if ( keyword( fieldNames[i].name ) ) {
+            field = fieldNames[i].field;
+            break;
+        }
+    if ( field == -1 )
+        fail( "field name expected" );
+    if ( !keyword( "in" ) ) {
+        compare( field, cmpOp( ) );
+        return;
+    }
+    /* field in (a, b, c) is field = a or field = b or field = c */
+    if ( !punct( "(" ) )
+        fail( "'(' expected after in" );
+    int jumps[256];
+    for ( n = 0; ; ) {
+        compare( field, C_EQ );
+        if ( punct( ")" ) )
+            break;
+        if ( !punct( "," ) )
+            fail( "',' or ')' expected" );
+        if ( n == 256 )
+            fail( "too many values" );
+        jumps[n++] = emit( OP_OR );
+    }
+    for ( j = 0; j < n; j++ )
+        fp->code[jumps[j]].jump = fp->ncode;
+}
+
+static void
+andExpr( )
+{
+    int j;
+
+    factor( );
+    while ( keyword( "and" ) || punct( "&&" ) ) {
+        j = emit( OP_AND );
+        factor( );
+        fp->code[j].jump = fp->ncode;
+    }
+}
+
+static void
+orExpr( )
+{
+    int j;
+
+    andExpr( );
+    while ( keyword( "or" ) || punct( "||" ) ) {
+        j = emit( OP_OR );
+        andExpr( );
+        fp->code[j].jump = fp->ncode;
+    }
+}
+
+/* compile expression; syntax errors are fatal like other bad arguments */
+struct filter *
+filterCompile( const char *s )
+{
+    int i, sp = 0;
+
+    if ( (fp = calloc( 1, sizeof(struct filter) )) == NULL )
+        fail( "out of memory" );
+    now = time( NULL );
+    expr = pos = s;
+    orExpr( );
+    skipSpace( );
+    if ( *pos )
+        fail( "unexpected text" );
+    for ( i = 0; i < fp->ncode; i++ ) {
+        if ( fp->code[i].op == OP_TEST ) sp++;
+        if ( sp > fp->depth ) fp->depth = sp;
+        if ( fp->code[i].op == OP_AND || fp->code[i].op == OP_OR ) sp--;
+    }
+    return fp;
+}
+
+static long long
+numField( int field, struct stat *f, long depth )
+{
+    switch ( field ) {
+    case F_UID:    return f->st_uid;
+    case F_GID:    return f->st_gid;
+    case F_SIZE:   return f->st_size;
+    case F_BLOCKS: return f->st_blocks;
+    case F_NLINK:  return f->st_nlink;
+    case F_INO:    return f->st_ino;
+    case F_DEV:    return f->st_dev;
+    case F_MODE:   return f->st_mode & 07777;
+    case F_DEPTH:  return depth;
+    case F_ATIME:  return f->st_atime;
+    case F_MTIME:  return f->st_mtime;
+    case F_CTIME:  return f->st_ctime;
+    case F_AAGE:   return now - f->st_atime;
+    case F_MAGE:   return now - f->st_mtime;
+    case F_CAGE:   return now - f->st_ctime;
+    }
+    return 0;
+}
+
+/*
+ * run the filter against one entry.  name is the base name, depth the
+ * directory-depth reported for the entry, path is only built when the
+ * expression asks for it.
+ */
+int
+filterMatch( struct filter *flt, struct threadData *t, const char *name,
+             const char *exten, struct stat *f, long depth )
+{
+    int stack[flt->depth + 1], sp = -1, pc, r = 0;
+    struct insn *in;
+    long long v;
+    const char *s;
+
+    for ( pc = 0; pc < flt->ncode; pc++ ) {
+        in = &flt->code[pc];
+        switch ( in->op ) {
+        case OP_TEST:
+            if ( in->field == F_TYPE )
+                r = (long long)(f->st_mode & S_IFMT) == in->num;
+            else if ( in->field >= F_NAME ) {
+                s = in->field == F_NAME ? name :
+                    in->field == F_EXT  ? (exten ? exten : "") : pwPath( t );
+                r = fnmatch( in->str, s, 0 ) == 0;
+            } else {
+                v = numField( in->field, f, depth );
+                switch ( in->cmp ) {
+                case C_EQ: r = v == in->num; break;
+                case C_NE: r = v != in->num; break;
+                case C_LT: r = v <  in->num; break;
+                case C_LE: r = v <= in->num; break;
+                case C_GT: r = v >  in->num; break;
+                case C_GE: r = v >= in->num; break;
+                }
+                stack[++sp] = r;
+                break;
+            }
+            stack[++sp] = in->cmp == C_NE ? !r : r;
+            break;
+        case OP_NOT:
+            stack[sp] = !stack[sp];
+            break;
+        case OP_AND:
+            if ( !stack[sp] ) pc = in->jump - 1; else sp--;
+            break;
+        case OP_OR:
+            if ( stack[sp] ) pc = in->jump - 1; else sp--;
+            break;
+        }
+    }
+    return stack[sp];
+}
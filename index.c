@@ -0,0 +1,275 @@
+/*
+ *  index.c  write a subtree index for pwalk-query  (pwalk --index FILE)
+
+Copyright (C) (2013-2016) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+/*
+
+Every walker keeps a list of the directories it finished with their own
+file count, bytes and blocks. Nothing is shared while walking. When the
+walk is done the lists are joined by directory id, laid out in DFS
+pre-order with cumulative totals and written to the index file.
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "pwalk.h"
+#include "pwindex.h"
+
+struct idxRec {
+    long   id, pid;             /* directory id, parent id (0 for root) */
+    ino_t  ino;
+    time_t mtime;
+    uid_t  uid;
+    gid_t  gid;
+    long   files, bytes, blocks;
+    size_t name, nlen;          /* in idxSlot names */
+    };
+
+struct idxSlot {
+    struct idxRec *rec;
+    long   n, max;
+    char  *names;
+    size_t nameLen, nameMax;
+    struct idxSlot *next;
+    };
+
+static struct idxSlot *idxSlots;        /* every walker that recorded */
+static pthread_mutex_t idxLock = PTHREAD_MUTEX_INITIALIZER;
+long dirIds;                            /* last directory id handed out */
+
+static void *
+xrealloc( void *p, size_t n )
+{
+    if ( (p = realloc( p, n )) == NULL ) {
+        fprintf( stderr, "index: out of memory\n" );
+        exit( 1 );
+    }
+    return p;
+}
+
+/* remember directory fi of walker t when fileDir is done with it */
+void
+indexRecord( struct threadData *t, int fi, long files, long bytes, long blocks )
+{
+    struct idxSlot *s = t->idx;
+    struct dirFrame *fr = &t->frame[fi];
+    struct idxRec *r;
+    char *name = t->names + fr->name, *p;
+    size_t nlen = fr->nlen;
+
+    if ( s == NULL ) {
+        s = t->idx = calloc( 1, sizeof(struct idxSlot) );
+        if ( s == NULL ) {
+            fprintf( stderr, "index: out of memory\n" );
+            exit( 1 );
+        }
+        pthread_mutex_lock( &idxLock );
+        s->next = idxSlots;
+        idxSlots = s;
+        pthread_mutex_unlock( &idxLock );
+    }
+    /* thread roots hold the full path, the index wants the last part */
+    if ( fr->pid && (p = memrchr( name, '/', nlen )) != NULL ) {
+        nlen -= p + 1 - name;
+        name = p + 1;
+    }
+    if ( s->n == s->max ) {
+        s->max = s->max ? s->max * 2 : 1024;
+        s->rec = xrealloc( s->rec, s->max * sizeof(struct idxRec) );
+    }
+    if ( s->nameLen + nlen > s->nameMax ) {
+        while ( s->nameLen + nlen > s->nameMax )
+            s->nameMax = s->nameMax ? s->nameMax * 2 : 16384;
+        s->names = xrealloc( s->names, s->nameMax );
+    }
+    r = &s->rec[s->n++];
+    r->id = fr->id;   r->pid = fr->pid;
+    r->ino = fr->st.ino;  r->mtime = fr->st.mtime;
+    r->uid = fr->st.uid;  r->gid = fr->st.gid;
+    r->files = files;
+    r->bytes = bytes + fr->st.size;
+    r->blocks = blocks + fr->st.blocks;
+    r->name = s->nameLen; r->nlen = nlen;
+    memcpy( s->names + s->nameLen, name, nlen );
+    s->nameLen += nlen;
+}
+
+static struct idxRec **byId;
+static char **nameOf;
+
+static int
+byName( const void *a, const void *b )
+{
+    const struct idxRec *x = byId[*(const long *)a], *y = byId[*(const long *)b];
+    size_t n = x->nlen < y->nlen ? x->nlen : y->nlen;
+    int c = memcmp( nameOf[x->id], nameOf[y->id], n );
+
+    return c ? c : (x->nlen > y->nlen) - (x->nlen < y->nlen);
+}
+
+static int
+byHash( const void *a, const void *b )
+{
+    const struct pwIndexHash *x = a, *y = b;
+
+    return (x->hash > y->hash) - (x->hash < y->hash);
+}
+
+/* join the walker lists and write the index; returns 0 or -1 */
+int
+indexWrite( const char *fname )
+{
+    struct idxSlot *s;
+    struct idxRec *r;
+    struct pwIndexHeader h;
+    struct pwIndexDir *dir;
+    struct pwIndexHash *hash;
+    long i, n = 0, *first, *child, *order, *stack, sp, c, k, id, p;
+    size_t *plen, pathMax = 4096, len, names = 0;
+    char *path;
+    FILE *fp;
+
+    byId = calloc( dirIds + 1, sizeof(struct idxRec *) );
+    nameOf = calloc( dirIds + 1, sizeof(char *) );
+    for ( s = idxSlots; s; s = s->next )
+        for ( i = 0; i < s->n; i++ ) {
+            byId[s->rec[i].id] = &s->rec[i];
+            nameOf[s->rec[i].id] = s->names + s->rec[i].name;
+            names += s->rec[i].nlen;
+            n++;
+        }
+    if ( n == 0 || byId[1] == NULL ) {
+        fprintf( stderr, "index: root directory was not walked\n" );
+        return -1;
+    }
+    /* children of every directory sorted by name; first[id] .. first[id+1] */
+    first = calloc( dirIds + 2, sizeof(long) );
+    child = xrealloc( NULL, n * sizeof(long) );
+    for ( id = 2; id <= dirIds; id++ )
+        if ( byId[id] && byId[byId[id]->pid] )
+            first[byId[id]->pid + 1]++;
+    for ( id = 1; id <= dirIds + 1; id++ )
+        first[id] += first[id - 1];
+    for ( id = 2; id <= dirIds; id++ )
+        if ( byId[id] && byId[byId[id]->pid] )
+            child[first[byId[id]->pid]++] = id;
+    for ( id = dirIds; id > 0; id-- )   /* first[] was moved up by one */
+        first[id] = first[id - 1];
+    first[0] = 0;
+    for ( id = 1; id <= dirIds; id++ )
+        qsort( child + first[id], first[id + 1] - first[id], sizeof(long), byName );
+
+    /* DFS pre-order; children are pushed in reverse to come out sorted */
+    dir = calloc( n, sizeof(struct pwIndexDir) );
+    hash = xrealloc( NULL, n * sizeof(struct pwIndexHash) );
+    order = xrealloc( NULL, n * sizeof(long) );
+    stack = xrealloc( NULL, 2 * n * sizeof(long) );
+    plen = xrealloc( NULL, n * sizeof(size_t) );
+    path = xrealloc( NULL, pathMax );
+    names = 0;
+    sp = 0; k = 0;
+    stack[sp++] = 1; stack[sp++] = -1;
+    while ( sp ) {
+        p = stack[--sp];                /* pre-order index of the parent */
+        id = stack[--sp];
+        r = byId[id];
+        order[k] = id;
+        dir[k].ino = r->ino;
+        dir[k].name = names;
+        dir[k].nlen = r->nlen;
+        dir[k].parent = p < 0 ? k : p;
+        dir[k].depth = p < 0 ? 0 : dir[p].depth + 1;
+        dir[k].mtime = r->mtime;
+        dir[k].uid = r->uid;  dir[k].gid = r->gid;
+        dir[k].files = dir[k].cfiles = r->files;
+        dir[k].bytes = dir[k].cbytes = r->bytes;
+        dir[k].blocks = dir[k].cblocks = r->blocks;
+        dir[k].cdirs = 1;
+        names += r->nlen;
+        /* path of the parent is always a prefix of the previous path */
+        len = p < 0 ? 0 : plen[p];
+        if ( len + r->nlen + 2 > pathMax ) {
+            while ( len + r->nlen + 2 > pathMax )
+                pathMax *= 2;
+            path = xrealloc( path, pathMax );
+        }
+        if ( p >= 0 && path[len - 1] != '/' )
+            path[len++] = '/';
+        memcpy( path + len, nameOf[id], r->nlen );
+        len += r->nlen;
+        if ( p < 0 )    /* root path is kept as given, without a trailing / */
+            while ( len > 1 && path[len - 1] == '/' )
+                len--;
+        plen[k] = len;
+        hash[k].hash = pwIndexHash( path, len );
+        hash[k].dir = k;
+        for ( c = first[id + 1] - 1; c >= first[id]; c-- ) {
+            stack[sp++] = child[c];
+            stack[sp++] = k;
+        }
+        k++;
+    }
+    n = k;
+    /* subtree end and cumulative totals, children before parents */
+    for ( k = 0; k < n; k++ )
+        dir[k].end = k + 1;
+    for ( k = n - 1; k > 0; k-- ) {
+        p = dir[k].parent;
+        if ( dir[k].end > dir[p].end )
+            dir[p].end = dir[k].end;
+        dir[p].cfiles += dir[k].cfiles;
+        dir[p].cbytes += dir[k].cbytes;
+        dir[p].cblocks += dir[k].cblocks;
+        dir[p].cdirs += dir[k].cdirs;
+    }
+    qsort( hash, n, sizeof(struct pwIndexHash), byHash );
+
+    memset( &h, 0, sizeof(h) );
+    memcpy( h.magic, PWINDEX_MAGIC, 8 );
+    h.ndirs = n;
+    h.dirOff = sizeof(h);
+    h.hashOff = h.dirOff + n * sizeof(struct pwIndexDir);
+    h.namesOff = h.hashOff + n * sizeof(struct pwIndexHash);
+    h.namesLen = names;
+    h.created = time( NULL );
+    if ( (fp = fopen( fname, "w" )) == NULL ) {
+        fprintf( stderr, "index: could not open %s: %s\n", fname, strerror(errno) );
+        return -1;
+    }
+    fwrite( &h, sizeof(h), 1, fp );
+    fwrite( dir, sizeof(struct pwIndexDir), n, fp );
+    fwrite( hash, sizeof(struct pwIndexHash), n, fp );
+    for ( k = 0; k < n; k++ )
+        fwrite( nameOf[order[k]], 1, dir[k].nlen, fp );
+    if ( fclose( fp ) ) {
+        fprintf( stderr, "index: write %s: %s\n", fname, strerror(errno) );
+        return -1;
+    }
+    free( byId ); free( nameOf ); free( first ); free( child );
+    free( dir ); free( hash ); free( order ); free( stack ); free( plen );
+    free( path );
+    return 0;
+}
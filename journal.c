@@ -0,0 +1,388 @@
+/*
+ *  journal.c  binary journal of applied changes and --rollback
+
+Copyright (C) (2013-2016) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+/*
+
+--journal FILE  every change a mutator made, with the old and new mode,
+uid and gid, the device and inode, and the path split into directory and
+entry name. Each mutator appends records to its own buffer and writes whole
+buffers to the O_APPEND file, so records never interleave and nothing is
+locked. A change is journaled after it was made; buffers are written when
+full and at the end of the run. A mutator holds its own lock from the
+change until it is journaled. On SIGINT or SIGTERM the handler only wakes
+a journal thread, which takes every mutator's lock, so none is between a
+change and its record and none starts another, writes the buffers and
+exits; a run stopped halfway can be rolled back completely.
+
+--rollback JOURNAL  read the journal, sort it by directory and newest change
+first, and hand one directory at a time to a pool of threads (pipeline.c).
+A directory is opened once and each entry is checked with fstatat: it must
+still be the same device and inode with the new mode, uid and gid of the
+journal, otherwise it changed since and is skipped; set-id bits are not
+compared when the owner changed, chown clears them. Ownership is restored
+before the mode.
+
+journal:  journalHeader, then journalRec, directory, name, ...
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "pipeline.h"
+
+#define JBUF_SIZE (64 * 1024)
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+struct jBuf {                   /* one per mutator */
+    pthread_mutex_t lock;       /* held from a change until it is journaled */
+    char   buf[JBUF_SIZE];
+    size_t len;
+    };
+
+static int JournalFd = -1;
+static struct jBuf *jBufs;
+static int nBufs;
+static uint64_t jSeq;
+static pthread_mutex_t jState = PTHREAD_MUTEX_INITIALIZER;
+static int jSigPipe[2];
+
+static void jFlush( struct jBuf *b );
+
+static void
+jSignal( int sig )
+{
+    unsigned char c = sig;
+
+    if ( write( jSigPipe[1], &c, 1 ) ) { }
+}
+
+/* stop the mutators where they are, write what they journaled and exit */
+static void *
+jSigThread( void *arg )
+{
+    unsigned char c;
+    int i;
+
+    while ( read( jSigPipe[0], &c, 1 ) != 1 )
+        ;
+    pthread_mutex_lock( &jState );
+    if ( JournalFd != -1 ) {
+        for ( i = 0; i < nBufs; i++ ) {
+            pthread_mutex_lock( &jBufs[i].lock );
+            jFlush( &jBufs[i] );
+        }
+        fsync( JournalFd );
+        fprintf( stderr, "journal: stopped by signal %d, changes so far are journaled\n", c );
+    }
+    signal( c, SIG_DFL );
+    raise( c );
+    return arg;
+}
+
+void
+journalOpen( const char *fname, int nworkers )
+{
+    struct journalHeader h;
+    struct sigaction sa;
+    pthread_t tid;
+    int i;
+
+    JournalFd = open( fname, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0600 );
+    if ( JournalFd == -1 ) {
+        fprintf( stderr, "could not open journal %s: %s\n", fname, strerror(errno) );
+        exit( 1 );
+    }
+    if ( (jBufs = calloc( nworkers, sizeof(struct jBuf) )) == NULL ) {
+        fprintf( stderr, "journal: out of memory\n" );
+        exit( 1 );
+    }
+    nBufs = nworkers;
+    for ( i = 0; i < nBufs; i++ )
+        pthread_mutex_init( &jBufs[i].lock, NULL );
+    memset( &h, 0, sizeof(h) );
+    memcpy( h.magic, JOURNAL_MAGIC, 8 );
+    h.created = time( NULL );
+    if ( write( JournalFd, &h, sizeof(h) ) != sizeof(h) ) {
+        fprintf( stderr, "write journal %s: %s\n", fname, strerror(errno) );
+        exit( 1 );
+    }
+    if ( pipe( jSigPipe ) || pthread_create( &tid, NULL, jSigThread, NULL ) ) {
+        fprintf( stderr, "journal: could not start the signal thread\n" );
+        exit( 1 );
+    }
+    pthread_detach( tid );
+    memset( &sa, 0, sizeof(sa) );
+    sa.sa_handler = jSignal;
+    sigemptyset( &sa.sa_mask );
+    sa.sa_flags = SA_RESTART;
+    sigaction( SIGINT, &sa, NULL );
+    sigaction( SIGTERM, &sa, NULL );
+}
+
+int
+journalActive( )
+{
+    return JournalFd != -1;
+}
+
+static void
+jFlush( struct jBuf *b )
+{
+    if ( b->len && write( JournalFd, b->buf, b->len ) != (ssize_t) b->len ) {
+        fprintf( stderr, "write journal: %s\n", strerror(errno) );
+        exit( 1 );
+    }
+    b->len = 0;
+}
+
+/* mutator worker is about to make a change; journalRelease once it is added */
+void
+journalHold( int worker )
+{
+    if ( JournalFd != -1 )
+        pthread_mutex_lock( &jBufs[worker].lock );
+}
+
+void
+journalRelease( int worker )
+{
+    if ( JournalFd != -1 )
+        pthread_mutex_unlock( &jBufs[worker].lock );
+}
+
+/* record a change made by mutator worker to path; old is the stat before */
+void
+journalAdd( int worker, const char *path, struct stat *old,
+            mode_t newMode, uid_t newUid, gid_t newGid )
+{
+    struct jBuf *b = &jBufs[worker];
+    struct journalRec *r;
+    const char *name = strrchr( path, '/' );
+    size_t dlen, nlen, need;
+
+    if ( JournalFd == -1 )
+        return;
+    if ( name == NULL ) {       /* relative to the current directory */
+        dlen = 0; name = path;
+    } else {                    /* "/x" is x in "/" */
+        dlen = name == path ? 1 : name - path; name++;
+    }
+    nlen = strlen( name );
+    need = sizeof(*r) + ALIGN8(dlen + 1) + ALIGN8(nlen + 1);
+    if ( dlen > UINT16_MAX || nlen > UINT16_MAX || need > JBUF_SIZE ) {
+        fprintf( stderr, "journal: path too long, not journaled: %s\n", path );
+        return;
+    }
+    if ( b->len + need > JBUF_SIZE )
+        jFlush( b );
+    r = (struct journalRec *)(b->buf + b->len);
+    memset( r, 0, need );
+    r->len = need;
+    r->dlen = dlen;
+    r->nlen = nlen;
+    r->seq = __sync_add_and_fetch( &jSeq, 1 );
+    r->dev = old->st_dev;
+    r->ino = old->st_ino;
+    r->oldMode = old->st_mode;  r->newMode = newMode;
+    r->oldUid = old->st_uid;    r->newUid = newUid;
+    r->oldGid = old->st_gid;    r->newGid = newGid;
+    memcpy( (char *)(r + 1), path, dlen );
+    memcpy( (char *)(r + 1) + ALIGN8(dlen + 1), name, nlen );
+    b->len += need;
+}
+
+/* after the mutators are done; write what is buffered */
+void
+journalClose( )
+{
+    int i;
+
+    if ( JournalFd == -1 )
+        return;
+    pthread_mutex_lock( &jState );
+    signal( SIGINT, SIG_DFL );
+    signal( SIGTERM, SIG_DFL );
+    for ( i = 0; i < nBufs; i++ )
+        jFlush( &jBufs[i] );
+    if ( fsync( JournalFd ) || close( JournalFd ) )
+        fprintf( stderr, "close journal: %s\n", strerror(errno) );
+    JournalFd = -1;
+    free( jBufs );
+    pthread_mutex_unlock( &jState );
+}
+
+/* rollback */
+static char *jData;             /* the whole journal */
+static long restored, skipped, failed;
+static int rbDryRun;
+
+struct rbGroup {                /* records of one directory */
+    size_t *off;
+    long   n;
+    };
+
+#define recDir(r)  ((char *)((r) + 1))
+#define recName(r) ((char *)((r) + 1) + ALIGN8((r)->dlen + 1))
+
+static int
+recCmp( const void *a, const void *b )
+{
+    struct journalRec *x = (struct journalRec *)(jData + *(const size_t *)a);
+    struct journalRec *y = (struct journalRec *)(jData + *(const size_t *)b);
+    int c = strcmp( recDir(x), recDir(y) );
+
+    if ( c )
+        return c;
+    return (x->seq < y->seq) - (x->seq > y->seq);     /* newest first */
+}
+
+static void
+rollbackWork( void *item, int worker )
+{
+    struct rbGroup *g = item;
+    struct journalRec *r = (struct journalRec *)(jData + g->off[0]);
+    const char *dir = r->dlen ? recDir(r) : ".";
+    struct stat st;
+    long i, done = 0, skip = 0, fail = 0;
+    mode_t mask;
+    int dirfd;
+
+    if ( (dirfd = open( dir, O_RDONLY|O_DIRECTORY|O_NOFOLLOW )) == -1 ) {
+        fprintf( stderr, "rollback: %s %s\n", dir, strerror(errno) );
+        __sync_add_and_fetch( &skipped, g->n );
+        free( g );
+        return;
+    }
+    for ( i = 0; i < g->n; i++ ) {
+        r = (struct journalRec *)(jData + g->off[i]);
+        /* a chown may have cleared the set-id bits */
+        mask = r->oldUid != r->newUid || r->oldGid != r->newGid ? ~06000 : ~0;
+        if ( fstatat( dirfd, recName(r), &st, AT_SYMLINK_NOFOLLOW ) == -1 ||
+             st.st_dev != r->dev || st.st_ino != r->ino ||
+             ((st.st_mode ^ r->newMode) & mask) || st.st_uid != r->newUid ||
+             st.st_gid != r->newGid ) {
+            fprintf( stderr, "rollback: skip %s/%s: changed since\n", dir, recName(r) );
+            skip++;
+            continue;
+        }
+        if ( rbDryRun ) {
+            done++;
+            continue;
+        }
+        if ( (r->oldUid != r->newUid || r->oldGid != r->newGid) &&
+             fchownat( dirfd, recName(r), r->oldUid, r->oldGid, AT_SYMLINK_NOFOLLOW ) ) {
+            fprintf( stderr, "rollback: chown %s/%s: %s\n", dir, recName(r), strerror(errno) );
+            fail++;
+            continue;
+        }
+        /* the mode too, chown clears set-id bits */
+        if ( !S_ISLNK(st.st_mode) &&
+             fchmodat( dirfd, recName(r), r->oldMode & 07777, 0 ) ) {
+            fprintf( stderr, "rollback: chmod %s/%s: %s\n", dir, recName(r), strerror(errno) );
+            fail++;
+            continue;
+        }
+        done++;
+    }
+    close( dirfd );
+    __sync_add_and_fetch( &restored, done );
+    __sync_add_and_fetch( &skipped, skip );
+    __sync_add_and_fetch( &failed, fail );
+    free( g );
+}
+
+/* undo the changes in journal fname with nthreads workers */
+void
+journalRollback( const char *fname, int nthreads, int dryRun )
+{
+    struct journalHeader *h;
+    struct journalRec *r;
+    struct rbGroup *g;
+    struct pipeline *pool;
+    struct stat st;
+    size_t *off = NULL, pos, len;
+    long n = 0, max = 0, i, j;
+    FILE *fp;
+
+    if ( (fp = fopen( fname, "r" )) == NULL || fstat( fileno(fp), &st ) ) {
+        fprintf( stderr, "could not open journal %s: %s\n", fname, strerror(errno) );
+        exit( 1 );
+    }
+    len = st.st_size;
+    if ( (jData = malloc( len + 1 )) == NULL ) {
+        fprintf( stderr, "journal: out of memory\n" );
+        exit( 1 );
+    }
+    h = (struct journalHeader *) jData;
+    if ( fread( jData, 1, len, fp ) != len || len < sizeof(*h) ||
+         memcmp( h->magic, JOURNAL_MAGIC, 8 ) ) {
+        fprintf( stderr, "%s is not a journal\n", fname );
+        exit( 1 );
+    }
+    fclose( fp );
+    for ( pos = sizeof(*h); pos + sizeof(*r) <= len; pos += r->len ) {
+        r = (struct journalRec *)(jData + pos);
+        if ( r->len < sizeof(*r) + ALIGN8(r->dlen + 1) + ALIGN8(r->nlen + 1) ||
+             pos + r->len > len ) {
+            fprintf( stderr, "journal %s is corrupt at %zu\n", fname, pos );
+            break;
+        }
+        if ( n == max ) {
+            max = max ? max * 2 : 4096;
+            if ( (off = realloc( off, max * sizeof(size_t) )) == NULL ) {
+                fprintf( stderr, "journal: out of memory\n" );
+                exit( 1 );
+            }
+        }
+        off[n++] = pos;
+    }
+    qsort( off, n, sizeof(size_t), recCmp );
+    rbDryRun = dryRun;
+    pool = pipelineStart( nthreads, nthreads * 4, rollbackWork );
+    for ( i = 0; i < n; i = j ) {
+        r = (struct journalRec *)(jData + off[i]);
+        for ( j = i + 1; j < n &&
+              !strcmp( recDir(r), recDir((struct journalRec *)(jData + off[j])) ); j++ )
+            ;
+        if ( (g = malloc( sizeof(*g) )) == NULL ) {
+            fprintf( stderr, "journal: out of memory\n" );
+            exit( 1 );
+        }
+        g->off = off + i;
+        g->n = j - i;
+        pipelinePut( pool, g );
+    }
+    pipelineFinish( pool );
+    fprintf( stderr, "rollback%s: %ld restored, %ld changed since and skipped, %ld failed\n",
+             dryRun ? " (dry run)" : "", restored, skipped, failed );
+    free( off );
+    free( jData );
+}
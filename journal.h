@@ -0,0 +1,39 @@
+/*
+ *  journal.h  binary journal of applied ownership and mode changes, and
+ *  the parallel rollback that undoes them; pwalk --chown_to and
+ *  repair-shared
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define JOURNAL_MAGIC "PWJRNL01"
+
+struct journalHeader {
+    char     magic[8];
+    int64_t  created;
+    };
+
+/* one change; the directory path and the entry name follow, 8 byte aligned */
+struct journalRec {
+    uint32_t len;               /* bytes in the record, header included */
+    uint16_t dlen, nlen;        /* directory path, entry name */
+    uint64_t seq;               /* order the changes were made */
+    uint64_t dev, ino;
+    uint32_t oldMode, newMode;
+    uint32_t oldUid, newUid;
+    uint32_t oldGid, newGid;
+    };
+
+void journalOpen( const char *fname, int nworkers );
+void journalHold( int worker );
+void journalRelease( int worker );
+void journalAdd( int worker, const char *path, struct stat *old,
+                 mode_t newMode, uid_t newUid, gid_t newGid );
+void journalClose( );
+int  journalActive( );
+void journalRollback( const char *fname, int nthreads, int dryRun );
+
+#endif /* JOURNAL_H */
@@ -0,0 +1,235 @@
+/*
+manifest.c  ppurge list of the files in a .ppurge directory
+
+Copyright (C) (2023) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; GPL version 3
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/*
+Every .ppurge directory that is not empty after a run gets a manifest of
+its files sorted by mtime, and the mtime of the directory when the
+manifest was written. The next run trusts the manifest only when the
+directory mtime is unchanged, so a user who moved a file out, or anything
+else that changed the directory, makes ppurge read the directory again.
+Files moved in by ppurge are added to the manifest before it is saved.
+
+.ppurge is mode 1777, so anybody can put a file there. A manifest is only
+read if it is a root owned regular file of mode 0600, and every name in
+it must be a plain name in .ppurge. It is written to a new temp file and
+renamed over the old one, never opened for writing where a user could
+have left something. The rename changes the directory mtime, so the
+directory is stat'ed after it and the header updated.
+
+file:   manHeader, entries sorted by mtime
+entry:  manEntryHdr, name, NUL, padded to 8 bytes
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ppurge.h"
+
+#define MAN_MAGIC "PPMAN001"
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+struct manHeader {
+    char     magic[8];
+    int64_t  sec, nsec;         /* mtime of .ppurge when written */
+    uint64_t n;
+    };
+
+struct manEntryHdr {
+    int64_t  mtime;
+    uint64_t ino;
+    uint32_t nlen;
+    uint32_t pad;
+    };
+
+struct manifest *
+manNew( )
+{
+    struct manifest *m = calloc( 1, sizeof(struct manifest) );
+
+    if ( m == NULL ) {
+        fprintf( stderr, "manifest: out of memory\n" );
+        exit( 1 );
+    }
+    return m;
+}
+
+void
+manAdd( struct manifest *m, const char *name, uint64_t ino, int64_t mtime )
+{
+    struct manEntry *e;
+
+    if ( m->n == m->max ) {
+        m->max = m->max ? m->max * 2 : 64;
+        if ( (m->e = realloc( m->e, m->max * sizeof(struct manEntry) )) == NULL ) {
+            fprintf( stderr, "manifest: out of memory\n" );
+            exit( 1 );
+        }
+    }
+    e = &m->e[m->n++];
+    e->name = strdup( name );
+    e->ino = ino;
+    e->mtime = mtime;
+}
+
+void
+manFree( struct manifest *m )
+{
+    long i;
+
+    if ( m == NULL )
+        return;
+    for ( i = 0; i < m->n; i++ )
+        free( m->e[i].name );
+    free( m->e );
+    free( m );
+}
+
+static int
+byMtime( const void *a, const void *b )
+{
+    const struct manEntry *x = a, *y = b;
+
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+void
+manSort( struct manifest *m )
+{
+    qsort( m->e, m->n, sizeof(struct manEntry), byMtime );
+}
+
+/* the manifest of .ppurge dirfd, NULL if there is none or dirMtime differs */
+struct manifest *
+manLoad( int dirfd, struct timespec *dirMtime )
+{
+    struct manHeader h;
+    struct manEntryHdr eh;
+    struct manifest *m;
+    struct stat st;
+    char name[FILENAME_MAX + 8];
+    FILE *fp;
+    int fd;
+    uint64_t i;
+
+    if ( (fd = openat( dirfd, MANIFEST, O_RDONLY|O_NOFOLLOW )) == -1 )
+        return NULL;
+    if ( fstat( fd, &st ) == -1 || !S_ISREG(st.st_mode) || st.st_uid != 0 ||
+         (st.st_mode & 07777) != 0600 || st.st_nlink != 1 ) {
+        PLOG( NULL, LOG_WARN, "%s is not ppurge's, ignored\n", MANIFEST );
+        close( fd );
+        return NULL;
+    }
+    if ( (fp = fdopen( fd, "r" )) == NULL ) {
+        close( fd );
+        return NULL;
+    }
+    if ( fread( &h, sizeof(h), 1, fp ) != 1 || memcmp( h.magic, MAN_MAGIC, 8 ) ||
+         h.sec != dirMtime->tv_sec || h.nsec != dirMtime->tv_nsec ) {
+        fclose( fp );
+        return NULL;
+    }
+    m = manNew( );
+    for ( i = 0; i < h.n; i++ ) {
+        if ( fread( &eh, sizeof(eh), 1, fp ) != 1 || eh.nlen >= FILENAME_MAX ||
+             fread( name, 1, ALIGN8(eh.nlen + 1), fp ) != ALIGN8(eh.nlen + 1) ) {
+            manFree( m );
+            fclose( fp );
+            return NULL;
+        }
+        name[eh.nlen] = '\0';
+        if ( !eh.nlen || strlen( name ) != eh.nlen || strchr( name, '/' ) ||
+             !strcmp( name, "." ) || !strcmp( name, ".." ) ) {
+            manFree( m );
+            fclose( fp );
+            return NULL;
+        }
+        manAdd( m, name, eh.ino, eh.mtime );
+    }
+    fclose( fp );
+    return m;
+}
+
+/* write m as the manifest of .ppurge dirfd; returns 0 or -1 */
+int
+manSave( struct manifest *m, int dirfd )
+{
+    struct manHeader h;
+    struct manEntryHdr eh;
+    struct stat st;
+    char pad[8] = { 0 };
+    FILE *fp;
+    int fd;
+    long i;
+
+    unlinkat( dirfd, MANIFEST_TMP, 0 );
+    if ( (fd = openat( dirfd, MANIFEST_TMP, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW,
+                       0600 )) == -1 )
+        return -1;
+    if ( fchown( fd, 0, 0 ) || fchmod( fd, 0600 ) ) {
+        close( fd );
+        unlinkat( dirfd, MANIFEST_TMP, 0 );
+        return -1;
+    }
+    if ( (fp = fdopen( fd, "w" )) == NULL ) {
+        close( fd );
+        return -1;
+    }
+    memset( &h, 0, sizeof(h) );
+    memcpy( h.magic, MAN_MAGIC, 8 );
+    h.n = m->n;
+    fwrite( &h, sizeof(h), 1, fp );
+    for ( i = 0; i < m->n; i++ ) {
+        memset( &eh, 0, sizeof(eh) );
+        eh.mtime = m->e[i].mtime;
+        eh.ino = m->e[i].ino;
+        eh.nlen = strlen( m->e[i].name );
+        fwrite( &eh, sizeof(eh), 1, fp );
+        fwrite( m->e[i].name, 1, eh.nlen, fp );
+        fwrite( pad, 1, ALIGN8(eh.nlen + 1) - eh.nlen, fp );
+    }
+    if ( fflush( fp ) || renameat( dirfd, MANIFEST_TMP, dirfd, MANIFEST ) ) {
+        fclose( fp );
+        unlinkat( dirfd, MANIFEST_TMP, 0 );
+        return -1;
+    }
+    /* the directory mtime once the manifest is in place */
+    if ( fstat( dirfd, &st ) == -1 ) {
+        fclose( fp );
+        unlinkat( dirfd, MANIFEST, 0 );
+        return -1;
+    }
+    h.sec = st.st_mtim.tv_sec;
+    h.nsec = st.st_mtim.tv_nsec;
+    if ( pwrite( fd, &h, sizeof(h), 0 ) != sizeof(h) || fclose( fp ) ) {
+        unlinkat( dirfd, MANIFEST, 0 );
+        return -1;
+    }
+    return 0;
+}
+
+void
+manRemove( int dirfd )
+{
+    if ( unlinkat( dirfd, MANIFEST, 0 ) == -1 && errno != ENOENT )
+        PLOG( NULL, LOG_ERROR, "unlink %s: %s\n", MANIFEST, strerror(errno) );
+}
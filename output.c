@@ -0,0 +1,516 @@
+/*
+ *  output.c  where pwalk records go; stdout, or sorted with --sorted
+
+Copyright (C) (2013-2016) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+/*
+
+--sorted=path|inode  bounded memory external sort
+
+Each walker appends records with their sort key to its own run buffer.
+A full buffer is sorted and spilled to an unlinked temp file. When the walk
+is done the remaining buffers are spilled and the runs are merged with a
+k-way heap merge; more than MERGE_FANIN runs are merged in passes so the
+number of open files and merge buffers stays bounded too. The memory for
+run buffers is --sort-mem MB shared by all walker slots.
+
+run entry:  uint32 key length, uint32 record length, key, record
+
+--max-buffer-mb MB  bounded output buffering
+
+Without it walkers write stdout themselves under the print lock, and a
+slow reader (gzip, ssh, a loader) leaves all but one of them waiting on
+that lock. With it each walker fills its own chunk and a full chunk is
+queued for one writer thread. Chunks being filled and chunks queued are
+all taken from the MB budget; a walker that needs a chunk when the
+budget is used up waits until the writer has written one. At the end the
+time walkers spent waiting is reported against the time they walked, and
+the writer's busy time against the run, which shows which side is slow.
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "pwalk.h"
+#include "perf.h"
+#include "trace.h"
+
+#define MERGE_FANIN 128
+
+int  SORTED = 0;                /* SORT_NONE, SORT_PATH, SORT_INODE */
+long SORT_MEM = 256;            /* MB for all run buffers */
+char *SORT_TMP = NULL;          /* directory for runs */
+FILE *OutFp = NULL;             /* stdout when NULL */
+long MAX_BUFFER = 0;            /* --max-buffer-mb, 0 writes directly */
+long WalkUs;                    /* time walkers spent walking */
+
+struct outChunk {
+    struct outChunk *next;
+    size_t len, max;
+    char   buf[];
+    };
+
+struct runBuf {
+    char   *buf;
+    size_t len, max;
+    size_t *off;                /* start of each entry in buf */
+    long   n, maxn;
+    struct outChunk *out;       /* --max-buffer-mb chunk being filled */
+    struct runBuf *next;
+    };
+
+static struct runBuf *runBufs;  /* every walker that sorted */
+static FILE **runs;             /* spilled runs waiting for the merge */
+static long nruns, maxruns;
+static pthread_mutex_t runLock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct outChunk *outHead, *outTail;     /* queued for the writer */
+static size_t outUsed, outChunkSize;           /* bytes of all chunks */
+static long outQueued, outWaits, outBlockedUs, outBusyUs, outStart;
+static int  outDone;
+static pthread_t outThread;
+static pthread_mutex_t outLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t outReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t outRoom = PTHREAD_COND_INITIALIZER;
+
+static void *
+xrealloc( void *p, size_t n )
+{
+    if ( (p = realloc( p, n )) == NULL ) {
+        fprintf( stderr, "sort: out of memory\n" );
+        exit( 1 );
+    }
+    return p;
+}
+
+static int
+keyCmp( const char *a, uint32_t alen, const char *b, uint32_t blen )
+{
+    int c = memcmp( a, b, alen < blen ? alen : blen );
+
+    return c ? c : (alen > blen) - (alen < blen);
+}
+
+static int
+entryCmp( const void *a, const void *b, void *arg )
+{
+    const char *x = (char *)arg + *(const size_t *)a;
+    const char *y = (char *)arg + *(const size_t *)b;
+    uint32_t xl, yl;
+
+    memcpy( &xl, x, 4 ); memcpy( &yl, y, 4 );
+    return keyCmp( x + 8, xl, y + 8, yl );
+}
+
+static FILE *
+runFile( )
+{
+    char name[FILENAME_MAX];
+    const char *dir = SORT_TMP ? SORT_TMP : getenv( "TMPDIR" );
+    int fd;
+    FILE *fp;
+
+    snprintf( name, sizeof(name), "%s/pwalk-run-XXXXXX", dir ? dir : "/tmp" );
+    if ( (fd = mkstemp( name )) == -1 || (fp = fdopen( fd, "w+" )) == NULL ) {
+        fprintf( stderr, "sort: temp file %s: %s\n", name, strerror(errno) );
+        exit( 1 );
+    }
+    unlink( name );
+    return fp;
+}
+
+static void
+addRun( FILE *fp )
+{
+    pthread_mutex_lock( &runLock );
+    if ( nruns == maxruns ) {
+        maxruns = maxruns ? maxruns * 2 : 64;
+        runs = xrealloc( runs, maxruns * sizeof(FILE *) );
+    }
+    runs[nruns++] = fp;
+    pthread_mutex_unlock( &runLock );
+}
+
+/* sort a walker's buffer and write it out as a run */
+static void
+spillRun( struct runBuf *r )
+{
+    FILE *fp;
+    uint32_t kl, rl;
+    long i;
+    char *e;
+
+    if ( r->n == 0 )
+        return;
+    qsort_r( r->off, r->n, sizeof(size_t), entryCmp, r->buf );
+    fp = runFile( );
+    for ( i = 0; i < r->n; i++ ) {
+        e = r->buf + r->off[i];
+        memcpy( &kl, e, 4 ); memcpy( &rl, e + 4, 4 );
+        if ( fwrite( e, 1, 8 + kl + rl, fp ) != 8 + kl + rl ) {
+            fprintf( stderr, "sort: write run: %s\n", strerror(errno) );
+            exit( 1 );
+        }
+    }
+    fflush( fp );
+    rewind( fp );
+    addRun( fp );
+    r->len = 0;
+    r->n = 0;
+}
+
+static long
+nowUs( )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void *
+outWriter( void *arg )
+{
+    FILE *fp = OutFp ? OutFp : stdout;
+    struct outChunk *c;
+    long t0, tt;
+
+    traceThread( MAXTHRDS );
+    pthread_mutex_lock( &outLock );
+    for ( ;; ) {
+        while ( outHead == NULL && !outDone )
+            pthread_cond_wait( &outReady, &outLock );
+        if ( (c = outHead) == NULL )
+            break;
+        if ( (outHead = c->next) == NULL )
+            outTail = NULL;
+        pthread_mutex_unlock( &outLock );
+        t0 = nowUs( );
+        tt = traceNow( );
+        if ( fwrite( c->buf, 1, c->len, fp ) != c->len ) {
+            fprintf( stderr, "output: write: %s\n", strerror(errno) );
+            exit( 1 );
+        }
+        traceSpan( "output", "write", tt, 0, -1, c->len );
+        pthread_mutex_lock( &outLock );
+        outBusyUs += nowUs( ) - t0;
+        outUsed -= c->max;
+        pthread_cond_broadcast( &outRoom );
+        free( c );
+    }
+    pthread_mutex_unlock( &outLock );
+    return NULL;
+}
+
+/* start the writer thread for --max-buffer-mb */
+void
+outputStart( )
+{
+    int error;
+
+    /* every walker can hold a chunk and the queue still has room */
+    outChunkSize = (MAX_BUFFER << 20) / (2 * MAXTHRDS);
+    if ( outChunkSize > 256 * 1024 )
+        outChunkSize = 256 * 1024;
+    if ( outChunkSize < 4096 )
+        outChunkSize = 4096;
+    fflush( OutFp ? OutFp : stdout );
+    outStart = nowUs( );
+    if ( (error = pthread_create( &outThread, NULL, outWriter, NULL )) ) {
+        fprintf( stderr, "output: writer thread: %s\n", strerror(error) );
+        exit( 1 );
+    }
+}
+
+static void
+outQueue( struct outChunk *c )
+{
+    pthread_mutex_lock( &outLock );
+    c->next = NULL;
+    if ( outTail )
+        outTail->next = c;
+    else
+        outHead = c;
+    outTail = c;
+    outQueued++;
+    pthread_cond_signal( &outReady );
+    pthread_mutex_unlock( &outLock );
+}
+
+/* a chunk of at least len bytes; waits while the budget is used up */
+static struct outChunk *
+outChunk( size_t len )
+{
+    size_t max = len > outChunkSize ? len : outChunkSize;
+    struct outChunk *c;
+    long t0, tt, p0 = perfStart( );
+
+    pthread_mutex_lock( &outLock );
+    if ( outUsed && outUsed + max > (size_t)(MAX_BUFFER << 20) ) {
+        t0 = nowUs( );
+        tt = traceNow( );
+        outWaits++;
+        while ( outUsed && outUsed + max > (size_t)(MAX_BUFFER << 20) )
+            pthread_cond_wait( &outRoom, &outLock );
+        outBlockedUs += nowUs( ) - t0;
+        traceSpan( "output", "wait for room", tt, 0, -1, 0 );
+    }
+    outUsed += max;
+    pthread_mutex_unlock( &outLock );
+    perfAdd( PERF_OUTPUT, p0, -1, 0 );
+    c = xrealloc( NULL, sizeof(struct outChunk) + max );
+    c->len = 0;
+    c->max = max;
+    return c;
+}
+
+/* --max-buffer-mb: append to the walker's chunk, queue it when full */
+static void
+bufferRecord( struct runBuf **run, const void *rec, size_t len )
+{
+    struct runBuf *r = *run;
+
+    if ( r == NULL ) {
+        r = *run = calloc( 1, sizeof(struct runBuf) );
+        if ( r == NULL ) {
+            fprintf( stderr, "output: out of memory\n" );
+            exit( 1 );
+        }
+        pthread_mutex_lock( &runLock );
+        r->next = runBufs;
+        runBufs = r;
+        pthread_mutex_unlock( &runLock );
+    }
+    if ( r->out && r->out->len + len > r->out->max ) {
+        outQueue( r->out );
+        r->out = NULL;
+    }
+    if ( r->out == NULL )
+        r->out = outChunk( len );
+    memcpy( r->out->buf + r->out->len, rec, len );
+    r->out->len += len;
+}
+
+/*
+ * Write one record.  path and ino are the sort keys, the record itself is
+ * opaque so any output format can be sorted.
+ */
+void
+outputRecord( struct runBuf **run, const void *rec, size_t len,
+              const char *path, uint64_t ino, uint64_t dev )
+{
+    struct runBuf *r = SORTED ? *run : NULL;
+    char key[16], *e;
+    const char *k;
+    uint32_t kl, rl = len;
+    size_t need;
+    int i;
+    long t0;
+
+    if ( !SORTED ) {
+        if ( MAX_BUFFER && run )
+            bufferRecord( run, rec, len );
+        else {
+            t0 = perfStart( );
+            fwrite( rec, 1, len, OutFp ? OutFp : stdout );
+            perfAdd( PERF_OUTPUT, t0, -1, 0 );
+        }
+        return;
+    }
+    if ( r == NULL ) {
+        r = *run = calloc( 1, sizeof(struct runBuf) );
+        if ( r == NULL ) {
+            fprintf( stderr, "sort: out of memory\n" );
+            exit( 1 );
+        }
+        r->max = (SORT_MEM << 20) / MAXTHRDS;
+        r->buf = xrealloc( NULL, r->max );
+        pthread_mutex_lock( &runLock );
+        r->next = runBufs;
+        runBufs = r;
+        pthread_mutex_unlock( &runLock );
+    }
+    if ( SORTED == SORT_PATH ) {
+        k = path; kl = strlen( path );
+    } else {    /* big endian inode then device sorts with memcmp */
+        for ( i = 0; i < 8; i++ ) {
+            key[i] = ino >> (56 - 8*i);
+            key[8+i] = dev >> (56 - 8*i);
+        }
+        k = key; kl = 16;
+    }
+    need = 8 + kl + rl;
+    if ( r->len + need > r->max ) {
+        spillRun( r );
+        if ( need > r->max ) {  /* a record bigger than the buffer */
+            r->max = need;
+            r->buf = xrealloc( r->buf, r->max );
+        }
+    }
+    if ( r->n == r->maxn ) {
+        r->maxn = r->maxn ? r->maxn * 2 : 4096;
+        r->off = xrealloc( r->off, r->maxn * sizeof(size_t) );
+    }
+    e = r->buf + r->len;
+    memcpy( e, &kl, 4 ); memcpy( e + 4, &rl, 4 );
+    memcpy( e + 8, k, kl );
+    memcpy( e + 8 + kl, rec, rl );
+    r->off[r->n++] = r->len;
+    r->len += need;
+}
+
+struct cursor {
+    FILE *fp;
+    uint32_t kl, rl;
+    char *e;
+    size_t max;
+    };
+
+static int
+cursorNext( struct cursor *c )
+{
+    char hdr[8];
+
+    if ( fread( hdr, 1, 8, c->fp ) != 8 )
+        return 0;
+    memcpy( &c->kl, hdr, 4 ); memcpy( &c->rl, hdr + 4, 4 );
+    if ( 8 + c->kl + c->rl > c->max ) {
+        c->max = 8 + c->kl + c->rl;
+        c->e = xrealloc( c->e, c->max );
+    }
+    memcpy( c->e, hdr, 8 );
+    if ( fread( c->e + 8, 1, c->kl + c->rl, c->fp ) != c->kl + c->rl ) {
+        fprintf( stderr, "sort: short run\n" );
+        exit( 1 );
+    }
+    return 1;
+}
+
+static int
+cursorCmp( struct cursor *a, struct cursor *b )
+{
+    return keyCmp( a->e + 8, a->kl, b->e + 8, b->kl );
+}
+
+/* merge runs[0..n-1] into out; whole entries, or just records when final */
+static void
+mergeRuns( FILE **in, long n, FILE *out, int final )
+{
+    struct cursor *c = calloc( n, sizeof(struct cursor) ), **heap, *t;
+    long i, hn = 0, j, m;
+
+    heap = xrealloc( NULL, n * sizeof(struct cursor *) );
+    for ( i = 0; i < n; i++ ) {
+        c[i].fp = in[i];
+        setvbuf( in[i], NULL, _IOFBF, 1 << 16 );
+        if ( !cursorNext( &c[i] ) )
+            continue;
+        /* sift up */
+        for ( j = hn++; j > 0 && cursorCmp( &c[i], heap[(j-1)/2] ) < 0; j = (j-1)/2 )
+            heap[j] = heap[(j-1)/2];
+        heap[j] = &c[i];
+    }
+    while ( hn ) {
+        t = heap[0];
+        if ( final )
+            fwrite( t->e + 8 + t->kl, 1, t->rl, out );
+        else
+            fwrite( t->e, 1, 8 + t->kl + t->rl, out );
+        if ( !cursorNext( t ) ) {
+            fclose( t->fp );
+            t = heap[--hn];
+        }
+        /* sift down */
+        for ( j = 0; (m = 2*j + 1) < hn; j = m ) {
+            if ( m + 1 < hn && cursorCmp( heap[m+1], heap[m] ) < 0 )
+                m++;
+            if ( cursorCmp( heap[m], t ) >= 0 )
+                break;
+            heap[j] = heap[m];
+        }
+        if ( hn )
+            heap[j] = t;
+    }
+    for ( i = 0; i < n; i++ )
+        free( c[i].e );
+    free( c );
+    free( heap );
+}
+
+/* spill what is left, merge all runs and write the sorted stream */
+void
+outputFinish( )
+{
+    struct runBuf *r;
+    FILE *fp;
+    long i, n;
+
+    if ( !SORTED && MAX_BUFFER ) {
+        for ( r = runBufs; r; r = r->next )
+            if ( r->out ) {
+                outQueue( r->out );
+                r->out = NULL;
+            }
+        pthread_mutex_lock( &outLock );
+        outDone = 1;
+        pthread_cond_signal( &outReady );
+        pthread_mutex_unlock( &outLock );
+        pthread_join( outThread, NULL );
+        fflush( OutFp ? OutFp : stdout );
+        fprintf( stderr, "output: %ld chunks of %ld KiB in %.1f s, writer busy"
+                 " %.1f s; walkers waited %ld times for %.1f s of %.1f s"
+                 " walking (%.0f%%)\n", outQueued, (long)outChunkSize >> 10,
+                 (nowUs( ) - outStart) / 1e6, outBusyUs / 1e6, outWaits,
+                 outBlockedUs / 1e6, WalkUs / 1e6,
+                 WalkUs ? 100.0 * outBlockedUs / WalkUs : 0 );
+        return;
+    }
+    if ( !SORTED ) {
+        fflush( OutFp ? OutFp : stdout );
+        return;
+    }
+    for ( r = runBufs; r; r = r->next )
+        spillRun( r );
+    /* free the run buffers before the merge needs memory */
+    for ( r = runBufs; r; r = r->next ) {
+        free( r->buf ); free( r->off );
+        r->buf = NULL; r->off = NULL;
+    }
+    while ( nruns > MERGE_FANIN ) {
+        for ( i = 0, n = 0; i < nruns; i += MERGE_FANIN ) {
+            fp = runFile( );
+            mergeRuns( runs + i, nruns - i < MERGE_FANIN ? nruns - i :
+                       MERGE_FANIN, fp, 0 );
+            fflush( fp );
+            rewind( fp );
+            runs[n++] = fp;
+        }
+        nruns = n;
+    }
+    mergeRuns( runs, nruns, OutFp ? OutFp : stdout, 1 );
+    nruns = 0;
+    fflush( OutFp ? OutFp : stdout );
+}
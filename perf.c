@@ -0,0 +1,360 @@
+/*
+ *  perf.c  where the time of a walk went  (--perf-report)
+
+Copyright (C) (2013-2016) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+/*
+
+Every thread that times something gets its own set of histograms on the
+first call, so recording takes no lock and shares no cache line. A walker
+thread gives its set back with perfDone() when it exits and the next new
+thread takes it, so the number of sets is the most threads that ran at
+once, not the number of threads the walk created.
+
+A histogram is HDR style, log linear: values below 8 ns have a bucket
+each, above that every power of two is split into 8 buckets, so a
+percentile is within 12.5%. Every operation has a histogram overall, one
+per directory depth (the last one is that depth and deeper) and one for
+each of the first PERF_DEVS st_dev the thread saw.
+
+A walker thread is busy from its first timed call to perfDone(); the
+time it spent in lock and output waits is blocked, the rest of the slot
+time over the run is idle.
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/sysmacros.h>
+#include "perf.h"
+
+#define PERF_SUB     8
+#define PERF_BUCKETS (PERF_SUB + 40 * PERF_SUB)
+#define PERF_DEPTHS  16
+#define PERF_DEVS    8
+
+struct perfHist {
+    uint64_t count, sum, max;
+    uint32_t n[PERF_BUCKETS];
+    };
+
+struct perfSet {
+    struct perfHist op[PERF_OPS];
+    struct perfHist depth[PERF_OPS][PERF_DEPTHS];
+    struct perfHist dev[PERF_OPS][PERF_DEVS];
+    dev_t  devs[PERF_DEVS];
+    int    ndev;
+    long   start;               /* first timed call of the current thread */
+    long   busy, blocked;       /* of walker threads that are done */
+    int    walker;
+    struct perfSet *next, *free;
+    };
+
+int PERF = 0;
+
+static __thread struct perfSet *mySet;
+static struct perfSet *perfSets, *perfFree;     /* every set, sets to reuse */
+static pthread_mutex_t perfMutex = PTHREAD_MUTEX_INITIALIZER;
+static long perfT0;             /* first set, the start of the run */
+
+static const char *opName[PERF_OPS] = { "open", "readdir", "stat", "change",
+    "lock mutexFD", "lock print", "output" };
+
+static long
+now( )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+long
+perfStart( )
+{
+    return PERF ? now( ) : 0;
+}
+
+static struct perfSet *
+perfSet( long t )
+{
+    struct perfSet *s;
+
+    pthread_mutex_lock( &perfMutex );
+    if ( (s = perfFree) != NULL )
+        perfFree = s->free;
+    else {
+        if ( (s = calloc( 1, sizeof(struct perfSet) )) == NULL ) {
+            fprintf( stderr, "perf: out of memory\n" );
+            exit( 1 );
+        }
+        s->next = perfSets;
+        perfSets = s;
+        if ( perfT0 == 0 )
+            perfT0 = t;
+    }
+    pthread_mutex_unlock( &perfMutex );
+    s->start = t;
+    return s;
+}
+
+static int
+bucket( uint64_t v )
+{
+    int k;
+
+    if ( v < PERF_SUB )
+        return v;
+    k = 63 - __builtin_clzll( v );      /* 2^k <= v, k >= 3 */
+    if ( k - 3 >= 40 )
+        return PERF_BUCKETS - 1;
+    return PERF_SUB + (k - 3) * PERF_SUB + ((v >> (k - 3)) & (PERF_SUB - 1));
+}
+
+/* the highest value of bucket b */
+static uint64_t
+bucketTop( int b )
+{
+    int k;
+
+    if ( b < PERF_SUB )
+        return b;
+    k = (b - PERF_SUB) / PERF_SUB + 3;
+    return ((uint64_t)(PERF_SUB + (b - PERF_SUB) % PERF_SUB + 1) << (k - 3)) - 1;
+}
+
+static void
+histAdd( struct perfHist *h, uint64_t v )
+{
+    h->count++;
+    h->sum += v;
+    if ( v > h->max )
+        h->max = v;
+    h->n[bucket( v )]++;
+}
+
+void
+perfAdd( int op, long t0, long depth, dev_t dev )
+{
+    struct perfSet *s;
+    long t;
+    int i;
+
+    if ( t0 == 0 )
+        return;
+    t = now( );
+    if ( (s = mySet) == NULL )
+        s = mySet = perfSet( t0 );
+    histAdd( &s->op[op], t - t0 );
+    if ( op >= PERF_LOCK_FD )
+        s->blocked += t - t0;
+    if ( depth < 0 )
+        return;
+    histAdd( &s->depth[op][depth < PERF_DEPTHS ? depth : PERF_DEPTHS - 1], t - t0 );
+    for ( i = 0; i < s->ndev && s->devs[i] != dev; i++ )
+        ;
+    if ( i == s->ndev ) {
+        if ( i == PERF_DEVS )
+            return;
+        s->devs[s->ndev++] = dev;
+    }
+    histAdd( &s->dev[op][i], t - t0 );
+}
+
+void
+perfDone( )
+{
+    struct perfSet *s = mySet;
+
+    if ( s == NULL )
+        return;
+    s->busy += now( ) - s->start;
+    s->walker = 1;
+    mySet = NULL;
+    pthread_mutex_lock( &perfMutex );
+    s->free = perfFree;
+    perfFree = s;
+    pthread_mutex_unlock( &perfMutex );
+}
+
+struct dirent *
+perfReaddir( DIR *dirp, long depth, dev_t dev )
+{
+    long t0 = perfStart( );
+    struct dirent *d = readdir( dirp );
+
+    perfAdd( PERF_READDIR, t0, depth, dev );
+    return d;
+}
+
+int
+perfFstatat( int dfd, const char *name, struct stat *f, int flags,
+             long depth, dev_t dev )
+{
+    long t0 = perfStart( );
+    int r = fstatat( dfd, name, f, flags );
+
+    perfAdd( PERF_STAT, t0, depth, dev );
+    return r;
+}
+
+int
+perfOpenat( int dfd, const char *name, int flags, long depth, dev_t dev )
+{
+    long t0 = perfStart( );
+    int r = openat( dfd, name, flags );
+
+    perfAdd( PERF_OPEN, t0, depth, dev );
+    return r;
+}
+
+void
+perfLock( pthread_mutex_t *m, int op, long depth, dev_t dev )
+{
+    long t0 = perfStart( );
+
+    pthread_mutex_lock( m );
+    perfAdd( op, t0, depth, dev );
+}
+
+static void
+histMerge( struct perfHist *to, struct perfHist *h )
+{
+    int i;
+
+    to->count += h->count;
+    to->sum += h->sum;
+    if ( h->max > to->max )
+        to->max = h->max;
+    for ( i = 0; i < PERF_BUCKETS; i++ )
+        to->n[i] += h->n[i];
+}
+
+static uint64_t
+percentile( struct perfHist *h, double p )
+{
+    uint64_t want = h->count * p, seen = 0;
+    int i;
+
+    for ( i = 0; i < PERF_BUCKETS; i++ )
+        if ( (seen += h->n[i]) > want )
+            return bucketTop( i ) < h->max ? bucketTop( i ) : h->max;
+    return h->max;
+}
+
+/* nanoseconds, short */
+static char *
+dur( char *buf, double ns )
+{
+    if ( ns < 1e3 )
+        sprintf( buf, "%.0fns", ns );
+    else if ( ns < 1e6 )
+        sprintf( buf, "%.1fus", ns / 1e3 );
+    else if ( ns < 1e9 )
+        sprintf( buf, "%.1fms", ns / 1e6 );
+    else
+        sprintf( buf, "%.2fs", ns / 1e9 );
+    return buf;
+}
+
+static void
+histLine( const char *op, const char *by, struct perfHist *h )
+{
+    char a[32], b[32], c[32], d[32], e[32];
+
+    if ( h->count == 0 )
+        return;
+    fprintf( stderr, "%-13s %-10s %11llu %8s %8s %8s %8s %9s\n", op, by,
+             (unsigned long long)h->count, dur( a, percentile( h, 0.5 ) ),
+             dur( b, percentile( h, 0.9 ) ), dur( c, percentile( h, 0.99 ) ),
+             dur( d, h->max ), dur( e, h->sum ) );
+}
+
+/* merge every set and write the report to stderr; slots walker threads */
+void
+perfReport( int slots )
+{
+    struct perfSet *all, *s;
+    dev_t devs[64];
+    int ndev = 0, op, i, j;
+    long wall, busy = 0, blocked = 0, t;
+    char by[32];
+    struct perfHist (*devH)[64];
+
+    if ( !PERF )
+        return;
+    t = now( );
+    wall = perfT0 ? t - perfT0 : 0;
+    all = calloc( 1, sizeof(struct perfSet) );
+    devH = calloc( PERF_OPS, sizeof(*devH) );
+    if ( all == NULL || devH == NULL ) {
+        fprintf( stderr, "perf: out of memory\n" );
+        return;
+    }
+    for ( s = perfSets; s; s = s->next ) {
+        for ( op = 0; op < PERF_OPS; op++ ) {
+            histMerge( &all->op[op], &s->op[op] );
+            for ( i = 0; i < PERF_DEPTHS; i++ )
+                histMerge( &all->depth[op][i], &s->depth[op][i] );
+        }
+        for ( i = 0; i < s->ndev; i++ ) {
+            for ( j = 0; j < ndev && devs[j] != s->devs[i]; j++ )
+                ;
+            if ( j == ndev ) {
+                if ( ndev == 64 )
+                    continue;
+                devs[ndev++] = s->devs[i];
+            }
+            for ( op = 0; op < PERF_OPS; op++ )
+                histMerge( &devH[op][j], &s->dev[op][i] );
+        }
+        if ( s->walker ) {
+            busy += s->busy;
+            blocked += s->blocked;
+        }
+    }
+    fprintf( stderr, "perf: %.2f s, %d walker slots: busy %.1f%%, blocked %.1f%%,"
+             " idle %.1f%%\n", wall / 1e9, slots,
+             wall ? 100.0 * (busy - blocked) / ((double)wall * slots) : 0,
+             wall ? 100.0 * blocked / ((double)wall * slots) : 0,
+             wall ? 100.0 - 100.0 * busy / ((double)wall * slots) : 0 );
+    fprintf( stderr, "%-13s %-10s %11s %8s %8s %8s %8s %9s\n", "operation", "",
+             "count", "p50", "p90", "p99", "max", "total" );
+    for ( op = 0; op < PERF_OPS; op++ )
+        histLine( opName[op], "", &all->op[op] );
+    fprintf( stderr, "by depth\n" );
+    for ( op = 0; op < PERF_OPS; op++ )
+        for ( i = 0; i < PERF_DEPTHS; i++ ) {
+            sprintf( by, i < PERF_DEPTHS - 1 ? "depth %d" : "depth %d+", i );
+            histLine( opName[op], by, &all->depth[op][i] );
+        }
+    fprintf( stderr, "by st_dev\n" );
+    for ( op = 0; op < PERF_OPS; op++ )
+        for ( j = 0; j < ndev; j++ ) {
+            sprintf( by, "dev %u:%u", major( devs[j] ), minor( devs[j] ) );
+            histLine( opName[op], by, &devH[op][j] );
+        }
+    free( devH );
+    free( all );
+}
@@ -0,0 +1,36 @@
+/*
+ *  perf.h  --perf-report latency histograms; shared by pwalk, ppurge and
+ *  repair-shared
+ */
+#ifndef PERF_H
+#define PERF_H
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define PERF_OPEN        0      /* open, openat of a directory */
+#define PERF_READDIR     1
+#define PERF_STAT        2      /* lstat, fstatat */
+#define PERF_CHANGE      3      /* chown, chmod, rename, unlink, utimes */
+#define PERF_LOCK_FD     4      /* mutexFD, thread slots */
+#define PERF_LOCK_PRINT  5      /* mutexPrintStat */
+#define PERF_OUTPUT      6      /* writing records, waiting for buffer room */
+#define PERF_OPS         7
+
+extern int PERF;                /* --perf-report */
+
+long perfStart( );              /* 0 unless PERF */
+void perfAdd( int op, long t0, long depth, dev_t dev );
+void perfDone( );               /* a walker thread exits */
+void perfReport( int slots );
+
+/* the calls with their time added to op; depth -1 leaves the breakdown out */
+struct dirent *perfReaddir( DIR *dirp, long depth, dev_t dev );
+int perfFstatat( int dfd, const char *name, struct stat *f, int flags,
+                 long depth, dev_t dev );
+int perfOpenat( int dfd, const char *name, int flags, long depth, dev_t dev );
+void perfLock( pthread_mutex_t *m, int op, long depth, dev_t dev );
+
+#endif /* PERF_H */
@@ -0,0 +1,150 @@
+/*
+ *  pipeline.c  bounded work queue served by a pool of threads
+
+Copyright (C) (2013-2016) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pipeline.h"
+
+struct worker {
+    struct pipeline *p;
+    int id;
+    };
+
+static void
+*pipelineWorker( void *arg )
+{
+    struct worker *w = (struct worker *) arg;
+    struct pipeline *p = w->p;
+    void *item;
+
+    for ( ;; ) {
+        pthread_mutex_lock( &p->lock );
+        while ( p->count == 0 && !p->done )
+            pthread_cond_wait( &p->notEmpty, &p->lock );
+        if ( p->count == 0 ) {  /* done and drained */
+            pthread_mutex_unlock( &p->lock );
+            break;
+        }
+        item = p->ring[p->head];
+        p->head = (p->head + 1) % p->depth;
+        p->count--;
+        pthread_cond_signal( &p->notFull );
+        pthread_mutex_unlock( &p->lock );
+        (*p->work)( item, w->id );
+    }
+    free( w );
+    return NULL;
+}
+
+struct pipeline *
+pipelineStart( int nthreads, int depth, void (*work)( void *item, int worker ) )
+{
+    struct pipeline *p;
+    struct worker *w;
+    int i, error;
+
+    if ( nthreads < 1 ) nthreads = 1;
+    if ( depth < 1 ) depth = 1;
+    if ( (p = calloc( 1, sizeof(struct pipeline) )) == NULL ||
+         (p->ring = malloc( depth * sizeof(void *) )) == NULL ||
+         (p->threads = malloc( nthreads * sizeof(pthread_t) )) == NULL ) {
+        fprintf( stderr, "pipeline: out of memory\n" );
+        exit( 1 );
+    }
+    pthread_mutex_init( &p->lock, NULL );
+    pthread_cond_init( &p->notEmpty, NULL );
+    pthread_cond_init( &p->notFull, NULL );
+    p->depth = depth;
+    p->work = work;
+    p->nthreads = nthreads;
+    for ( i = 0; i < nthreads; i++ ) {
+        w = malloc( sizeof(struct worker) );
+        w->p = p; w->id = i;
+        if ( (error = pthread_create( &p->threads[i], NULL, pipelineWorker, w )) ) {
+            fprintf( stderr, "pipeline: pthread_create: %s\n", strerror(error) );
+            exit( 1 );
+        }
+    }
+    return p;
+}
+
+/* queue an item, wait while the pipeline is full */
+void
+pipelinePut( struct pipeline *p, void *item )
+{
+    pthread_mutex_lock( &p->lock );
+    if ( p->count == p->depth )
+        p->blocked++;
+    while ( p->count == p->depth )
+        pthread_cond_wait( &p->notFull, &p->lock );
+    p->ring[(p->head + p->count) % p->depth] = item;
+    p->count++;
+    pthread_cond_signal( &p->notEmpty );
+    pthread_mutex_unlock( &p->lock );
+}
+
+/* no more items; let the workers drain the queue and wait for them */
+void
+pipelineFinish( struct pipeline *p )
+{
+    int i;
+
+    pthread_mutex_lock( &p->lock );
+    p->done = 1;
+    pthread_cond_broadcast( &p->notEmpty );
+    pthread_mutex_unlock( &p->lock );
+    for ( i = 0; i < p->nthreads; i++ )
+        pthread_join( p->threads[i], NULL );
+}
+
+struct dirRef *
+dirRefOpen( int fd )
+{
+    struct dirRef *r;
+
+    if ( (r = malloc( sizeof(struct dirRef) )) == NULL )
+        return NULL;
+    if ( (r->fd = dup( fd )) == -1 ) {
+        free( r );
+        return NULL;
+    }
+    r->refs = 1;
+    return r;
+}
+
+struct dirRef *
+dirRefHold( struct dirRef *r )
+{
+    __sync_fetch_and_add( &r->refs, 1 );
+    return r;
+}
+
+void
+dirRefRelease( struct dirRef *r )
+{
+    if ( __sync_sub_and_fetch( &r->refs, 1 ) == 0 ) {
+        close( r->fd );
+        free( r );
+    }
+}
@@ -0,0 +1,44 @@
+/*
+ *  pipeline.h  bounded work queue served by a pool of threads
+ *
+ *  Walkers put items, worker threads take them and call work(item, worker).
+ *  pipelinePut() blocks while depth items are in flight, which bounds the
+ *  memory and the number of outstanding operations.
+ */
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+
+struct pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t  notEmpty, notFull;
+    void **ring;                /* queued items */
+    int  head, count, depth;
+    int  nthreads;
+    pthread_t *threads;
+    void (*work)( void *item, int worker );
+    int  done;                  /* no more items will be put */
+    long blocked;               /* puts that had to wait for room */
+    };
+
+struct pipeline *pipelineStart( int nthreads, int depth,
+                                void (*work)( void *item, int worker ) );
+void pipelinePut( struct pipeline *p, void *item );
+void pipelineFinish( struct pipeline *p );
+
+/*
+ * A directory fd shared by queued operations.  The walker closes its own
+ * DIR when it is done with it; queued operations hold a dup of the fd
+ * until the last one drops its reference.
+ */
+struct dirRef {
+    int fd;
+    int refs;
+    };
+
+struct dirRef *dirRefOpen( int fd );
+struct dirRef *dirRefHold( struct dirRef *r );
+void dirRefRelease( struct dirRef *r );
+
+#endif /* PIPELINE_H */
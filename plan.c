@@ -0,0 +1,344 @@
+/*
+plan.c  ppurge --plan FILE and --apply FILE
+
+Copyright (C) (2023) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; GPL version 3
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/*
+--plan walks without changing anything and writes what ppurge would do.
+Entries are grouped by directory: a group header with the path, inode and
+device of the directory, then one entry per file with the inode and mtime
+seen by the planner. Every walker builds the group of the directory it is
+reading and appends whole groups to the plan under a lock.
+
+--apply reads the groups and hands them to a pool of threads (pipeline.c).
+A group opens its directory once; the directory must still be the same
+inode and every file is checked with fstatat before it is renamed or
+unlinked. Anything that changed since the plan was written is skipped.
+A plan is only taken from root (main checks the real uid) and every size
+and name in it is checked before it is used: a group that does not fit
+or an entry name that is not a plain name in its directory ends the
+group.
+
+plan:   planHeader, then groups
+group:  planGroupHdr, path, planItem + name ..., each part 8 byte aligned
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ppurge.h"
+#include "pipeline.h"
+
+#define GROUP_MAX (1 << 20)     /* bytes before a group is written out */
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+struct planGroup {
+    char   *buf;                /* planGroupHdr, path, entries */
+    size_t len, max;
+    size_t hlen;                /* header and path */
+    };
+
+FILE *PlanFp;
+static pthread_mutex_t planLock = PTHREAD_MUTEX_INITIALIZER;
+static long applied, skipped;
+
+static void *
+xrealloc( void *p, size_t n )
+{
+    if ( (p = realloc( p, n )) == NULL ) {
+        fprintf( stderr, "plan: out of memory\n" );
+        exit( 1 );
+    }
+    return p;
+}
+
+void
+planOpen( const char *fname )
+{
+    struct planHeader h;
+
+    if ( (PlanFp = userOpen( fname )) == NULL ) {
+        fprintf( stderr, "could not open plan %s: %s\n", fname, strerror(errno) );
+        exit( 1 );
+    }
+    memset( &h, 0, sizeof(h) );
+    memcpy( h.magic, PLAN_MAGIC, 8 );
+    h.created = time( NULL );
+    h.ptime = Ptime;
+    h.rtime = Rtime;
+    fwrite( &h, sizeof(h), 1, PlanFp );
+}
+
+void
+planClose( )
+{
+    if ( PlanFp && fclose( PlanFp ) ) {
+        PLOG( NULL, LOG_ERROR, "write plan: %s\n", strerror(errno) );
+        exit( 1 );
+    }
+    PlanFp = NULL;
+}
+
+static void
+writeGroup( struct planGroup *g )
+{
+    struct planGroupHdr *h = (struct planGroupHdr *) g->buf;
+
+    h->len = g->len;
+    pthread_mutex_lock( &planLock );
+    if ( fwrite( g->buf, 1, g->len, PlanFp ) != g->len ) {
+        PLOG( NULL, LOG_ERROR, "write plan: %s\n", strerror(errno) );
+        exit( 1 );
+    }
+    pthread_mutex_unlock( &planLock );
+    g->len = g->hlen;           /* keep the directory for more entries */
+    h->n = 0;
+}
+
+/* start the group of directory cur->dname open on dirfd */
+void
+planGroup( struct threadData *cur, int dirfd )
+{
+    struct planGroup *g;
+    struct planGroupHdr *h;
+    struct stat st;
+    size_t plen = strlen( cur->dname );
+
+    planFlush( cur, 0 );
+    if ( fstat( dirfd, &st ) == -1 ) {
+        PLOG(cur->ring, LOG_ERROR, "plan fstat: %s %s\n", cur->dname, strerror(errno));
+        return;
+    }
+    g = cur->plan = calloc( 1, sizeof(struct planGroup) );
+    if ( g == NULL ) {
+        fprintf( stderr, "plan: out of memory\n" );
+        exit( 1 );
+    }
+    g->hlen = sizeof(struct planGroupHdr) + ALIGN8(plen + 1);
+    g->max = g->hlen + 4096;
+    g->buf = xrealloc( NULL, g->max );
+    memset( g->buf, 0, g->hlen );
+    h = (struct planGroupHdr *) g->buf;
+    h->ino = st.st_ino;
+    h->dev = st.st_dev;
+    h->depth = cur->depth;
+    h->plen = plen;
+    memcpy( h + 1, cur->dname, plen );
+    g->len = g->hlen;
+}
+
+/* plan type ('P' or 'R') for name in the current group */
+void
+planEntry( struct threadData *cur, char type, const char *name, struct stat *f )
+{
+    struct planGroup *g = cur->plan;
+    struct planItem *e;
+    size_t nlen = strlen( name ), need;
+
+    if ( g == NULL )
+        return;
+    need = sizeof(struct planItem) + ALIGN8(nlen + 1);
+    if ( g->len + need > g->max ) {
+        if ( g->len + need > GROUP_MAX && g->len > g->hlen )
+            writeGroup( g );
+        while ( g->len + need > g->max )
+            g->max *= 2;
+        g->buf = xrealloc( g->buf, g->max );
+    }
+    e = (struct planItem *)(g->buf + g->len);
+    memset( e, 0, need );
+    e->ino = f->st_ino;
+    e->mtime = f->st_mtime;
+    e->nlen = nlen;
+    e->type = type;
+    memcpy( e + 1, name, nlen );
+    g->len += need;
+    ((struct planGroupHdr *) g->buf)->n++;
+}
+
+/* write the current group; with PLAN_RMDIR even when it has no entries */
+void
+planFlush( struct threadData *cur, int flags )
+{
+    struct planGroup *g = cur->plan;
+
+    if ( g == NULL )
+        return;
+    ((struct planGroupHdr *) g->buf)->flags = flags;
+    if ( ((struct planGroupHdr *) g->buf)->n || flags )
+        writeGroup( g );
+    free( g->buf );
+    free( g );
+    cur->plan = NULL;
+}
+
+/*
+ * remove the .ppurge of group path cur->dname if it is empty; st is of the
+ * directory the group was applied to. The parent is opened without
+ * following a symlink and its .ppurge must be that same directory.
+ */
+static void
+rmPurgedir( struct threadData *cur, struct stat *st )
+{
+    struct stat f;
+    char *s = strrchr( cur->dname, '/' );
+    int pfd;
+
+    if ( s == NULL || strcmp( s + 1, ".ppurge" ) ) {
+        PLOG(cur->ring, LOG_ERROR, "apply: %s is not a .ppurge\n", cur->dname);
+        return;
+    }
+    *s = '\0';
+    pfd = open( s == cur->dname ? "/" : cur->dname, O_RDONLY|O_DIRECTORY|O_NOFOLLOW );
+    *s = '/';
+    if ( pfd == -1 || fstatat( pfd, ".ppurge", &f, AT_SYMLINK_NOFOLLOW ) == -1 ||
+         f.st_dev != st->st_dev || f.st_ino != st->st_ino ) {
+        PLOG(cur->ring, LOG_WARN, "apply: %s is not the planned directory\n", cur->dname);
+        if ( pfd != -1 )
+            close( pfd );
+        return;
+    }
+    if ( unlinkat( pfd, ".ppurge", AT_REMOVEDIR ) == -1 &&
+         errno != ENOTEMPTY && errno != EEXIST )
+        PLOG(cur->ring, LOG_ERROR, "rmdir %s: %s\n", cur->dname, strerror(errno));
+    close( pfd );
+}
+
+/* do one group; worker is the tdslot whose log ring and io_uring are used */
+static void
+applyGroup( void *item, int worker )
+{
+    struct planGroupHdr *h = item;
+    struct threadData *cur = &tdslot[worker];
+    struct planItem *e;
+    struct stat st, f;
+    char *p, *name, *end = (char *) item + h->len;
+    int dirfd, purgefd = -1;
+    time_t purgedir_atime;
+    long done = 0, skip = 0;
+    uint32_t i;
+
+    if ( h->plen >= sizeof(cur->dname) ||
+         ALIGN8((size_t)h->plen + 1) > h->len - sizeof(*h) ) {
+        PLOG(cur->ring, LOG_ERROR, "apply: a group of the plan is corrupt\n");
+        __sync_add_and_fetch( &skipped, h->n );
+        free( item );
+        return;
+    }
+    p = (char *) item + sizeof(*h) + ALIGN8(h->plen + 1);
+    memcpy( cur->dname, h + 1, h->plen );
+    cur->dname[h->plen] = '\0';
+    cur->depth = h->depth;
+    if ( (dirfd = open( cur->dname, O_RDONLY|O_DIRECTORY|O_NOFOLLOW )) == -1 ) {
+        PLOG(cur->ring, LOG_WARN, "apply: %s %s\n", cur->dname, strerror(errno));
+        __sync_add_and_fetch( &skipped, h->n );
+        free( item );
+        return;
+    }
+    if ( fstat( dirfd, &st ) == -1 || st.st_ino != h->ino || st.st_dev != h->dev ) {
+        PLOG(cur->ring, LOG_WARN, "apply: %s is not the planned directory\n", cur->dname);
+        __sync_add_and_fetch( &skipped, h->n );
+        close( dirfd );
+        free( item );
+        return;
+    }
+    for ( i = 0; i < h->n; i++ ) {
+        e = (struct planItem *) p;
+        name = (char *)(e + 1);
+        if ( (size_t)(end - p) < sizeof(*e) ||
+             (size_t)(end - name) < ALIGN8((size_t)e->nlen + 1) ||
+             name[e->nlen] || (e->type != 'P' && e->type != 'R') ||
+             !e->nlen || strlen( name ) != e->nlen || strchr( name, '/' ) ||
+             !strcmp( name, "." ) || !strcmp( name, ".." ) ) {
+            PLOG(cur->ring, LOG_ERROR, "apply: group %s is corrupt\n", cur->dname);
+            skip += h->n - i;
+            break;
+        }
+        p = name + ALIGN8(e->nlen + 1);
+        if ( fstatat( dirfd, name, &f, AT_SYMLINK_NOFOLLOW ) == -1 ||
+             f.st_ino != e->ino || f.st_mtime != e->mtime || S_ISDIR(f.st_mode) ) {
+            PLOG(cur->ring, LOG_INFO, "skip %s/%s: changed since plan\n", cur->dname, name);
+            skip++;
+            continue;
+        }
+        if ( e->type == 'P' && purgefd == -1 &&
+             (purgefd = create_ppurge( cur, dirfd, &purgedir_atime )) == -1 ) {
+            skip++;
+            continue;
+        }
+        snprintf( cur->dname + h->plen, sizeof(cur->dname) - h->plen, "/%s", name );
+        purgeAction( cur, e->type, dirfd, purgefd, name, &f );
+        cur->dname[h->plen] = '\0';
+        done++;
+    }
+    uringDrain( cur->uring );
+    if ( h->flags & PLAN_RMDIR )
+        rmPurgedir( cur, &st );
+    if ( purgefd != -1 )
+        close( purgefd );
+    close( dirfd );
+    __sync_add_and_fetch( &applied, done );
+    __sync_add_and_fetch( &skipped, skip );
+    free( item );
+}
+
+/* run the plan in fname with nthreads workers */
+void
+planApply( const char *fname, int nthreads )
+{
+    struct planHeader ph;
+    struct planGroupHdr h;
+    struct pipeline *pool;
+    FILE *fp;
+    char *g;
+
+    if ( (fp = fopen( fname, "r" )) == NULL ) {
+        fprintf( stderr, "could not open plan %s: %s\n", fname, strerror(errno) );
+        exit( 1 );
+    }
+    if ( fread( &ph, sizeof(ph), 1, fp ) != 1 || memcmp( ph.magic, PLAN_MAGIC, 8 ) ) {
+        fprintf( stderr, "%s is not a ppurge plan\n", fname );
+        exit( 1 );
+    }
+    PLOG( NULL, LOG_INFO, "apply plan %s written %s", fname,
+          ctime( (time_t *)&ph.created ) );
+    pool = pipelineStart( nthreads, nthreads * 4, applyGroup );
+    while ( fread( &h, sizeof(h), 1, fp ) == 1 ) {
+        if ( h.len < sizeof(h) ) {
+            PLOG( NULL, LOG_ERROR, "plan %s is corrupt\n", fname );
+            break;
+        }
+        g = xrealloc( NULL, h.len );
+        memcpy( g, &h, sizeof(h) );
+        if ( fread( g + sizeof(h), 1, h.len - sizeof(h), fp ) != h.len - sizeof(h) ) {
+            PLOG( NULL, LOG_ERROR, "plan %s is truncated\n", fname );
+            free( g );
+            break;
+        }
+        pipelinePut( pool, g );
+    }
+    pipelineFinish( pool );
+    fclose( fp );
+    plogFinish( );      /* the workers' records before the summary */
+    PLOG( NULL, LOG_INFO, "apply: %ld done, %ld changed since plan and skipped\n",
+          applied, skipped );
+}
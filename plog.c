@@ -0,0 +1,312 @@
+/*
+plog.c  ppurge logging; per thread rings drained by one writer thread
+
+Copyright (C) (2023) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; GPL version 3
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/*
+Every walker thread slot owns a ring. A walker appends records to its ring
+without taking a lock; the writer thread is the only reader of the rings
+and the only writer of stdout and the log file. P and R records are stored
+as binary stat fields plus the path and turned into CSV by the writer, so
+the walkers never format or escape anything. A full ring makes the walker
+wait for the writer; purge records are never dropped.
+
+record:  uint32 length (8 byte aligned, header included), uint32 kind, body
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "ppurge.h"
+#include "pwrecord.h"
+
+#define RING_SIZE (1 << 20)     /* bytes per thread, power of two */
+#define MSG_MAX   8192          /* longest message */
+
+#define KIND_PAD    0           /* skip to the start of the ring */
+#define KIND_MSG    1
+#define KIND_ACTION 2
+
+int  LogLevel = LOG_INFO;
+FILE *Logfd;
+
+struct logRing {
+    char   *buf;
+    size_t head;                /* bytes written, only the owner moves it */
+    size_t tail;                /* bytes consumed, only the writer moves it */
+    long   waits;               /* times the owner found the ring full */
+    };
+
+struct logHdr {
+    uint32_t len;
+    uint32_t kind;
+    };
+
+struct logMsg {
+    int    level;
+    };
+
+struct logAction {
+    char   type;                /* 'P' purged, 'R' removed, 'D' directory removed */
+    long   depth;
+    long   uid, gid, size, mode;
+    long   atime, mtime, ctime;
+    uint32_t plen;              /* path follows */
+    };
+
+static struct logRing *rings;
+static int nRings;
+static pthread_t writer;
+static int running, stopping;
+static pthread_mutex_t wakeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t syncLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *levelName[] = { "error", "warn", "info", "debug", "trace" };
+
+int
+plogLevel( const char *name )
+{
+    int i;
+
+    for ( i = 0; i <= LOG_TRACE; i++ )
+        if ( !strcmp( name, levelName[i] ) )
+            return i;
+    if ( *name >= '0' && *name <= '4' && !name[1] )
+        return *name - '0';
+    return -1;
+}
+
+struct logRing *
+plogRing( int slot )
+{
+    return rings && slot < nRings ? &rings[slot] : NULL;
+}
+
+/* turn one record into output; writer thread or synchronous callers */
+static void
+emit( uint32_t kind, char *body )
+{
+    struct logMsg *m;
+    struct logAction *a;
+    char path[FILENAME_MAX + 1], fname[2 * FILENAME_MAX + 1];
+
+    if ( kind == KIND_MSG ) {
+        m = (struct logMsg *) body;
+        fputs( (char *)(m + 1), m->level >= LOG_DEBUG ? stderr : Logfd );
+    } else if ( kind == KIND_ACTION ) {
+        a = (struct logAction *) body;
+        memcpy( path, a + 1, a->plen );
+        path[a->plen] = '\0';
+        csv_escape( path, fname );
+        printf( "%c,%ld,\"%s\",%ld,%ld,%ld,\"%07lo\",%ld,%ld,%ld\n",
+                a->type, a->depth, fname, a->uid, a->gid, a->size,
+                (unsigned long)a->mode, a->atime, a->mtime, a->ctime );
+    }
+}
+
+/* room for len body bytes in r; waits for the writer when r is full */
+static char *
+reserve( struct logRing *r, size_t *len )
+{
+    size_t need = (sizeof(struct logHdr) + *len + 7) & ~(size_t)7;
+    size_t off, room, total;
+    struct logHdr *h;
+
+    for ( ;; ) {
+        off = r->head & (RING_SIZE - 1);
+        room = RING_SIZE - off;                 /* to the end of buf */
+        total = room < need ? room + need : need;
+        if ( RING_SIZE - (r->head - __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE )) >= total )
+            break;
+        r->waits++;
+        pthread_cond_signal( &wake );
+        sched_yield( );
+    }
+    if ( room < need ) {        /* record would wrap, pad to the start */
+        h = (struct logHdr *)(r->buf + off);
+        h->len = room;
+        h->kind = KIND_PAD;
+        __atomic_store_n( &r->head, r->head + room, __ATOMIC_RELEASE );
+        off = 0;
+    }
+    *len = need;
+    return r->buf + off;
+}
+
+static void
+commit( struct logRing *r, char *rec, size_t len, uint32_t kind )
+{
+    struct logHdr *h = (struct logHdr *) rec;
+
+    h->len = len;
+    h->kind = kind;
+    __atomic_store_n( &r->head, r->head + len, __ATOMIC_RELEASE );
+}
+
+/* format a message at level; called through PLOG so level is enabled */
+void
+plogMsg( struct logRing *r, int level, const char *fmt, ... )
+{
+    char buf[sizeof(struct logMsg) + MSG_MAX], *rec, *s;
+    struct logMsg *m = (struct logMsg *) buf;
+    size_t n, len;
+    va_list ap;
+
+    m->level = level;
+    s = (char *)(m + 1);
+    va_start( ap, fmt );
+    n = vsnprintf( s, MSG_MAX, fmt, ap );
+    va_end( ap );
+    if ( n >= MSG_MAX )
+        n = MSG_MAX - 1;
+    len = sizeof(struct logMsg) + n + 1;
+    if ( r == NULL || !running ) {
+        pthread_mutex_lock( &syncLock );
+        emit( KIND_MSG, buf );
+        pthread_mutex_unlock( &syncLock );
+        return;
+    }
+    rec = reserve( r, &len );
+    memcpy( rec + sizeof(struct logHdr), buf, sizeof(struct logMsg) + n + 1 );
+    commit( r, rec, len, KIND_MSG );
+}
+
+/* P or R record for path with the stat of the file before the action */
+void
+plogAction( struct logRing *r, char type, long depth, const char *path,
+            struct stat *f )
+{
+    char buf[sizeof(struct logAction) + FILENAME_MAX + 1], *rec;
+    struct logAction *a = (struct logAction *) buf;
+    size_t len, plen = strlen( path );
+
+    if ( plen > FILENAME_MAX )
+        plen = FILENAME_MAX;
+    a->type = type;   a->depth = depth;
+    a->uid = f->st_uid;  a->gid = f->st_gid;
+    a->size = f->st_size;  a->mode = f->st_mode;
+    a->atime = f->st_atime;  a->mtime = f->st_mtime;  a->ctime = f->st_ctime;
+    a->plen = plen;
+    memcpy( a + 1, path, plen );
+    len = sizeof(struct logAction) + plen;
+    if ( r == NULL || !running ) {
+        pthread_mutex_lock( &syncLock );
+        emit( KIND_ACTION, buf );
+        pthread_mutex_unlock( &syncLock );
+        return;
+    }
+    rec = reserve( r, &len );
+    memcpy( rec + sizeof(struct logHdr), buf, sizeof(struct logAction) + plen );
+    commit( r, rec, len, KIND_ACTION );
+}
+
+/* drain every ring once; returns the number of records written */
+static long
+drain( )
+{
+    struct logRing *r;
+    struct logHdr *h;
+    size_t head;
+    long n = 0;
+    int i;
+
+    for ( i = 0; i < nRings; i++ ) {
+        r = &rings[i];
+        head = __atomic_load_n( &r->head, __ATOMIC_ACQUIRE );
+        while ( r->tail < head ) {
+            h = (struct logHdr *)(r->buf + (r->tail & (RING_SIZE - 1)));
+            emit( h->kind, (char *)(h + 1) );
+            __atomic_store_n( &r->tail, r->tail + h->len, __ATOMIC_RELEASE );
+            n++;
+        }
+    }
+    return n;
+}
+
+static void *
+writerThread( void *arg )
+{
+    struct timespec ts;
+    int stop;
+
+    for ( ;; ) {
+        stop = __atomic_load_n( &stopping, __ATOMIC_ACQUIRE );
+        if ( drain( ) )
+            continue;
+        if ( stop )
+            break;
+        fflush( stdout );
+        fflush( Logfd );
+        pthread_mutex_lock( &wakeLock );
+        clock_gettime( CLOCK_REALTIME, &ts );
+        ts.tv_nsec += 20000000;
+        if ( ts.tv_nsec >= 1000000000 ) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait( &wake, &wakeLock, &ts );
+        pthread_mutex_unlock( &wakeLock );
+    }
+    return NULL;
+}
+
+void
+plogStart( int nrings )
+{
+    int i, error;
+
+    rings = calloc( nrings, sizeof(struct logRing) );
+    for ( i = 0; i < nrings; i++ )
+        if ( rings == NULL || (rings[i].buf = malloc( RING_SIZE )) == NULL ) {
+            fprintf( stderr, "plog: out of memory\n" );
+            exit( 1 );
+        }
+    nRings = nrings;
+    if ( (error = pthread_create( &writer, NULL, writerThread, NULL )) ) {
+        fprintf( stderr, "plog: writer thread: %s\n", strerror(error) );
+        exit( 1 );
+    }
+    running = 1;
+}
+
+/* all walkers are done; write what is left and stop the writer */
+void
+plogFinish( )
+{
+    long waits = 0;
+    int i;
+
+    if ( !running )
+        return;
+    __atomic_store_n( &stopping, 1, __ATOMIC_RELEASE );
+    pthread_cond_signal( &wake );
+    pthread_join( writer, NULL );
+    running = 0;
+    for ( i = 0; i < nRings; i++ )
+        waits += rings[i].waits;
+    if ( waits )
+        PLOG( NULL, LOG_INFO, "log rings were full %ld times\n", waits );
+    fflush( stdout );
+    fflush( Logfd );
+}
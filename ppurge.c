@@ -29,6 +29,9 @@ along with this program; If not, see <https://www.gnu.org/licenses/>.
 #include <unistd.h>
 #include <fcntl.h>
 #include <utime.h>
+#include "ppurge.h"
+#include "pwrecord.h"
+#include "perf.h"
 
 /*  
 ppurge  Parallel Purge
@@ -59,13 +62,19 @@ should be a single volume that is not bridged.
 
 When the .ppurge directory is empty it will be removed.
 
-At present Ppurge does not remove directories. There are many structal
-directories in scatch systems which could be removed due to in activity.
-But not removing directories will leave many empty directory trees in
-scratch file systems. A feature for Deleting directories could be implemented
-with a directory level test. For scratch volumes with well defined directory
+There are many structal directories in scatch systems which could be removed
+due to in activity. Not removing directories leaves many empty directory
+trees in scratch file systems. For scratch volumes with well defined directory
 structure. '/scratch30/department/user/project/Purge at this level'
-if DEPTH > 4 purge directories
+--purge-dirs-below DEPTH removes empty directories deeper than DEPTH (the
+root is depth 0) in the same walk. Every directory has a node with a count
+of its own walk plus the subdirectories it handed out. Whoever brings the
+count to zero removes the directory with unlinkat(AT_REMOVEDIR) on a dup of
+the parent fd if it is empty and its mtime, as seen by the walk, is older
+than --dir-age days (default purgeDays), then counts down the parent. A
+directory that keeps anything keeps its parents. Removed directories are
+written with type 'D'. Whether a directory ends up empty is only known while
+files are removed, so it is not used with --plan or --apply.
 
 Output is written to stdout. Output is a list of all files that are purged or removed.
 Output is wirtten in CSV format. First character of each line is 'P' or 'R', for Purged or Removed.
@@ -74,9 +83,45 @@ Format of output:
 type, depth, fname, UID, GID, st_size, st_mode, atime, mtime, ctime
 
 ppurge creates a log file with the following name ppurge-YYYY.MM.DD-HH_MM_SS.log
+(-N.log for another run started in the same second)
 Internal error messages are written to the log file.
 
 A list of pathname with illegal characters are written to the log file
+
+--log-level error|warn|info|debug|trace  (default info) selects what is
+logged. debug and trace go to stderr, trace lists every entry walked.
+Walkers write log and P/R records to their own ring buffer and one writer
+thread formats them (plog.c); a level that is not enabled costs a compare.
+
+The renameat into .ppurge and the unlinkat of expired files are batched
+through a per thread io_uring (uring.c, Linux 5.11 or later) so many are in
+flight at once; the P and R records are written when they complete. Each
+directory is drained before it is closed. Without kernel support, or with
+--no-uring, the synchronous calls are used. --uring-depth sets the ring size.
+
+A .ppurge that is not empty after a run keeps a manifest, .ppurge-manifest,
+of its files sorted by mtime (manifest.c). While the mtime of .ppurge is
+what the manifest recorded only the expired head of the list is stat'ed and
+removed; otherwise the directory is read again and the manifest rebuilt.
+
+--plan FILE walks without changing anything and writes the renames and
+unlinks it would do to FILE, grouped by directory, with the inode and mtime
+of every file. --apply FILE does a plan with a pool of threads and skips
+anything that changed since the plan was written (plan.c). The scan can run
+on a read-only export and the apply on a node that can write. ppurge is
+setuid root, so both are refused unless the real uid is root.
+
+--report FILE writes the pwalk record of every entry the walk stat'ed to
+FILE, the printStat schema of pwalk with a header and an action column:
+P, R or D for what was done, empty when nothing was. Records come from the
+fstatat the purge already did and are written with the pwalk encoder and
+output (pwrecord.c, output.c), so one walk serves both the purge and the
+report. Files in .ppurge are one level below their directory. Unexpired
+files in a .ppurge with a manifest are only stat'ed for the report. With
+--plan the action column has what would be done.
+
+The log, report and plan files are created with the real uid's rights by
+userOpen; none of them may already exist or be a symlink.
 */
 
 static char *whoami = "ppurge";
@@ -86,40 +131,24 @@ static char *Version = "0.1.0 Aug 14 2023 John F Dey john@fuzzdog.com";
  0.1.0  Initial version. Code base copied from pwalk. Purging and reporting
         seems to difficult to perform in one walk of the tree. Purging
         will be a dedicated process.
+        --report puts the pwalk report back in the same walk.
 */
 
-#define DEBUG 2  // [0, 1, 2]
-
-#if defined(DEBUG) && DEBUG == 1
- #define DEBUG_1(fmt, args...) fprintf(stderr, "DEBUG: %s(): " fmt, __func__, ##args)
-#elif defined(DEBUG) && DEBUG == 2
- #define DEBUG_1(fmt, args...) fprintf(stderr, "DEBUG: %s(): " fmt, __func__, ##args)
- #define DEBUG_2(fmt, args...) fprintf(stderr, "DEBUG: %s(): " fmt, __func__, ##args)
-#else
- #define DEBUG_1(fmt, args...) /* Don't do anything in release builds */
- #define DEBUG_2(fmt, args...) /* Don't do anything in release builds */
-#endif
-
-FILE *Logfd;   /* error log */
 time_t Ptime;  /* Purge all files older than this time stamp (less than)*/
-time_t Rtime;  /* Remove all files older than this time stamp (Ptime * 2) */
-int DEPTH = 0; /* possible furture use for directory purging */
-
-struct threadData {
-    char dname[FILENAME_MAX+1]; /* full path and basename */
-    int dirfd;                  /* file pointer to directory*/
-    long depth;                 /* directory depth */
-    long THRDid;                /* unique ID increaments with each new THRD */
-    int  flag;                  /* 0 if thread; recursion > 0 */
-    pthread_t thread_id;        /* system assigned */
-    pthread_attr_t tattr;
-};
-
-#define MAXTHRDS 32
+time_t Rtime;  /* Remove all files older than this time stamp (2 * purgeDays) */
+int DEPTH = 0;          /* directories deeper than this may be removed */
+int PURGE_DIRS = 0;     /* --purge-dirs-below DEPTH */
+time_t Dtime;           /* remove directories with mtime older than this */
+int URING = 1;          /* batch mutations through io_uring */
+int URING_DEPTH = 64;   /* operations in flight per thread */
+char *APPLY = NULL;     /* --apply FILE */
+int REPORT = 0;         /* --report FILE */
+
 int ThreadCNT  = 1; /* ThreadCNT < MAXTHRDS */
 int totalTHRDS = 0;
 struct threadData tdslot[MAXTHRDS];
 pthread_mutex_t mutexFD;
+pthread_cond_t walkDone = PTHREAD_COND_INITIALIZER;
 
 void
 printVersion( ) {
@@ -140,128 +169,349 @@ printHelp()
     printf("ppurge should be run daly on volumes with the same value for purgeDays\n");
     printf("Flags: --help\n       --version\n" );
     printf("       --purgeDays (positive integer) Purge files older than n days.\n");
+    printf("       --log-level error|warn|info|debug|trace  (default info)\n");
+    printf("       --no-uring  rename and unlink one at a time\n");
+    printf("       --uring-depth n  renames and unlinks in flight per thread (default 64)\n");
+    printf("       --purge-dirs-below DEPTH  remove empty directories below DEPTH\n");
+    printf("       --dir-age (positive integer) directories must be older than n days (default purgeDays)\n");
+    printf("       --report FILE  write the pwalk record and action of every entry to FILE, a new file\n");
+    printf("       --plan FILE  write what would be purged and removed to FILE, change nothing\n");
+    printf("       --apply FILE  purge and remove what FILE lists if it has not changed\n");
+    printf("       --perf-report  print latency percentiles of every syscall and lock and thread use\n");
 }
 
-/* Escape CSV delimeters */
+/*
+ *  --report; one pwalk record of path with the action taken, "" for none.
+ *  fileCnt is -1 for anything but a directory.
+ */
 void
-csv_escape(char *in, char *out)
+report( ino_t pino, long depth, char *path, struct stat *f,
+        long fileCnt, long dirSz, const char *action )
 {
-   char *orig;
-   int cnt = 0;
-
-   orig = in;
-   while ( *in ) {
-      if ( *in == '"' )
-          *out++ = '"';
-      if ( (unsigned char)*in < 32 ) {
-          in++;
-          cnt++;
-      } else
-          *out++ = *in++;
-   *out = '\0';
-   }
-   if ( cnt )
-       fprintf( Logfd, "Bad File Name: %s\n", orig);
+    char out[FILENAME_MAX + FILENAME_MAX], *o, *exten;
+    size_t need, len;
+
+    exten = fileExten( path );
+    need = PW_RECORD_MAX( strlen(path), exten ? strlen(exten) : 0 );
+    o = ( need <= sizeof(out) ) ? out : malloc( need );
+    len = pwRecord( o, f->st_ino, pino, depth, path, exten, f, fileCnt, dirSz,
+                    -1, action );
+    outputRecord( NULL, o, len, path, f->st_ino, f->st_dev );
+    if ( o != out )
+        free( o );
 }
 
 /*
- *  purgeLog
- *  log files that are moved to purge, and files that are removed.
+ *  purgeDone
+ *  log files that are moved to purge, and files that are removed, when the
+ *  rename or unlink is finished; error is 0 or an errno.
  *  Initial release of ppurge only purges file. Asume no directories are purged.
- *
  */
 void
-purgeLog( struct threadData *cur, char type, struct stat *f)
+purgeDone( struct purgeOp *op, int error )
 {
-   char out[FILENAME_MAX+FILENAME_MAX];
-   char fname[FILENAME_MAX];
-   long depth;
-
-   csv_escape(cur->dname, fname);
-   depth = cur->depth;
-   sprintf ( out, "%c,%ld,\"%s\",%ld,%ld,%ld,\"%07o\",%ld,%ld,%ld\n",
-            type, depth, fname, (long)f->st_uid, (long)f->st_gid, (long)f->st_size, (int)f->st_mode,
-            (long)f->st_atime, (long)f->st_mtime, (long)f->st_ctime);
-    fputs( out, stdout );
+    if ( REPORT )       /* files in .ppurge are one level down */
+        report( op->pino, op->depth + (op->type == 'R'), op->path, &op->f, -1, 0,
+                error ? "" : op->type == 'P' ? "P" : "R" );
+    if ( error == 0 ) {
+        plogAction( op->ring, op->type, op->depth, op->path, &op->f );
+        if ( op->type == 'P' && op->man )
+            manAdd( op->man, op->name, op->f.st_ino, op->f.st_mtime );
+        return;
+    }
+    if ( op->man && op->type == 'R' )
+        op->man->dirty = 1;
+    if ( op->type == 'P' )
+        PLOG(op->ring, LOG_ERROR, "BADNESS %s could not be moved to .ppurge: %s\n", op->path, strerror(error));
+    else
+        PLOG(op->ring, LOG_ERROR, "rm_purged - unlink failed: '%s' %s\n", op->name, strerror(error));
+}
+
+/*
+ *  purgeAction
+ *  'P' renames name from dirfd into todirfd (.ppurge), 'R' unlinks name in
+ *  dirfd. cur->dname is the path of name. Queued on the thread's io_uring
+ *  when there is one, purgeDone() logs the result.
+ */
+void
+purgeAction( struct threadData *cur, char type, int dirfd, int todirfd,
+             const char *name, struct stat *f )
+{
+    struct purgeOp *op, sync;
+    int error = 0;
+    long t0;
+
+    op = cur->uring ? uringGet( cur->uring ) : &sync;
+    op->type = type;
+    op->dirfd = dirfd;
+    op->todirfd = todirfd;
+    op->flags = 0;
+    op->depth = cur->depth;
+    op->f = *f;
+    op->ring = cur->ring;
+    op->man = cur->man;
+    op->pino = cur->st.st_ino;
+    strcpy( op->path, cur->dname );
+    op->name = op->path + strlen( op->path ) - strlen( name );
+    if ( cur->uring ) {
+        uringQueue( cur->uring, op );
+        return;
+    }
+    t0 = perfStart( );
+    if ( type == 'P' ) {
+        if ( renameat( dirfd, name, todirfd, name ) == -1 )
+            error = errno;
+    } else if ( unlinkat( dirfd, name, 0 ) == -1 )
+        error = errno;
+    perfAdd( PERF_CHANGE, t0, cur->depth, f->st_dev );
+    purgeDone( op, error );
+}
+
+static int
+inoCmp( const void *a, const void *b )
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
 }
 
 /********************************
-    opendir .ppurge directory
+    find the files in .ppurge, from its manifest when the directory has
+    not changed since the manifest was written, otherwise opendir
     if mtime < PPURGE_tm remove the file
     return the number of files which are not deleted
 
-    when all the files are deleted, then .ppurge dir can be removed
+    when all the files are deleted, then .ppurge dir is removed
+    cur->man holds the files moved in by this run
 *********************************/
 int
-rm_purged(struct threadData *cur, char* DirName, time_t purgedir_atime, int purgedir_fd)
+rm_purged(struct threadData *cur, char* DirName, time_t purgedir_atime, int purgedir_fd,
+          struct timespec *before)
 {
     DIR *purgeDIR;
-    int ret;
     struct dirent *d;
-    struct stat f;
-    long int fcount =0;
+    struct stat f, dirst;
+    struct manifest *m, *moved = cur->man;
+    struct manEntry *e;
+    long int fcount =0, i, n, dirSz =0, nmoved =0;
+    uint64_t *movedIno = NULL;  /* have their P record already */
     char *s, *t, *end_dname;
 
-    DEBUG_1("check purgedir: %s\n", DirName);
-    if ( (purgeDIR = fdopendir( purgedir_fd )) == NULL ) {
-        fprintf( Logfd, "rm_purged - opendir error: %s\n", DirName );
-        return -1;
+    PLOG(cur->ring, LOG_DEBUG, "check purgedir: %s\n", DirName);
+    if ( PlanFp )
+        planGroup( cur, purgedir_fd );
+    if ( (m = manLoad( purgedir_fd, before )) != NULL ) {
+        PLOG(cur->ring, LOG_DEBUG, "%s manifest: %ld files\n", DirName, m->n);
+        for ( i = 0; moved && i < moved->n; i++ )
+            manAdd( m, moved->e[i].name, moved->e[i].ino, moved->e[i].mtime );
+    } else {
+        if ( (purgeDIR = fdopendir( dup( purgedir_fd ) )) == NULL ) {
+            PLOG(cur->ring, LOG_ERROR, "rm_purged - opendir error: %s\n", DirName );
+            close( purgedir_fd );
+            return -1;
+        }
+        m = manNew( );
+        while ( (d = readdir( purgeDIR )) != NULL ) {
+            if ( strcmp(".", d->d_name) == 0 ) continue;
+            if ( strcmp("..", d->d_name) == 0 ) continue;
+            if ( strcmp(MANIFEST, d->d_name) == 0 ) continue;
+            if ( strcmp(MANIFEST_TMP, d->d_name) == 0 ) continue;
+            if ( fstatat (purgedir_fd, d->d_name, &f, AT_SYMLINK_NOFOLLOW ) == -1 ) {
+                PLOG(cur->ring, LOG_ERROR, "fstatat: '%s' %s\n", d->d_name, strerror(errno));
+                continue;
+            }
+            manAdd( m, d->d_name, f.st_ino, f.st_mtime );
+        }
+        closedir(purgeDIR);
     }
-    
+    if ( REPORT && moved && moved->n ) {
+        movedIno = malloc( moved->n * sizeof(uint64_t) );
+        for ( i = 0; movedIno && i < moved->n; i++ )
+            movedIno[nmoved++] = moved->e[i].ino;
+        qsort( movedIno, nmoved, sizeof(uint64_t), inoCmp );
+    }
+    manFree( moved );
+    cur->man = m;
+    manSort( m );
+    if ( REPORT ) {
+        dirst = cur->st;        /* the entries below are in .ppurge */
+        if ( fstat( purgedir_fd, &cur->st ) == -1 )
+            PLOG(cur->ring, LOG_ERROR, "fstat: '%s' %s\n", DirName, strerror(errno));
+    }
+
+    /* only the expired prefix is looked at */
     s = cur->dname + strlen(cur->dname);
     *s++ = '/';
     end_dname = s;
-    while ( (d = readdir( purgeDIR )) != NULL ) {
-        if ( strcmp(".", d->d_name) == 0 ) continue;
-        if ( strcmp("..", d->d_name) == 0 ) continue;
-        if ( fstatat (purgedir_fd, d->d_name, &f, 0 ) == -1 ) {
-            fprintf( Logfd, "fstatat: '%s' %s\n", d->d_name, strerror(errno));
+    for ( n = 0; purgedir_atime < Ptime && n < m->n && m->e[n].mtime < Rtime; n++ ) {
+        e = &m->e[n];
+        s = e->name; t = end_dname;
+        while ( *s )  /* copy file name to end of current path */
+            *t++ = *s++;
+        *t = '\0';
+        if ( fstatat (purgedir_fd, e->name, &f, AT_SYMLINK_NOFOLLOW ) == -1 ) {
+            m->dirty = 1;       /* gone; read the directory next time */
             continue;
         }
-        if (purgedir_atime < Ptime && f.st_mtime < Rtime) {
-            s = d->d_name; t = end_dname;
-            while ( *s )  /* copy file name to end of current path */
-                *t++ = *s++;
-            *t = '\0';
-            if ((ret =unlinkat(purgedir_fd, d->d_name, 0)) != 0) {
-                fprintf( Logfd, "rm_purged - unlink failed: '%s' %s\n", d->d_name, strerror(errno));
-            } else {
-                purgeLog( cur, 'R', &f);
-            }
+        dirSz += f.st_size;
+        /* only regular files directly in .ppurge are ever removed */
+        if ( !S_ISREG(f.st_mode) || f.st_ino != e->ino || f.st_mtime >= Rtime ) {
+            m->dirty = 1;       /* changed, keep it */
+            fcount++;
+            if ( REPORT )
+                report( cur->st.st_ino, cur->depth + 1, cur->dname, &f, -1, 0, "" );
+            continue;
+        }
+        if ( PlanFp ) {
+            planEntry( cur, 'R', e->name, &f );
+            if ( REPORT )
+                report( cur->st.st_ino, cur->depth + 1, cur->dname, &f, -1, 0, "R" );
         } else
-            fcount +=1;
+            purgeAction( cur, 'R', purgedir_fd, -1, e->name, &f );
     }
-    DEBUG_1("%s number of files: %ld\n", DirName, fcount);
-    closedir(purgeDIR);
+    /* not expired; a manifest saves these stats unless they are reported */
+    for ( i = n; REPORT && i < m->n; i++ ) {
+        if ( nmoved && bsearch( &m->e[i].ino, movedIno, nmoved, sizeof(uint64_t), inoCmp ) )
+            continue;
+        s = m->e[i].name; t = end_dname;
+        while ( *s )
+            *t++ = *s++;
+        *t = '\0';
+        if ( fstatat( purgedir_fd, m->e[i].name, &f, AT_SYMLINK_NOFOLLOW ) == 0 ) {
+            dirSz += f.st_size;
+            report( cur->st.st_ino, cur->depth + 1, cur->dname, &f, -1, 0, "" );
+        }
+    }
+    *--end_dname = '\0';
+    fcount += m->n - n;
+    PLOG(cur->ring, LOG_DEBUG, "%s number of files: %ld\n", DirName, fcount);
+    uringDrain( cur->uring );
+    if ( PlanFp )
+        planFlush( cur, fcount == 0 ? PLAN_RMDIR : 0 );
+    else if ( fcount == 0 || m->dirty )
+        manRemove( purgedir_fd );
+    else {
+        for ( i = 0; i < n; i++ )
+            free( m->e[i].name );
+        memmove( m->e, m->e + n, fcount * sizeof(struct manEntry) );
+        m->n = fcount;
+        if ( manSave( m, purgedir_fd ) )
+            PLOG(cur->ring, LOG_ERROR, "write manifest %s: %s\n", DirName, strerror(errno));
+    }
+    if ( fcount == 0 && !PlanFp &&      /* directory is empty */
+         unlinkat( cur->dirfd, ".ppurge", AT_REMOVEDIR ) != 0 ) {
+        PLOG(cur->ring, LOG_ERROR, "unlink .ppurge failed: '%s'\n", strerror(errno));
+        fcount = -1;
+    }
+    if ( REPORT ) {
+        report( dirst.st_ino, cur->depth, DirName, &cur->st, m->n, dirSz,
+                fcount == 0 ? "R" : "" );
+        cur->st = dirst;
+        free( movedIno );
+    }
+    manFree( m );
+    cur->man = NULL;
+    close( purgedir_fd );
     return fcount;
 }
 
 /* Open/Create .ppurge directory */
 int
-create_ppurge(int dirfd, time_t *purgedir_atime)
+create_ppurge(struct threadData *cur, int dirfd, time_t *purgedir_atime)
 {
     int purgedir_fd = -1;
     struct stat f;
     int ret;
 
     /* test if directory exists before creating */
-    DEBUG_1("\n");
+    PLOG(cur->ring, LOG_DEBUG, "%s\n", cur->dname);
     if ((purgedir_fd = openat( dirfd, ".ppurge", O_DIRECTORY |O_RDONLY)) != -1)
         if ((ret = fstatat( dirfd, ".ppurge", &f, 0)) != -1 )
             *purgedir_atime = f.st_atime;
         else
-            fprintf(Logfd, "create_ppurge - fstatat_1: %s\n", strerror(errno));
+            PLOG(cur->ring, LOG_ERROR, "create_ppurge - fstatat_1: %s\n", strerror(errno));
     else {
         if ((ret = mkdirat(dirfd, ".ppurge", 01777 )) == 0 ) {
             if ((purgedir_fd = openat( dirfd, ".ppurge", O_DIRECTORY |O_RDONLY)) == -1 )
-                fprintf(Logfd, "create_ppurge - openat .ppurge: %s\n", strerror(errno));
+                PLOG(cur->ring, LOG_ERROR, "create_ppurge - openat .ppurge: %s\n", strerror(errno));
             *purgedir_atime = time(NULL);
         } else
-            fprintf(Logfd, "create_ppurge - mkdirat .ppurge: %s\n", strerror(errno));
+            PLOG(cur->ring, LOG_ERROR, "create_ppurge - mkdirat .ppurge: %s\n", strerror(errno));
     }
     return purgedir_fd;
 }
 
+/*
+ * a directory for --purge-dirs-below; freed when the directory and all of
+ * its subdirectories are done
+ */
+struct dirNode {
+    struct dirNode *parent;
+    int    remaining;           /* own walk + subdirectories not done */
+    int    keep;                /* something is left in the directory */
+    int    fd;                  /* dup of the directory for its children */
+    long   depth;
+    long   fileCnt, dirSz;      /* for --report, -1 until it was read */
+    struct stat st;             /* as the walk saw it */
+    char   *name;               /* tail of path */
+    char   path[];
+    };
+
+struct dirNode *
+dirNodeNew( struct dirNode *parent, const char *path, const char *name,
+            long depth, struct stat *f )
+{
+    struct dirNode *n = malloc( sizeof(struct dirNode) + strlen(path) + 1 );
+
+    if ( n == NULL ) {
+        fprintf( stderr, "dirNode: out of memory\n" );
+        exit( 1 );
+    }
+    n->parent = parent;
+    n->remaining = 1;
+    n->keep = 0;
+    n->fd = -1;
+    n->depth = depth;
+    n->fileCnt = -1;
+    n->dirSz = 0;
+    n->st = *f;
+    strcpy( n->path, path );
+    n->name = n->path + strlen( path ) - strlen( name );
+    if ( parent )
+        __sync_add_and_fetch( &parent->remaining, 1 );
+    return n;
+}
+
+/* one part of n is done; remove the directories that are complete */
+void
+dirNodeDone( struct threadData *cur, struct dirNode *n )
+{
+    struct dirNode *p;
+    int removed;
+
+    while ( n && __sync_sub_and_fetch( &n->remaining, 1 ) == 0 ) {
+        p = n->parent;
+        removed = 0;
+        if ( p && (n->keep || n->depth <= DEPTH || n->st.st_mtime >= Dtime) )
+            p->keep = 1;
+        else if ( p && unlinkat( p->fd, n->name, AT_REMOVEDIR ) == 0 ) {
+            plogAction( cur->ring, 'D', n->depth, n->path, &n->st );
+            removed = 1;
+        } else if ( p ) {
+            if ( errno != ENOTEMPTY && errno != EEXIST )
+                PLOG(cur->ring, LOG_ERROR, "rmdir %s: %s\n", n->path, strerror(errno));
+            p->keep = 1;
+        }
+        if ( REPORT && n->fileCnt != -1 )
+            report( p ? p->st.st_ino : 0, n->depth - 1, n->path, &n->st,
+                    n->fileCnt, n->dirSz, removed ? "D" : "" );
+        if ( n->fd != -1 )
+            close( n->fd );
+        free( n );
+        n = p;
+    }
+}
+
 /********************************
     Open a directory and read the conents.
     call opendir with path passed in as an argument
@@ -277,55 +527,71 @@ void
 {
     char *s, *t, *end_dname;
     int  slot =0, ret;
-    int fcount;
+    int fcount = 0;
+    long t0;
     DIR *dirp;
     int subfd, purgedir_fd = -1;
     time_t purgedir_atime;
+    struct timespec purgedir_mtime;     /* before this run moved files in */
+    struct stat pst;
     long localCnt =0; /* number of files in a specific directory */
+    long entries =0, entSz =0;  /* every entry, for --report */
     struct dirent *d;
     struct stat f;
     struct threadData *cur, thrd_inst = {.THRDid = -1}, *thrd_ptr = &thrd_inst;
 
     cur = (struct threadData *) arg;
-    DEBUG_2("threadID=%ld,rdepth=%ld,file=%s\n", cur->THRDid, cur->depth, cur->dname);
+    PLOG(cur->ring, LOG_TRACE, "threadID=%ld,rdepth=%ld,file=%s\n", cur->THRDid, cur->depth, cur->dname);
     if ((dirp = fdopendir( cur->dirfd )) == NULL ) {
-        fprintf( Logfd, "Locked Dir: %s\n", cur->dname );
+        PLOG(cur->ring, LOG_ERROR, "Locked Dir: %s\n", cur->dname );
+        if ( cur->node )
+            cur->node->keep = 1;
         goto return_thread;
     }
+    cur->man = NULL;
+    if ( PlanFp )
+        planGroup( cur, cur->dirfd );
     s = cur->dname + strlen(cur->dname);
     *s++ = '/';
     end_dname = s;
-    while ( (d = readdir( dirp )) != NULL ) {
+    while ( (d = perfReaddir( dirp, cur->depth, cur->st.st_dev )) != NULL ) {
         if ( d->d_name[0] == '.' && 
              (!d->d_name[1] || (d->d_name[1]=='.' && !d->d_name[2]))) continue;
+        entries++;
         s = d->d_name; t = end_dname;
         while ( *s )  /* copy file name to end of cur->dname */
             *t++ = *s++;
         *t = '\0';
-        if ( fstatat( cur->dirfd, d->d_name, &f, AT_SYMLINK_NOFOLLOW) == -1 ) {
-            fprintf( Logfd, "threadID=%ld,rdepth=%d fstatat: '%s' %s\n",
+        if ( perfFstatat( cur->dirfd, d->d_name, &f, AT_SYMLINK_NOFOLLOW,
+                          cur->depth, cur->st.st_dev ) == -1 ) {
+            PLOG(cur->ring, LOG_ERROR, "threadID=%ld,rdepth=%d fstatat: '%s' %s\n",
               cur->THRDid, cur->flag, strerror(errno), cur->dname);
             continue;
         }
-        fprintf(stderr, "%8ld %s\n",f.st_size, cur->dname);
+        PLOG(cur->ring, LOG_TRACE, "%8ld %s\n", (long)f.st_size, cur->dname);
+        entSz += f.st_size;
         /* Follow Sub dirs recursivly but don't follow links */
         if ( S_ISDIR(f.st_mode) ) {
             if ( !strcmp(".ppurge", d->d_name)) {
                 if (purgedir_fd == -1) {
                     purgedir_fd = openat(cur->dirfd, ".ppurge", O_RDONLY);
                     purgedir_atime = f.st_atime;
+                    purgedir_mtime = f.st_mtim;
                 }
                 continue;
             }
             s = d->d_name; t = end_dname;
             while ( *s )  /* copy file name to end of current path */
                 *t++ = *s++;
-            if ((subfd = openat(cur->dirfd, d->d_name, O_RDONLY)) == -1 ) {
-                fprintf(Logfd, "openat fail: %s\n", cur->dname);
+            if ((subfd = perfOpenat(cur->dirfd, d->d_name, O_RDONLY,
+                                    cur->depth, cur->st.st_dev)) == -1 ) {
+                PLOG(cur->ring, LOG_ERROR, "openat fail: %s\n", cur->dname);
+                if ( cur->node )
+                    cur->node->keep = 1;
                 continue;
             }
-            DEBUG_1("follow directory: %s\n", cur->dname);
-            pthread_mutex_lock (&mutexFD);
+            PLOG(cur->ring, LOG_DEBUG, "follow directory: %s\n", cur->dname);
+            perfLock( &mutexFD, PERF_LOCK_FD, cur->depth, cur->st.st_dev );
             if ( ThreadCNT < MAXTHRDS ) {
                 slot = 0;
                 while ( slot < MAXTHRDS ) {
@@ -344,6 +610,8 @@ void
                 thrd_ptr->THRDid = cur->THRDid;
                 thrd_ptr->flag = cur->flag + 1;
                 thrd_ptr->dirfd = subfd;
+                thrd_ptr->ring = cur->ring;
+                thrd_ptr->uring = cur->uring;
             }
             pthread_mutex_unlock (&mutexFD);
             /* create ponter to tdslot that will be used for next
@@ -352,68 +620,143 @@ void
              */
             strcpy( thrd_ptr->dname, (const char*)cur->dname );
             thrd_ptr->depth  = cur->depth + 1;
+            thrd_ptr->node = NULL;
+            thrd_ptr->st = f;
+            thrd_ptr->pinode = cur->st.st_ino;
+            if ( cur->node ) {
+                if ( cur->node->fd == -1 )
+                    cur->node->fd = dup( cur->dirfd );
+                thrd_ptr->node = dirNodeNew( cur->node, cur->dname, d->d_name,
+                                             thrd_ptr->depth, &f );
+            }
             if ( thrd_ptr->THRDid != cur->THRDid ) {  /* new thread available */
-                DEBUG_1("creating new thread: %s\n", thrd_ptr->dname);
+                PLOG(cur->ring, LOG_DEBUG, "creating new thread: %s\n", thrd_ptr->dname);
                 pthread_create( &tdslot[slot].thread_id, &tdslot[slot].tattr,
                                 fileDir, (void*)thrd_ptr );
             } else
                 fileDir( (void*) thrd_ptr );
         } else { /* regular file */
             if (f.st_mtime <= (time_t)0 || f.st_atime <= (time_t)0) { // BeeGFS issue with empty mtime
-                fprintf(Logfd, "bad mtime: %s\n", cur->dname);
-                if ((ret = utimensat(cur->dirfd, d->d_name, NULL, 0)) != 0)
-                    fprintf(Logfd, "utimes fail: %s\n", cur->dname);
+                PLOG(cur->ring, LOG_WARN, "bad mtime: %s\n", cur->dname);
+                if ( REPORT )
+                    report( cur->st.st_ino, cur->depth, cur->dname, &f, -1, 0, "" );
+                if (!PlanFp) {
+                    t0 = perfStart( );
+                    ret = utimensat(cur->dirfd, d->d_name, NULL, 0);
+                    perfAdd( PERF_CHANGE, t0, cur->depth, cur->st.st_dev );
+                    if ( ret != 0 )
+                        PLOG(cur->ring, LOG_ERROR, "utimes fail: %s\n", cur->dname);
+                }
                 continue;
             }
             if ( (f.st_mode & S_IFMT) == S_IFLNK) {
-                DEBUG_1("link:%s\n", cur->dname);
+                PLOG(cur->ring, LOG_DEBUG, "link:%s\n", cur->dname);
+                if ( REPORT )
+                    report( cur->st.st_ino, cur->depth, cur->dname, &f, -1, 0, "" );
                 continue;
             }
             if ( f.st_mtime < Ptime) {
-                DEBUG_1("purge: %s\n", cur->dname);
-                if ( purgedir_fd == -1 )
-                    purgedir_fd = create_ppurge(cur->dirfd, &purgedir_atime);
-                if (renameat(cur->dirfd, d->d_name, purgedir_fd, d->d_name) == -1) {
-                    fprintf(Logfd, "BADNESS %s could not be moved to .ppurge: %s\n", cur->dname, strerror(errno));
-                } else {
-                    // need full path name for csv output
-                    purgeLog( cur, 'P', &f);
+                PLOG(cur->ring, LOG_DEBUG, "purge: %s\n", cur->dname);
+                if ( PlanFp ) {
+                    planEntry( cur, 'P', d->d_name, &f );
+                    if ( REPORT )
+                        report( cur->st.st_ino, cur->depth, cur->dname, &f, -1, 0, "P" );
+                    continue;
                 }
-            } else
+                if ( purgedir_fd == -1 ) {
+                    purgedir_fd = create_ppurge(cur, cur->dirfd, &purgedir_atime);
+                    if ( purgedir_fd != -1 && fstat( purgedir_fd, &pst ) == 0 )
+                        purgedir_mtime = pst.st_mtim;
+                }
+                if ( cur->man == NULL )
+                    cur->man = manNew( );
+                purgeAction( cur, 'P', cur->dirfd, purgedir_fd, d->d_name, &f );
+            } else {
                 localCnt++;
+                if ( REPORT )
+                    report( cur->st.st_ino, cur->depth, cur->dname, &f, -1, 0, "" );
+            }
         }
     }
+    if ( localCnt && cur->node )
+        cur->node->keep = 1;
+    uringDrain( cur->uring );   /* renames are done before .ppurge is read */
     if ( purgedir_fd != -1 ) {
-        fcount = rm_purged(cur, cur->dname, purgedir_atime, purgedir_fd);
-        if ( fcount == 0 )  /* directory is empty */
-            if ((ret = unlinkat(cur->dirfd, ".ppurge", AT_REMOVEDIR)) != 0) {
-                fprintf( Logfd, "unlink .ppurge failed: '%s'\n", strerror(errno));
-            }
+        strcpy( end_dname, ".ppurge" );
+        fcount = rm_purged(cur, cur->dname, purgedir_atime, purgedir_fd, &purgedir_mtime);
+        if ( fcount != 0 && cur->node )
+            cur->node->keep = 1;
 
     }
+    if ( PlanFp )
+        planFlush( cur, 0 );
+    manFree( cur->man );
+    cur->man = NULL;
     closedir( dirp );
     *--end_dname = '\0';
+    if ( cur->node ) {          /* reported when it is done */
+        cur->node->fileCnt = entries;
+        cur->node->dirSz = entSz;
+    } else if ( REPORT )
+        report( cur->pinode, cur->depth - 1, cur->dname, &cur->st, entries, entSz, "" );
 
 return_thread:
+    dirNodeDone( cur, cur->node );
+    cur->node = NULL;
     if ( cur->flag == 0 ) { /* this instance of fileDir is a thread */
+        perfDone( );
         pthread_mutex_lock ( &mutexFD );
-        DEBUG_2("msg=endTHRD,threadID=%ld,rdepth=%d,file=<%s>\n", cur->THRDid, cur->flag, cur->dname);
-        --ThreadCNT;
+        PLOG(cur->ring, LOG_TRACE, "msg=endTHRD,threadID=%ld,rdepth=%d,file=<%s>\n", cur->THRDid, cur->flag, cur->dname);
         cur->THRDid = -1;
+        if ( --ThreadCNT == 0 )
+            pthread_cond_signal( &walkDone );
         pthread_mutex_unlock ( &mutexFD );
         pthread_exit( EXIT_SUCCESS );
     } else
         return 0;
 }
 
+/*
+ *  userOpen
+ *  ppurge is setuid root; a file named by the user is created with the
+ *  real uid's rights, never over an existing file or through a symlink
+ */
+FILE *
+userOpen( const char *path )
+{
+    uid_t euid = geteuid( );
+    FILE *fp = NULL;
+    int fd, err;
+
+    if ( seteuid( getuid( ) ) )
+        return NULL;
+    fd = open( path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0644 );
+    err = errno;
+    if ( seteuid( euid ) ) {
+        fprintf(stderr, "unable to restore euid: %s\n", strerror(errno));
+        exit(1);
+    }
+    if ( fd != -1 && (fp = fdopen( fd, "w" )) == NULL ) {
+        err = errno;
+        close( fd );
+    }
+    errno = err;
+    return fp;
+}
+
 /* open a log file */
 void
 openLog(time_t now)
 {
-    char logName[64];
-
-    (void)strftime(logName, 63, "ppurge-%Y.%m.%d-%H_%M_%S.log", localtime(&now));
-    if ((Logfd = fopen(logName,  "w")) < 0) {
+    char logName[80], stamp[64];
+    int i;
+
+    (void)strftime(stamp, 63, "ppurge-%Y.%m.%d-%H_%M_%S", localtime(&now));
+    snprintf(logName, sizeof(logName), "%s.log", stamp);
+    /* a run started in the same second gets a numbered log */
+    for ( i = 1; (Logfd = userOpen(logName)) == NULL && errno == EEXIST && i < 100; i++ )
+        snprintf(logName, sizeof(logName), "%s-%d.log", stamp, i);
+    if (Logfd == NULL) {
         fprintf(stderr, "could not open: %s\n", logName);
         exit(errno);
     }
@@ -422,8 +765,9 @@ openLog(time_t now)
 int
 main( int argc, char* argv[] )
 {
-    int error, i, pdays = 0;
+    int error, i, pdays = 0, ddays = 0;
     int rootfd; 
+    char *plan = NULL;
     time_t now;
 
     if ( argc < 2 ) {
@@ -451,15 +795,81 @@ main( int argc, char* argv[] )
                 exit(1);
             }
             Ptime = now - (pdays * 86400);
-            Rtime = Ptime * 2;
+            Rtime = now - (2 * pdays * 86400);
+        }
+        if ( !strcmp(*argv, "--purge-dirs-below")) {
+            argc--; argv++;
+            if ( argc < 1 || (DEPTH = atoi(*argv)) < 0 ) {
+                fprintf(stderr, "--purge-dirs-below should be a depth of 0 or more\n");
+                exit(1);
+            }
+            PURGE_DIRS = 1;
+        }
+        if ( !strcmp(*argv, "--dir-age")) {
+            argc--; argv++;
+            if ( argc < 1 || (ddays = atoi(*argv)) < 1 || ddays > 32000 ) {
+                fprintf(stderr, "--dir-age should be possitive integer between 1 and 32000\n");
+                exit(1);
+            }
+        }
+        if ( !strcmp(*argv, "--no-uring"))
+            URING = 0;
+        if ( !strcmp(*argv, "--uring-depth")) {
+            argc--; argv++;
+            if ( argc < 1 || (URING_DEPTH = atoi(*argv)) < 1 || URING_DEPTH > 4096 ) {
+                fprintf(stderr, "--uring-depth should be between 1 and 4096\n");
+                exit(1);
+            }
+        }
+        if ( !strcmp(*argv, "--plan") || !strcmp(*argv, "--apply")) {
+            if ( argc < 2 ) {
+                fprintf(stderr, "%s needs a file name\n", *argv);
+                exit(1);
+            }
+            if ( !strcmp(*argv, "--plan") )
+                plan = argv[1];
+            else
+                APPLY = argv[1];
+            argc--; argv++;
+        }
+        if ( !strcmp(*argv, "--report")) {
+            argc--; argv++;
+            if ( argc < 1 || (OutFp = userOpen(*argv)) == NULL ) {
+                fprintf(stderr, "could not open report %s: %s\n", argc < 1 ? "" : *argv,
+                        argc < 1 ? "--report needs a file name" : strerror(errno));
+                exit(1);
+            }
+            REPORT = 1;
+        }
+        if ( !strcmp(*argv, "--perf-report"))
+            PERF = 1;
+        if ( !strcmp(*argv, "--log-level")) {
+            argc--; argv++;
+            if ( argc < 1 || (LogLevel = plogLevel(*argv)) < 0 ) {
+                fprintf(stderr, "--log-level is one of error, warn, info, debug, trace\n");
+                exit(1);
+            }
         }
         argc--; argv++;
     }
     openLog(now);
-    if (pdays == 0) {
+    if ( APPLY && REPORT ) {
+        fprintf(stderr, "--report needs a walk, it is not used with --apply\n");
+        exit(1);
+    }
+    if ( PURGE_DIRS && (plan || APPLY) ) {
+        fprintf(stderr, "--purge-dirs-below is not used with --plan or --apply\n");
+        exit(1);
+    }
+    if ( (plan || APPLY) && getuid() != 0 ) {
+        fprintf(stderr, "--plan and --apply are only for root\n");
+        exit(1);
+    }
+    if (pdays == 0 && !APPLY) {
         fprintf(stderr, "--purgeDays must be specified\n");
         exit(1);
     }
+    Dtime = now - ((ddays ? ddays : pdays) * 86400);
     if ( setuid((uid_t) 0)) {
        fprintf(stderr, "unable to setuid root; not all files will be processed\n");
        exit(1);
@@ -470,12 +880,33 @@ main( int argc, char* argv[] )
     for ( i=0; i<MAXTHRDS; i++ ) {
         tdslot[i].THRDid = -1;
         if ( (error = pthread_attr_init( &tdslot[i].tattr )) )
-            fprintf( Logfd, "Failed to create pthread attr: %s\n", strerror(error));
+            PLOG(NULL, LOG_ERROR, "Failed to create pthread attr: %s\n", strerror(error));
         else if ( (error = pthread_attr_setdetachstate( &tdslot[i].tattr, PTHREAD_CREATE_DETACHED)) )
-            fprintf( Logfd, "failed to set attribute detached: %s\n", strerror(error));
+            PLOG(NULL, LOG_ERROR, "failed to set attribute detached: %s\n", strerror(error));
+    }
+    if ( plan )
+        URING = 0;      /* nothing to rename or unlink */
+    plogStart( MAXTHRDS );
+    for ( i=0; i<MAXTHRDS; i++ ) {
+        tdslot[i].ring = plogRing( i );
+        if ( URING && (tdslot[i].uring = uringOpen( URING_DEPTH )) == NULL ) {
+            PLOG(NULL, LOG_INFO, "io_uring renameat/unlinkat not available, using synchronous calls\n");
+            URING = 0;
+        }
     }
     pthread_mutex_init(&mutexFD, NULL);
 
+    if ( APPLY ) {
+        planApply( APPLY, MAXTHRDS );
+        plogFinish( );
+        exit( EXIT_SUCCESS );
+    }
+    if ( argc < 1 ) {
+        printHelp( );
+        exit( EXIT_FAILURE );
+    }
+    if ( plan )
+        planOpen( plan );
     if ((rootfd = open(*argv, O_DIRECTORY | O_RDONLY)) == -1 ) {
         fprintf( stderr, "Could not open root directory:'%s' %s\n", *argv, strerror(errno));
         exit(errno);
@@ -486,6 +917,26 @@ main( int argc, char* argv[] )
     tdslot[0].THRDid = totalTHRDS++; /* first thread is zero */
     tdslot[0].flag = 0;
     tdslot[0].depth = 0;
+    tdslot[0].pinode = 0;
+    if ( fstat( rootfd, &tdslot[0].st ) == -1 ) {
+        fprintf( stderr, "fstat: '%s' %s\n", *argv, strerror(errno));
+        exit(errno);
+    }
+    if ( REPORT )
+        pwHeader( OutFp, PW_HDR_ACTION );
+    if ( PURGE_DIRS )           /* the root is never removed */
+        tdslot[0].node = dirNodeNew( NULL, tdslot[0].dname, "", 0, &tdslot[0].st );
+    pthread_mutex_lock( &mutexFD );
     pthread_create( &(tdslot[0].thread_id), &tdslot[0].tattr, fileDir, (void*)&tdslot[0] );
-    pthread_exit( NULL );
+    while ( ThreadCNT > 0 )
+        pthread_cond_wait( &walkDone, &mutexFD );
+    pthread_mutex_unlock( &mutexFD );
+    planClose( );
+    if ( REPORT ) {
+        outputFinish( );
+        fclose( OutFp );
+    }
+    perfReport( MAXTHRDS );
+    plogFinish( );
+    exit( EXIT_SUCCESS );
 }
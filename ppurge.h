@@ -0,0 +1,149 @@
+/*
+ *  ppurge.h  shared by the ppurge sources
+ */
+#ifndef PPURGE_H
+#define PPURGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define MAXTHRDS 32
+
+struct threadData {
+    char dname[FILENAME_MAX+1]; /* full path and basename */
+    int dirfd;                  /* file pointer to directory*/
+    long depth;                 /* directory depth */
+    long THRDid;                /* unique ID increaments with each new THRD */
+    int  flag;                  /* 0 if thread; recursion > 0 */
+    pthread_t thread_id;        /* system assigned */
+    pthread_attr_t tattr;
+    struct logRing *ring;       /* this thread's log ring */
+    struct pUring *uring;       /* this thread's io_uring, NULL is synchronous */
+    struct planGroup *plan;     /* --plan entries of the current directory */
+    struct manifest *man;       /* files moved into .ppurge, or its manifest */
+    struct dirNode *node;       /* --purge-dirs-below completion count */
+    struct stat st;             /* this directory, for --report */
+    ino_t pinode;               /* parent of this directory, for --report */
+};
+
+extern struct threadData tdslot[MAXTHRDS];
+extern time_t Ptime, Rtime;
+
+/* plog.c  per thread log rings drained by one writer thread */
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+#define LOG_TRACE 4
+
+extern int  LogLevel;           /* messages above this level cost one compare */
+extern FILE *Logfd;             /* error log, written by the log writer */
+
+struct logRing;
+
+/* a disabled level does not evaluate its arguments */
+#define PLOG(ring, level, fmt, args...) \
+    do { if ( (level) <= LogLevel ) plogMsg( ring, level, fmt, ##args ); } while (0)
+
+int  plogLevel( const char *name );
+struct logRing *plogRing( int slot );
+void plogMsg( struct logRing *r, int level, const char *fmt, ... )
+    __attribute__((format(printf, 3, 4)));
+void plogAction( struct logRing *r, char type, long depth, const char *path,
+                 struct stat *f );
+void plogStart( int nrings );
+void plogFinish( );
+
+/* uring.c  renameat/unlinkat batched through io_uring */
+struct purgeOp {
+    char   type;                /* 'P' rename into .ppurge, 'R' unlink */
+    int    dirfd, todirfd;
+    int    flags;               /* unlinkat flags */
+    long   depth;
+    struct stat f;              /* before the action, for the P/R record */
+    struct logRing *ring;
+    struct manifest *man;       /* P adds the file, a failed R marks it dirty */
+    ino_t  pino;                /* directory of the file, for --report */
+    char   *name;               /* tail of path */
+    char   path[FILENAME_MAX + 1];
+    };
+
+struct pUring;
+struct pUring *uringOpen( unsigned depth );
+struct purgeOp *uringGet( struct pUring *u );
+void uringQueue( struct pUring *u, struct purgeOp *op );
+void uringDrain( struct pUring *u );
+
+/* ppurge.c */
+void purgeDone( struct purgeOp *op, int error );
+void purgeAction( struct threadData *cur, char type, int dirfd, int todirfd,
+                  const char *name, struct stat *f );
+int  create_ppurge( struct threadData *cur, int dirfd, time_t *purgedir_atime );
+FILE *userOpen( const char *path );
+
+/* plan.c  --plan FILE writes what would be done, --apply FILE does it */
+#define PLAN_MAGIC "PPLAN001"
+#define PLAN_RMDIR 1            /* group is a .ppurge; remove it when empty */
+
+struct planHeader {
+    char     magic[8];
+    int64_t  created;
+    int64_t  ptime, rtime;
+    };
+
+/* a directory and the entries planned in it */
+struct planGroupHdr {
+    uint32_t len;               /* bytes in the group, header included */
+    uint32_t n;                 /* entries */
+    uint64_t ino;               /* of the directory when planned */
+    int64_t  dev;
+    int64_t  depth;
+    uint32_t flags;
+    uint32_t plen;              /* directory path follows, then entries */
+    };
+
+struct planItem {
+    uint64_t ino;               /* of the file when planned */
+    int64_t  mtime;
+    uint16_t nlen;              /* name and a NUL follow */
+    char     type;              /* 'P' or 'R' */
+    char     pad[5];
+    };
+
+extern FILE *PlanFp;
+void planOpen( const char *fname );
+void planClose( );
+void planGroup( struct threadData *cur, int dirfd );
+void planEntry( struct threadData *cur, char type, const char *name,
+                struct stat *f );
+void planFlush( struct threadData *cur, int flags );
+void planApply( const char *fname, int nthreads );
+
+/* manifest.c  sorted list of the files in a .ppurge directory */
+#define MANIFEST ".ppurge-manifest"
+#define MANIFEST_TMP ".ppurge-manifest.tmp"
+
+struct manEntry {
+    int64_t  mtime;
+    uint64_t ino;
+    char     *name;
+    };
+
+struct manifest {
+    struct manEntry *e;
+    long   n, max;
+    int    dirty;               /* does not match the directory, do not save */
+    };
+
+struct manifest *manNew( );
+struct manifest *manLoad( int dirfd, struct timespec *dirMtime );
+void manAdd( struct manifest *m, const char *name, uint64_t ino, int64_t mtime );
+void manSort( struct manifest *m );
+int  manSave( struct manifest *m, int dirfd );
+void manRemove( int dirfd );
+void manFree( struct manifest *m );
+
+#endif /* PPURGE_H */
@@ -0,0 +1,339 @@
+/*
+ *  profile.c  per directory cost of a walk and the schedule it gives the
+ *  next one  (pwalk --profile FILE)
+
+Copyright (C) (2013-2016) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+/*
+
+Every walker keeps a list of the directories it finished with their entry
+count and the time fileDir spent on them, less the time of the directories
+it recursed into. When the walk is done the lists are joined by directory
+id, summed up the tree and every subtree that took at least 1/PROF_KEEP of
+the walk is written to the profile. Small subtrees are left out, so the
+file stays small however big the tree is.
+
+At the start of the next walk the profile is read into a tree of the
+expensive directories, the children of each sorted most expensive first.
+fileDir hands those children out before it reads the directory, so the
+biggest subtrees get the free walker slots first instead of the last one
+found by readdir becoming a long single threaded tail.
+
+profile:  # comment, then  entries <tab> usec <tab> path  for every subtree,
+          depth first so every directory is followed by its subtree; path
+          is relative to the walk root, which is "/"
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "pwalk.h"
+
+#define PROF_KEEP 1024          /* keep subtrees of at least 1/PROF_KEEP */
+
+struct profRec {
+    long   id, pid;             /* directory id, parent id (0 for root) */
+    long   entries, usec;       /* this directory only */
+    size_t name, nlen;          /* in profSlot names */
+    };
+
+struct profSlot {
+    struct profRec *rec;
+    long   n, max;
+    char  *names;
+    size_t nameLen, nameMax;
+    struct profSlot *next;
+    };
+
+static struct profSlot *profSlots;      /* every walker that recorded */
+static pthread_mutex_t profLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+xrealloc( void *p, size_t n )
+{
+    if ( (p = realloc( p, n )) == NULL ) {
+        fprintf( stderr, "profile: out of memory\n" );
+        exit( 1 );
+    }
+    return p;
+}
+
+long
+profileNow( )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * remember directory fi of walker t when fileDir is done with it; the time
+ * of a directory walked by recursion is taken off its parent's
+ */
+void
+profileRecord( struct threadData *t, int fi, long entries )
+{
+    struct profSlot *s = t->prof;
+    struct dirFrame *fr = &t->frame[fi];
+    struct profRec *r;
+    char *name = t->names + fr->name, *p;
+    size_t nlen = fr->nlen;
+    long total = profileNow( ) - fr->t0;
+
+    if ( s == NULL ) {
+        s = t->prof = calloc( 1, sizeof(struct profSlot) );
+        if ( s == NULL ) {
+            fprintf( stderr, "profile: out of memory\n" );
+            exit( 1 );
+        }
+        pthread_mutex_lock( &profLock );
+        s->next = profSlots;
+        profSlots = s;
+        pthread_mutex_unlock( &profLock );
+    }
+    if ( fr->parent >= 0 )
+        t->frame[fr->parent].kidUs += total;
+    /* thread roots hold the full path, the profile wants the last part */
+    if ( fr->pid && (p = memrchr( name, '/', nlen )) != NULL ) {
+        nlen -= p + 1 - name;
+        name = p + 1;
+    }
+    if ( s->n == s->max ) {
+        s->max = s->max ? s->max * 2 : 1024;
+        s->rec = xrealloc( s->rec, s->max * sizeof(struct profRec) );
+    }
+    if ( s->nameLen + nlen > s->nameMax ) {
+        while ( s->nameLen + nlen > s->nameMax )
+            s->nameMax = s->nameMax ? s->nameMax * 2 : 16384;
+        s->names = xrealloc( s->names, s->nameMax );
+    }
+    r = &s->rec[s->n++];
+    r->id = fr->id;   r->pid = fr->pid;
+    r->entries = entries;
+    r->usec = total > fr->kidUs ? total - fr->kidUs : 0;
+    r->name = s->nameLen; r->nlen = nlen;
+    memcpy( s->names + s->nameLen, name, nlen );
+    s->nameLen += nlen;
+}
+
+/* join the walker lists and write the expensive subtrees; 0 or -1 */
+int
+profileWrite( const char *fname )
+{
+    struct profSlot *s;
+    struct profRec **byId;
+    char **nameOf, **path, *tmp;
+    long *entries, *usec, *kid, *sib, *stack, i, id, min;
+    size_t len;
+    FILE *fp;
+
+    byId = calloc( dirIds + 1, sizeof(struct profRec *) );
+    nameOf = calloc( dirIds + 1, sizeof(char *) );
+    path = calloc( dirIds + 1, sizeof(char *) );
+    entries = calloc( dirIds + 1, sizeof(long) );
+    usec = calloc( dirIds + 1, sizeof(long) );
+    kid = calloc( dirIds + 1, sizeof(long) );
+    sib = calloc( dirIds + 1, sizeof(long) );
+    stack = calloc( dirIds + 1, sizeof(long) );
+    if ( !byId || !nameOf || !path || !entries || !usec || !kid || !sib || !stack ) {
+        fprintf( stderr, "profile: out of memory\n" );
+        return -1;
+    }
+    for ( s = profSlots; s; s = s->next )
+        for ( i = 0; i < s->n; i++ ) {
+            id = s->rec[i].id;
+            byId[id] = &s->rec[i];
+            nameOf[id] = s->names + s->rec[i].name;
+            entries[id] = s->rec[i].entries;
+            usec[id] = s->rec[i].usec;
+        }
+    if ( byId[1] == NULL ) {
+        fprintf( stderr, "profile: root directory was not walked\n" );
+        return -1;
+    }
+    /* a parent always has a smaller id than its children */
+    for ( id = dirIds; id > 1; id-- )
+        if ( byId[id] && byId[byId[id]->pid] ) {
+            entries[byId[id]->pid] += entries[id];
+            usec[byId[id]->pid] += usec[id];
+        }
+    min = usec[1] / PROF_KEEP;
+    if ( asprintf( &tmp, "%s.tmp", fname ) == -1 || (fp = fopen( tmp, "w" )) == NULL ) {
+        fprintf( stderr, "profile: could not open %s.tmp: %s\n", fname, strerror(errno) );
+        return -1;
+    }
+    path[1] = "";
+    for ( id = 2; id <= dirIds; id++ ) {
+        if ( !byId[id] || !path[byId[id]->pid] || usec[id] < min || usec[id] == 0 )
+            continue;
+        len = byId[id]->nlen;
+        /* a name with a newline can not be a line, it is left out */
+        if ( memchr( nameOf[id], '\n', len ) )
+            continue;
+        if ( asprintf( &path[id], "%s/%.*s", path[byId[id]->pid], (int)len,
+                       nameOf[id] ) == -1 ) {
+            fprintf( stderr, "profile: out of memory\n" );
+            return -1;
+        }
+    }
+    /* ids are roughly breadth first; the loader wants every subtree in one
+       piece, so the kept directories are linked to their parent and written
+       depth first, children in id order */
+    for ( id = dirIds; id > 1; id-- )
+        if ( path[id] ) {
+            sib[id] = kid[byId[id]->pid];
+            kid[byId[id]->pid] = id;
+        }
+    fprintf( fp, "# pwalk profile: entries usec path\n" );
+    stack[0] = 1;
+    for ( i = 1; i > 0; ) {
+        id = stack[--i];
+        fprintf( fp, "%ld\t%ld\t%s\n", entries[id], usec[id], id == 1 ? "/" : path[id] );
+        if ( sib[id] )
+            stack[i++] = sib[id];
+        if ( kid[id] )
+            stack[i++] = kid[id];
+    }
+    if ( fclose( fp ) || rename( tmp, fname ) ) {
+        fprintf( stderr, "profile: write %s: %s\n", fname, strerror(errno) );
+        return -1;
+    }
+    for ( id = 2; id <= dirIds; id++ )
+        free( path[id] );
+    free( byId ); free( nameOf ); free( path ); free( entries ); free( usec );
+    free( kid ); free( sib ); free( stack );
+    free( tmp );
+    return 0;
+}
+
+static int
+byCost( const void *a, const void *b )
+{
+    const struct profNode *x = *(struct profNode * const *)a;
+    const struct profNode *y = *(struct profNode * const *)b;
+
+    return (x->usec < y->usec) - (x->usec > y->usec);
+}
+
+/*
+ * read the profile of the previous run; NULL if there is none.  A line
+ * whose parent is not the line before it or one of its parents is dropped.
+ */
+struct profNode *
+profileLoad( const char *fname )
+{
+    struct profNode *root = NULL, *n, **stack = NULL;
+    char *line = NULL, *p, *q;
+    size_t cap = 0, plen, depth, maxDepth = 0, i;
+    long entries, usec;
+    ssize_t len;
+    FILE *fp;
+
+    if ( (fp = fopen( fname, "r" )) == NULL ) {
+        if ( errno != ENOENT )
+            fprintf( stderr, "profile: %s: %s\n", fname, strerror(errno) );
+        return NULL;
+    }
+    while ( (len = getline( &line, &cap, fp )) > 0 ) {
+        if ( line[len - 1] == '\n' )
+            line[--len] = '\0';
+        if ( line[0] == '#' )
+            continue;
+        entries = strtol( line, &p, 10 );
+        if ( *p++ != '\t' )
+            continue;
+        usec = strtol( p, &p, 10 );
+        if ( *p++ != '\t' || *p != '/' )
+            continue;
+        plen = strlen( p );
+        n = xrealloc( NULL, sizeof(struct profNode) + plen + 1 );
+        memset( n, 0, sizeof(*n) );
+        n->entries = entries;
+        n->usec = usec;
+        memcpy( n->path, p, plen + 1 );
+        if ( root == NULL ) {
+            if ( plen != 1 ) {
+                free( n );
+                continue;
+            }
+            n->name = n->path + 1;
+            root = n;
+            stack = xrealloc( stack, sizeof(*stack) );
+            stack[0] = root;
+            maxDepth = 0;
+            continue;
+        }
+        /* depth is the number of '/'; the parent is on the stack below */
+        for ( depth = 0, q = n->path; *q; q++ )
+            if ( *q == '/' )
+                depth++;
+        if ( plen == 1 || depth > maxDepth + 1 || (depth > 1 &&
+             (strncmp( n->path, stack[depth - 1]->path,
+                       (i = strlen( stack[depth - 1]->path )) ) ||
+              n->path[i] != '/')) ) {
+            free( n );
+            continue;
+        }
+        n->name = strrchr( n->path, '/' ) + 1;
+        stack[depth - 1]->kid = xrealloc( stack[depth - 1]->kid,
+                            (stack[depth - 1]->nkid + 1) * sizeof(n) );
+        stack[depth - 1]->kid[stack[depth - 1]->nkid++] = n;
+        stack = xrealloc( stack, (depth + 1) * sizeof(*stack) );
+        stack[depth] = n;
+        maxDepth = depth;
+    }
+    free( line );
+    free( stack );
+    fclose( fp );
+    /* sort every level, most expensive first */
+    if ( root ) {
+        stack = xrealloc( NULL, sizeof(*stack) );
+        stack[0] = root;
+        for ( i = 1, cap = 1; i > 0; ) {
+            n = stack[--i];
+            qsort( n->kid, n->nkid, sizeof(n), byCost );
+            if ( i + n->nkid > cap ) {
+                cap = i + n->nkid;
+                stack = xrealloc( stack, cap * sizeof(*stack) );
+            }
+            memcpy( stack + i, n->kid, n->nkid * sizeof(n) );
+            i += n->nkid;
+        }
+        free( stack );
+    }
+    return root;
+}
+
+/* child name of p in the profile, NULL if it was not expensive */
+struct profNode *
+profileKid( struct profNode *p, const char *name )
+{
+    int i;
+
+    for ( i = 0; i < p->nkid; i++ )
+        if ( !strcmp( p->kid[i]->name, name ) )
+            return p->kid[i];
+    return NULL;
+}
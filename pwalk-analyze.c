@@ -0,0 +1,525 @@
+/*
+ *  pwalk-analyze.c  totals, directory rollups and histograms of a pwalk run
+
+Copyright (C) (2013-2016) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+/*
+
+report.py and reassemble.py for archives too big for Python.
+
+The CSV is mapped, not read. csv_escape() drops control characters, so a
+newline is always the end of a record, even in a quoted name, and the map
+can be cut into chunks at the first newline after any offset. The chunks
+are parsed on a pipeline of --threads threads with pwParseLine; memchr
+finds the line ends. Every thread keeps its own totals, they are added up
+when all chunks are done. The map is private, so the in place unquoting
+of pwParseLine never writes to the file. pgcopy input is read in one
+thread with pwNext.
+
+Output on stdout:
+  per UID bytes and records, the lines of report.py
+  Total directories and the root's rollup, as reassemble.py prints it
+  file size and mtime age histograms, files and bytes per bucket
+--rollup FILE writes the rollup of every directory:
+  inode,parent-inode,directory-depth,pw_fcount,pw_dirsum,sumcnt,sumsiz,"filename"
+
+Like reassemble.py, directories are keyed by inode and the rollup of the
+root (parent inode 0) also counts the root itself.
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pwcsv.h"
+#include "pipeline.h"
+
+static char *whoami = "pwalk-analyze";
+
+#define NSIZE 48                /* log2 size buckets, 0 is empty files */
+#define NAGE  10
+
+int  THREADS = 8;
+char *ROLLUP = NULL;            /* --rollup FILE */
+long NOW = 0;                   /* --now, ages are relative to it */
+
+static const long ageLimit[NAGE] = { 86400, 7*86400, 30*86400, 90*86400,
+    180*86400, 365*86400, 2*365*86400, 3*365*86400, 5*365*86400, -1 };
+static const char *ageName[NAGE + 1] = { "< 1 day", "< 1 week", "< 30 days",
+    "< 90 days", "< 180 days", "< 1 year", "< 2 years", "< 3 years",
+    "< 5 years", "older", "future" };
+
+struct uidTot {
+    long   uid;
+    long   records;
+    int64_t bytes;
+    int    used;
+    };
+
+struct dirRec {
+    uint64_t ino, pino;
+    long   depth, fcount, dirsum, size;
+    int64_t sumcnt, sumsiz;
+    char   *name;
+    size_t nlen;
+    };
+
+struct workerState {
+    struct uidTot *uid;         /* open addressing on uid */
+    long   nuid, maxuid;
+    struct dirRec *dir;
+    long   ndir, maxdir;
+    long   records, bad;
+    long   sizeN[NSIZE], ageN[NAGE + 1];
+    int64_t sizeB[NSIZE], ageB[NAGE + 1];
+    };
+
+struct chunk {                  /* one pipeline item */
+    char   *s, *end;
+    };
+
+static struct workerState *W;
+
+void
+printHelp()
+{
+    printf("Useage : %s [options] FILE\n", whoami);
+    printf("Totals of a pwalk output (CSV or --format=pgcopy).\n");
+    printf("Flags: --threads n     chunks parsed in parallel (default 8)\n");
+    printf("       --rollup FILE   write the rollup of every directory\n");
+    printf("       --now EPOCH     mtime ages relative to EPOCH (default now)\n");
+    printf("Output: bytes UID: user FileCount: records, per UID (report.py)\n");
+    printf("        Total directories and the root rollup (reassemble.py)\n");
+    printf("        file size and mtime age histograms\n");
+}
+
+static void *
+xrealloc( void *p, size_t n )
+{
+    if ( (p = realloc( p, n )) == NULL ) {
+        fprintf( stderr, "%s: out of memory\n", whoami );
+        exit( 1 );
+    }
+    return p;
+}
+
+static struct uidTot *
+uidGet( struct workerState *w, long uid )
+{
+    struct uidTot *old;
+    long i, n;
+
+    if ( 2 * (w->nuid + 1) > w->maxuid ) {
+        old = w->uid;
+        n = w->maxuid;
+        w->maxuid = n ? n * 2 : 1024;
+        w->uid = calloc( w->maxuid, sizeof(struct uidTot) );
+        if ( w->uid == NULL ) {
+            fprintf( stderr, "%s: out of memory\n", whoami );
+            exit( 1 );
+        }
+        w->nuid = 0;
+        for ( i = 0; i < n; i++ )
+            if ( old[i].used )
+                *uidGet( w, old[i].uid ) = old[i];
+        free( old );
+    }
+    for ( i = (uint64_t)uid * 0x9E3779B97F4A7C15ULL >> 20 & (w->maxuid - 1);
+          w->uid[i].used; i = (i + 1) & (w->maxuid - 1) )
+        if ( w->uid[i].uid == uid )
+            return &w->uid[i];
+    w->uid[i].used = 1;
+    w->uid[i].uid = uid;
+    w->nuid++;
+    return &w->uid[i];
+}
+
+static int
+sizeBucket( long size )
+{
+    int b = 0;
+
+    while ( size > 0 && b < NSIZE - 1 ) {
+        size >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/* add one record to the worker's totals */
+static void
+account( struct workerState *w, struct pwRec *r )
+{
+    struct uidTot *u = uidGet( w, r->uid );
+    struct dirRec *d;
+    long age;
+    int b;
+
+    w->records++;
+    u->records++;
+    u->bytes += r->size;
+    if ( r->fcount >= 0 ) {
+        if ( w->ndir == w->maxdir ) {
+            w->maxdir = w->maxdir ? w->maxdir * 2 : 4096;
+            w->dir = xrealloc( w->dir, w->maxdir * sizeof(struct dirRec) );
+        }
+        d = &w->dir[w->ndir++];
+        d->ino = r->ino;  d->pino = r->pino;
+        d->depth = r->depth;
+        d->fcount = r->fcount;  d->dirsum = r->dirsum;
+        d->size = r->size;
+        d->name = r->name;  d->nlen = r->nlen;
+        return;
+    }
+    if ( !S_ISREG(r->mode) )
+        return;
+    b = sizeBucket( r->size );
+    w->sizeN[b]++;
+    w->sizeB[b] += r->size;
+    age = NOW - r->mtime;
+    if ( age < 0 )
+        b = NAGE;               /* in the future */
+    else
+        for ( b = 0; b < NAGE - 1 && age >= ageLimit[b]; b++ )
+            ;
+    w->ageN[b]++;
+    w->ageB[b] += r->size;
+}
+
+/* pipeline work: parse the lines of one chunk */
+static void
+parseChunk( void *item, int worker )
+{
+    struct chunk *c = item;
+    struct workerState *w = &W[worker];
+    struct pwRec r;
+    char *s, *nl;
+
+    for ( s = c->s; s < c->end; s = nl + 1 ) {
+        if ( (nl = memchr( s, '\n', c->end - s )) == NULL )
+            nl = c->end;
+        if ( nl == s )
+            continue;
+        if ( pwParseLine( s, nl - s, &r ) == 0 )
+            account( w, &r );
+        else
+            w->bad++;
+    }
+    free( c );
+}
+
+/* parse the whole of fname into W; pgcopy in this thread, CSV in chunks */
+static void
+parseFile( const char *fname )
+{
+    struct pipeline *pl;
+    struct pwReader rd;
+    struct pwRec r;
+    struct chunk *c;
+    struct stat st;
+    char *map, *s, *end, *next;
+    size_t step;
+    int fd, ret;
+
+    if ( pwOpen( &rd, fname ) )
+        exit( 1 );
+    if ( rd.pgcopy ) {
+        while ( (ret = pwNext( &rd, &r )) != 0 ) {
+            if ( ret < 0 ) {
+                fprintf( stderr, "%s: %s is not pwalk output\n", whoami, fname );
+                exit( 1 );
+            }
+            account( &W[0], &r );
+            if ( r.fcount >= 0 ) {      /* the name is in rd's buffer */
+                W[0].dir[W[0].ndir - 1].name = xrealloc( NULL, r.nlen + 1 );
+                memcpy( W[0].dir[W[0].ndir - 1].name, r.name, r.nlen );
+            }
+        }
+        pwClose( &rd );
+        return;
+    }
+    pwClose( &rd );
+    if ( (fd = open( fname, O_RDONLY )) == -1 || fstat( fd, &st ) ) {
+        fprintf( stderr, "%s: %s: %s\n", whoami, fname, strerror(errno) );
+        exit( 1 );
+    }
+    if ( st.st_size == 0 )
+        return;
+    map = mmap( NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0 );
+    if ( map == MAP_FAILED ) {
+        fprintf( stderr, "%s: mmap %s: %s\n", whoami, fname, strerror(errno) );
+        exit( 1 );
+    }
+    close( fd );
+    madvise( map, st.st_size, MADV_SEQUENTIAL );
+    s = map;
+    end = map + st.st_size;
+    if ( !strncmp( s, "inode,", 6 < st.st_size ? 6 : st.st_size ) ) {
+        s = memchr( s, '\n', end - s );     /* --header */
+        s = s ? s + 1 : end;
+    }
+    /* a few chunks per thread so a slow one does not hold up the end */
+    step = st.st_size / (THREADS * 8) + 1;
+    if ( step < (1 << 20) )
+        step = 1 << 20;
+    pl = pipelineStart( THREADS, THREADS * 2, parseChunk );
+    while ( s < end ) {
+        next = end - s > step ? memchr( s + step, '\n', end - s - step ) : NULL;
+        next = next ? next + 1 : end;
+        c = xrealloc( NULL, sizeof(struct chunk) );
+        c->s = s;
+        c->end = next;
+        pipelinePut( pl, c );
+        s = next;
+    }
+    pipelineFinish( pl );
+}
+
+static int
+byBytes( const void *a, const void *b )
+{
+    const struct uidTot *x = a, *y = b;
+
+    return (x->bytes > y->bytes) - (x->bytes < y->bytes);
+}
+
+static int
+byDepth( const void *a, const void *b )
+{
+    const struct dirRec *x = a, *y = b;
+
+    return (x->depth < y->depth) - (x->depth > y->depth);
+}
+
+static void
+human( char *buf, size_t len, double v )
+{
+    const char *unit = " KMGTPE";
+    int i = 0;
+
+    while ( v >= 1024 && i < 6 ) {
+        v /= 1024;
+        i++;
+    }
+    if ( i )
+        snprintf( buf, len, "%.0f %ciB", v, unit[i] );
+    else
+        snprintf( buf, len, "%.0f B", v );
+}
+
+/* sum every directory into its parent, deepest first */
+static void
+rollup( struct workerState *t )
+{
+    struct dirRec *d = t->dir, *p;
+    long *slot, nslot, i, j, root = -1;
+
+    qsort( d, t->ndir, sizeof(struct dirRec), byDepth );
+    for ( nslot = 1024; nslot < 2 * t->ndir; nslot *= 2 )
+        ;
+    slot = xrealloc( NULL, nslot * sizeof(long) );
+    memset( slot, -1, nslot * sizeof(long) );
+    for ( i = 0; i < t->ndir; i++ ) {
+        d[i].sumcnt = d[i].fcount;
+        d[i].sumsiz = d[i].dirsum;
+        for ( j = d[i].ino * 0x9E3779B97F4A7C15ULL >> 20 & (nslot - 1);
+              slot[j] >= 0 && d[slot[j]].ino != d[i].ino; j = (j + 1) & (nslot - 1) )
+            ;
+        slot[j] = i;            /* a repeated inode: the last one, as in python */
+    }
+    for ( i = 0; i < t->ndir; i++ ) {
+        if ( d[i].pino == 0 ) {
+            root = i;
+            continue;
+        }
+        for ( j = d[i].pino * 0x9E3779B97F4A7C15ULL >> 20 & (nslot - 1);
+              slot[j] >= 0 && d[slot[j]].ino != d[i].pino; j = (j + 1) & (nslot - 1) )
+            ;
+        if ( slot[j] < 0 )
+            continue;           /* parent not in the run */
+        p = &d[slot[j]];
+        p->sumcnt += d[i].sumcnt;
+        p->sumsiz += d[i].sumsiz;
+    }
+    free( slot );
+    printf( "Total directories: %ld\n", t->ndir );
+    if ( root >= 0 ) {
+        d[root].sumcnt++;
+        d[root].sumsiz += d[root].size;
+        printf( "{'depth': %ld, 'dircnt': %ld, 'dirsiz': %ld, 'parent': 0,"
+                " 'sumcnt': %lld, 'sumsiz': %lld}\n", d[root].depth,
+                d[root].fcount, d[root].dirsum, (long long)d[root].sumcnt,
+                (long long)d[root].sumsiz );
+    }
+}
+
+static void
+writeRollup( struct workerState *t, const char *fname )
+{
+    FILE *fp;
+    long i;
+    size_t k;
+
+    if ( (fp = fopen( fname, "w" )) == NULL ) {
+        fprintf( stderr, "%s: %s: %s\n", whoami, fname, strerror(errno) );
+        exit( 1 );
+    }
+    fprintf( fp, "inode,parent-inode,directory-depth,pw_fcount,pw_dirsum,"
+             "sumcnt,sumsiz,\"filename\"\n" );
+    for ( i = t->ndir - 1; i >= 0; i-- ) {     /* shallowest first */
+        fprintf( fp, "%llu,%llu,%ld,%ld,%ld,%lld,%lld,\"",
+                 (unsigned long long)t->dir[i].ino,
+                 (unsigned long long)t->dir[i].pino, t->dir[i].depth,
+                 t->dir[i].fcount, t->dir[i].dirsum,
+                 (long long)t->dir[i].sumcnt, (long long)t->dir[i].sumsiz );
+        for ( k = 0; k < t->dir[i].nlen; k++ ) {
+            if ( t->dir[i].name[k] == '"' )
+                putc( '"', fp );
+            putc( t->dir[i].name[k], fp );
+        }
+        fprintf( fp, "\"\n" );
+    }
+    if ( fclose( fp ) ) {
+        fprintf( stderr, "%s: write %s: %s\n", whoami, fname, strerror(errno) );
+        exit( 1 );
+    }
+}
+
+int
+main( int argc, char *argv[] )
+{
+    struct workerState *t;
+    struct uidTot *u;
+    struct passwd *pw;
+    char *file = NULL, lo[32], hi[32], b[32];
+    long i, j, n;
+
+    argc--; argv++;
+    while ( argc > 0 ) {
+        if ( !strcmp( *argv, "--help" ) ) {
+            printHelp();
+            exit( 0 );
+        } else if ( !strcmp( *argv, "--threads" ) && argc > 1 ) {
+            argc--; argv++;
+            THREADS = atoi( *argv );
+        } else if ( !strcmp( *argv, "--rollup" ) && argc > 1 ) {
+            argc--; argv++;
+            ROLLUP = *argv;
+        } else if ( !strcmp( *argv, "--now" ) && argc > 1 ) {
+            argc--; argv++;
+            NOW = atol( *argv );
+        } else if ( file == NULL )
+            file = *argv;
+        else {
+            printHelp();
+            exit( 1 );
+        }
+        argc--; argv++;
+    }
+    if ( file == NULL ) {
+        printHelp();
+        exit( 1 );
+    }
+    if ( THREADS < 1 ) THREADS = 1;
+    if ( NOW == 0 ) NOW = time( NULL );
+    W = calloc( THREADS, sizeof(struct workerState) );
+    if ( W == NULL ) {
+        fprintf( stderr, "%s: out of memory\n", whoami );
+        exit( 1 );
+    }
+    parseFile( file );
+
+    /* add the other workers into the first */
+    t = &W[0];
+    for ( i = 1; i < THREADS; i++ ) {
+        for ( j = 0; j < W[i].maxuid; j++ )
+            if ( W[i].uid[j].used ) {
+                u = uidGet( t, W[i].uid[j].uid );
+                u->records += W[i].uid[j].records;
+                u->bytes += W[i].uid[j].bytes;
+            }
+        if ( t->ndir + W[i].ndir > t->maxdir ) {
+            t->maxdir = t->ndir + W[i].ndir;
+            t->dir = xrealloc( t->dir, t->maxdir * sizeof(struct dirRec) );
+        }
+        memcpy( t->dir + t->ndir, W[i].dir, W[i].ndir * sizeof(struct dirRec) );
+        t->ndir += W[i].ndir;
+        t->records += W[i].records;
+        t->bad += W[i].bad;
+        for ( j = 0; j < NSIZE; j++ ) {
+            t->sizeN[j] += W[i].sizeN[j];
+            t->sizeB[j] += W[i].sizeB[j];
+        }
+        for ( j = 0; j <= NAGE; j++ ) {
+            t->ageN[j] += W[i].ageN[j];
+            t->ageB[j] += W[i].ageB[j];
+        }
+    }
+    fprintf( stderr, "%s: %ld records, %ld lines that are not pwalk records\n",
+             whoami, t->records, t->bad );
+
+    /* per UID, smallest first like report.py */
+    for ( i = n = 0; i < t->maxuid; i++ )
+        if ( t->uid[i].used )
+            t->uid[n++] = t->uid[i];
+    qsort( t->uid, n, sizeof(struct uidTot), byBytes );
+    for ( i = 0; i < n; i++ ) {
+        pw = getpwuid( t->uid[i].uid );
+        if ( pw )
+            printf( "%lld UID: %s FileCount: %ld\n", (long long)t->uid[i].bytes,
+                    pw->pw_name, t->uid[i].records );
+        else
+            printf( "%lld UID: %ld FileCount: %ld\n", (long long)t->uid[i].bytes,
+                    t->uid[i].uid, t->uid[i].records );
+    }
+
+    rollup( t );
+    if ( ROLLUP )
+        writeRollup( t, ROLLUP );
+
+    printf( "file size             files            bytes\n" );
+    for ( i = 0; i < NSIZE; i++ ) {
+        if ( t->sizeN[i] == 0 )
+            continue;
+        human( lo, sizeof(lo), i ? (double)(1L << (i - 1)) : 0 );
+        human( hi, sizeof(hi), i ? (double)(1L << i) : 0 );
+        human( b, sizeof(b), (double)t->sizeB[i] );
+        printf( "%8s %1s %-8s %12ld %16lld  %s\n", lo, i ? "-" : "",
+                i ? hi : "", t->sizeN[i], (long long)t->sizeB[i], b );
+    }
+    printf( "mtime age             files            bytes\n" );
+    for ( i = 0; i <= NAGE; i++ ) {
+        if ( t->ageN[i] == 0 )
+            continue;
+        human( b, sizeof(b), (double)t->ageB[i] );
+        printf( "%-19s %12ld %16lld  %s\n", ageName[i], t->ageN[i],
+                (long long)t->ageB[i], b );
+    }
+    exit( t->bad ? 1 : 0 );     /* the totals are short */
+}
@@ -0,0 +1,575 @@
+/*
+ *  pwalk-diff.c  what changed between two pwalk runs
+
+Copyright (C) (2013-2016) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+/*
+
+Who used the last 10TB of disk space last night?
+
+pwalk-diff OLD NEW joins two pwalk outputs (CSV or pgcopy) on (st_dev,
+inode), or on the path for file systems whose inodes are not stable
+(--by-path, --by-path-dev DEV). It is a partitioned hash join: both inputs
+are split by key hash into partition files, then the partitions are joined
+in parallel. Only one partition of the old run is held in memory per
+thread, so memory is bounded by --mem whatever the size of the inputs.
+Every partition holds two open temp files, so there are no more than
+RLIMIT_NOFILE allows; with a low limit a partition can outgrow --mem.
+
+Output, one line per changed file:
+    change,delta,old_size,new_size,UID,"filename"
+    change is A added, R removed, G grown, S shrunk
+
+A summary with totals, per UID deltas and the directories with the largest
+net change is written to stderr.
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "pwcsv.h"
+#include "pipeline.h"
+
+static char *whoami = "pwalk-diff";
+
+#define MAXPATHDEV 64
+
+int  BY_PATH = 0;               /* join on path for every record */
+long PATH_DEV[MAXPATHDEV];      /* join on path for these st_dev */
+int  nPathDev = 0;
+int  THREADS = 8;
+long MEM = 1024;                /* MB for the join */
+int  TOPDIRS = 20;
+int  SUMMARY_ONLY = 0;
+char *TMPDIR = NULL;
+
+/* partition record, path follows */
+struct dRec {
+    int64_t  dev;
+    uint64_t ino;
+    int64_t  size;
+    int32_t  uid;
+    uint16_t byPath;
+    uint16_t matched;
+    uint32_t plen;
+    };
+
+struct delta {                  /* per UID or per directory */
+    char    *key;               /* directory, NULL for UID maps */
+    long    uid;
+    int64_t bytes;
+    long    added, removed, grown, shrunk;
+    int     used;
+    };
+
+struct map {
+    struct delta *d;
+    long n, max;
+    };
+
+struct part {                   /* one partition per pipeline item */
+    int id;
+    };
+
+struct workerState {
+    struct map uids, dirs;
+    char *out;
+    size_t outLen;
+    long added, removed, grown, shrunk;
+    int64_t addedB, removedB, grownB, shrunkB;
+    };
+
+FILE **oldPart, **newPart;
+int NPART;
+struct workerState *W;
+pthread_mutex_t outLock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+printHelp()
+{
+    printf("Useage : %s [options] OLD NEW\n", whoami);
+    printf("Compare two pwalk outputs (CSV or --format=pgcopy).\n");
+    printf("Flags: --by-path       join on file name instead of st_dev,inode\n");
+    printf("       --by-path-dev n join on file name for st_dev n (BeeGFS)\n");
+    printf("       --threads n     partitions joined in parallel (default 8)\n");
+    printf("       --mem MB        memory for the join (default 1024)\n");
+    printf("       --top n         directories in the summary (default 20)\n");
+    printf("       --summary-only  do not list changed files\n");
+    printf("       --tmpdir DIR    directory for partitions (default $TMPDIR)\n");
+    printf("Output: change,delta,old_size,new_size,UID,\"filename\"\n");
+    printf("  change A added, R removed, G grown, S shrunk\n");
+}
+
+static void *
+xrealloc( void *p, size_t n )
+{
+    if ( (p = realloc( p, n )) == NULL ) {
+        fprintf( stderr, "%s: out of memory\n", whoami );
+        exit( 1 );
+    }
+    return p;
+}
+
+static uint64_t
+hashBytes( const char *s, size_t len, uint64_t h )
+{
+    while ( len-- ) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t
+recHash( struct dRec *r )
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    if ( r->byPath )
+        return hashBytes( (char *)(r + 1), r->plen, h );
+    h = hashBytes( (char *)&r->dev, sizeof(r->dev), h );
+    return hashBytes( (char *)&r->ino, sizeof(r->ino), h );
+}
+
+static int
+recEqual( struct dRec *a, struct dRec *b )
+{
+    if ( a->byPath != b->byPath )
+        return 0;
+    if ( a->byPath )
+        return a->plen == b->plen && !memcmp( a + 1, b + 1, a->plen );
+    return a->dev == b->dev && a->ino == b->ino;
+}
+
+static FILE *
+tempFile( )
+{
+    char name[FILENAME_MAX];
+    const char *dir = TMPDIR ? TMPDIR : getenv( "TMPDIR" );
+    int fd;
+    FILE *fp;
+
+    snprintf( name, sizeof(name), "%s/pwalk-diff-XXXXXX", dir ? dir : "/tmp" );
+    if ( (fd = mkstemp( name )) == -1 || (fp = fdopen( fd, "w+" )) == NULL ) {
+        fprintf( stderr, "%s: temp file %s: %s\n", whoami, name, strerror(errno) );
+        exit( 1 );
+    }
+    unlink( name );
+    setvbuf( fp, NULL, _IOFBF, 1 << 15 );
+    return fp;
+}
+
+/* split one input into partition files */
+long
+partition( const char *fname, FILE **part )
+{
+    struct pwReader rd;
+    struct pwRec r;
+    struct dRec *d = NULL;
+    size_t max = 0;
+    long n = 0;
+    int i, ret;
+
+    if ( pwOpen( &rd, fname ) )
+        exit( 1 );
+    while ( (ret = pwNext( &rd, &r )) != 0 ) {
+        if ( ret < 0 ) {    /* a short side would show up as removed files */
+            fprintf( stderr, "%s: %s is not pwalk output, no diff\n", whoami, fname );
+            exit( 1 );
+        }
+        if ( sizeof(*d) + r.nlen > max ) {
+            max = (sizeof(*d) + r.nlen) * 2;
+            d = xrealloc( d, max );
+        }
+        d->dev = r.dev; d->ino = r.ino; d->size = r.size; d->uid = r.uid;
+        d->matched = 0;
+        d->plen = r.nlen;
+        d->byPath = BY_PATH;
+        for ( i = 0; i < nPathDev && !d->byPath; i++ )
+            d->byPath = r.dev == PATH_DEV[i];
+        memcpy( d + 1, r.name, d->plen );
+        i = recHash( d ) % NPART;
+        fwrite( d, 1, sizeof(*d) + d->plen, part[i] );
+        n++;
+    }
+    pwClose( &rd );
+    free( d );
+    for ( i = 0; i < NPART; i++ ) {
+        fflush( part[i] );
+        rewind( part[i] );
+    }
+    return n;
+}
+
+static struct dRec *
+readRec( FILE *fp, char **buf, size_t *max )
+{
+    struct dRec d;
+
+    if ( fread( &d, 1, sizeof(d), fp ) != sizeof(d) )
+        return NULL;
+    if ( sizeof(d) + d.plen > *max ) {
+        *max = (sizeof(d) + d.plen) * 2;
+        *buf = xrealloc( *buf, *max );
+    }
+    memcpy( *buf, &d, sizeof(d) );
+    if ( fread( *buf + sizeof(d), 1, d.plen, fp ) != d.plen )
+        return NULL;
+    return (struct dRec *)*buf;
+}
+
+/* find or add key in map; dir maps use the key string, uid maps the uid */
+static struct delta *
+mapGet( struct map *m, const char *key, size_t klen, long uid )
+{
+    struct delta *d, *old;
+    uint64_t h;
+    long i, oldmax;
+
+    if ( 2 * (m->n + 1) > m->max ) {    /* grow and rehash */
+        old = m->d; oldmax = m->max;
+        m->max = m->max ? m->max * 2 : 1024;
+        m->d = calloc( m->max, sizeof(struct delta) );
+        m->n = 0;
+        for ( i = 0; i < oldmax; i++ )
+            if ( old[i].used ) {
+                d = mapGet( m, old[i].key, old[i].key ? strlen( old[i].key ) : 0,
+                            old[i].uid );
+                free( d->key );
+                *d = old[i];
+            }
+        free( old );
+    }
+    h = key ? hashBytes( key, klen, 14695981039346656037ULL ) :
+              (uint64_t)uid * 0x9E3779B97F4A7C15ULL;
+    for ( i = h % m->max; m->d[i].used; i = (i + 1) % m->max ) {
+        d = &m->d[i];
+        if ( key ? (strlen( d->key ) == klen && !memcmp( d->key, key, klen ))
+                 : d->uid == uid )
+            return d;
+    }
+    d = &m->d[i];
+    d->used = 1;
+    d->uid = uid;
+    d->key = key ? strndup( key, klen ) : NULL;
+    m->n++;
+    return d;
+}
+
+static void
+account( struct workerState *w, char change, int64_t delta, long uid,
+         const char *path, size_t plen )
+{
+    struct delta *u, *d;
+    const char *slash = memrchr( path, '/', plen );
+
+    u = mapGet( &w->uids, NULL, 0, uid );
+    d = mapGet( &w->dirs, path, slash ? (size_t)(slash - path) : plen, 0 );
+    u->bytes += delta; d->bytes += delta;
+    switch ( change ) {
+    case 'A': u->added++;   d->added++;   w->added++;   w->addedB += delta;   break;
+    case 'R': u->removed++; d->removed++; w->removed++; w->removedB += delta; break;
+    case 'G': u->grown++;   d->grown++;   w->grown++;   w->grownB += delta;   break;
+    case 'S': u->shrunk++;  d->shrunk++;  w->shrunk++;  w->shrunkB += delta;  break;
+    }
+}
+
+static void
+flushOut( struct workerState *w )
+{
+    pthread_mutex_lock( &outLock );
+    fwrite( w->out, 1, w->outLen, stdout );
+    pthread_mutex_unlock( &outLock );
+    w->outLen = 0;
+}
+
+static void
+emit( struct workerState *w, char change, struct dRec *o, struct dRec *n )
+{
+    struct dRec *r = n ? n : o;
+    int64_t os = o ? o->size : 0, ns = n ? n->size : 0;
+    const char *p = (char *)(r + 1);
+    size_t i, need = 2 * r->plen + 128;
+    char *s;
+
+    account( w, change, ns - os, r->uid, p, r->plen );
+    if ( SUMMARY_ONLY )
+        return;
+    if ( w->outLen + need > (1 << 16) )
+        flushOut( w );
+    if ( need > (1 << 16) )
+        w->out = xrealloc( w->out, need );
+    s = w->out + w->outLen;
+    s += sprintf( s, "%c,%ld,%ld,%ld,%d,\"", change, (long)(ns - os),
+                  (long)os, (long)ns, r->uid );
+    for ( i = 0; i < r->plen; i++ ) {
+        if ( p[i] == '"' )
+            *s++ = '"';
+        *s++ = p[i];
+    }
+    *s++ = '"'; *s++ = '\n';
+    w->outLen = s - w->out;
+    if ( w->outLen > (1 << 16) )
+        flushOut( w );
+}
+
+/* join one partition: old side in a hash table, stream the new side */
+void
+joinPart( void *item, int worker )
+{
+    struct part *pt = (struct part *) item;
+    struct workerState *w = &W[worker];
+    char *arena = NULL, *buf = NULL;
+    size_t alen = 0, amax = 0, bmax = 0, len;
+    long n = 0, i, tsize, *table;
+    struct dRec *r, *o;
+    uint64_t h;
+
+    if ( w->out == NULL )
+        w->out = xrealloc( NULL, 1 << 17 );
+    while ( (r = readRec( oldPart[pt->id], &buf, &bmax )) != NULL ) {
+        len = (sizeof(*r) + r->plen + 7) & ~7UL;
+        if ( alen + len > amax ) {
+            amax = amax ? amax * 2 : 1 << 20;
+            while ( alen + len > amax ) amax *= 2;
+            arena = xrealloc( arena, amax );
+        }
+        memcpy( arena + alen, r, sizeof(*r) + r->plen );
+        alen += len;
+        n++;
+    }
+    tsize = 2 * n + 1;
+    table = xrealloc( NULL, tsize * sizeof(long) );
+    for ( i = 0; i < tsize; i++ )
+        table[i] = -1;
+    for ( len = 0; len < alen; len += (sizeof(*o) + o->plen + 7) & ~7UL ) {
+        o = (struct dRec *)(arena + len);
+        for ( h = recHash( o ) % tsize; table[h] != -1; h = (h + 1) % tsize ) ;
+        table[h] = len;
+    }
+    while ( (r = readRec( newPart[pt->id], &buf, &bmax )) != NULL ) {
+        o = NULL;
+        for ( h = recHash( r ) % tsize; table[h] != -1; h = (h + 1) % tsize )
+            if ( recEqual( (struct dRec *)(arena + table[h]), r ) ) {
+                o = (struct dRec *)(arena + table[h]);
+                if ( !o->matched )
+                    break;
+                o = NULL;       /* duplicate key; hard links by path */
+            }
+        if ( o == NULL )
+            emit( w, 'A', NULL, r );
+        else {
+            o->matched = 1;
+            if ( r->size > o->size )
+                emit( w, 'G', o, r );
+            else if ( r->size < o->size )
+                emit( w, 'S', o, r );
+        }
+    }
+    for ( len = 0; len < alen; len += (sizeof(*o) + o->plen + 7) & ~7UL ) {
+        o = (struct dRec *)(arena + len);
+        if ( !o->matched )
+            emit( w, 'R', o, NULL );
+    }
+    if ( w->outLen )
+        flushOut( w );
+    fclose( oldPart[pt->id] );
+    fclose( newPart[pt->id] );
+    free( arena ); free( buf ); free( table ); free( pt );
+}
+
+static int
+byBytes( const void *a, const void *b )
+{
+    const struct delta *x = a, *y = b;
+
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+static int
+byAbsBytes( const void *a, const void *b )
+{
+    int64_t x = llabs( ((const struct delta *)a)->bytes );
+    int64_t y = llabs( ((const struct delta *)b)->bytes );
+
+    return (x < y) - (x > y);
+}
+
+/* merge the per worker maps and print the summary on stderr */
+void
+summary( )
+{
+    struct map uids = {0}, dirs = {0};
+    struct delta *d, *s, *all;
+    long i, k, n;
+    long added = 0, removed = 0, grown = 0, shrunk = 0;
+    int64_t addedB = 0, removedB = 0, grownB = 0, shrunkB = 0;
+
+    for ( k = 0; k < THREADS; k++ ) {
+        added += W[k].added;     addedB += W[k].addedB;
+        removed += W[k].removed; removedB += W[k].removedB;
+        grown += W[k].grown;     grownB += W[k].grownB;
+        shrunk += W[k].shrunk;   shrunkB += W[k].shrunkB;
+        for ( i = 0; i < W[k].uids.max; i++ ) {
+            s = &W[k].uids.d[i];
+            if ( !s->used ) continue;
+            d = mapGet( &uids, NULL, 0, s->uid );
+            d->bytes += s->bytes; d->added += s->added; d->removed += s->removed;
+            d->grown += s->grown; d->shrunk += s->shrunk;
+        }
+        for ( i = 0; i < W[k].dirs.max; i++ ) {
+            s = &W[k].dirs.d[i];
+            if ( !s->used ) continue;
+            d = mapGet( &dirs, s->key, strlen( s->key ), 0 );
+            d->bytes += s->bytes; d->added += s->added; d->removed += s->removed;
+            d->grown += s->grown; d->shrunk += s->shrunk;
+        }
+    }
+    fprintf( stderr, "added   %10ld files %+18lld bytes\n", added, (long long)addedB );
+    fprintf( stderr, "removed %10ld files %+18lld bytes\n", removed, (long long)removedB );
+    fprintf( stderr, "grown   %10ld files %+18lld bytes\n", grown, (long long)grownB );
+    fprintf( stderr, "shrunk  %10ld files %+18lld bytes\n", shrunk, (long long)shrunkB );
+    fprintf( stderr, "net                    %+18lld bytes\n\n",
+             (long long)(addedB + removedB + grownB + shrunkB) );
+
+    all = xrealloc( NULL, (uids.n + dirs.n + 1) * sizeof(struct delta) );
+    for ( i = 0, n = 0; i < uids.max; i++ )
+        if ( uids.d[i].used )
+            all[n++] = uids.d[i];
+    qsort( all, n, sizeof(struct delta), byBytes );
+    fprintf( stderr, "%10s %18s %10s %10s %10s %10s\n", "UID", "net bytes",
+             "added", "removed", "grown", "shrunk" );
+    for ( i = 0; i < n; i++ )
+        fprintf( stderr, "%10ld %+18lld %10ld %10ld %10ld %10ld\n",
+                 all[i].uid, (long long)all[i].bytes, all[i].added,
+                 all[i].removed, all[i].grown, all[i].shrunk );
+    for ( i = 0, n = 0; i < dirs.max; i++ )
+        if ( dirs.d[i].used )
+            all[n++] = dirs.d[i];
+    qsort( all, n, sizeof(struct delta), byAbsBytes );
+    fprintf( stderr, "\n%18s %10s %10s  %s\n", "net bytes", "added",
+             "removed", "directory" );
+    for ( i = 0; i < n && i < TOPDIRS; i++ )
+        fprintf( stderr, "%+18lld %10ld %10ld  %s\n", (long long)all[i].bytes,
+                 all[i].added, all[i].removed, all[i].key );
+    free( all );
+}
+
+int
+main( int argc, char *argv[] )
+{
+    char *files[2];
+    int nfiles = 0, i;
+    struct stat st;
+    struct rlimit rl;
+    struct pipeline *join;
+    struct part *pt;
+    long nold, nnew;
+
+    argc--; argv++;
+    while ( argc > 0 ) {
+        if ( !strcmp( *argv, "--help" ) ) {
+            printHelp();
+            exit( 0 );
+        } else if ( !strcmp( *argv, "--by-path" ) )
+            BY_PATH = 1;
+        else if ( !strcmp( *argv, "--by-path-dev" ) && argc > 1 ) {
+            argc--; argv++;
+            if ( nPathDev < MAXPATHDEV )
+                PATH_DEV[nPathDev++] = atol( *argv );
+        } else if ( !strcmp( *argv, "--threads" ) && argc > 1 ) {
+            argc--; argv++;
+            THREADS = atoi( *argv );
+        } else if ( !strcmp( *argv, "--mem" ) && argc > 1 ) {
+            argc--; argv++;
+            MEM = atol( *argv );
+        } else if ( !strcmp( *argv, "--top" ) && argc > 1 ) {
+            argc--; argv++;
+            TOPDIRS = atoi( *argv );
+        } else if ( !strcmp( *argv, "--tmpdir" ) && argc > 1 ) {
+            argc--; argv++;
+            TMPDIR = *argv;
+        } else if ( !strcmp( *argv, "--summary-only" ) )
+            SUMMARY_ONLY = 1;
+        else if ( nfiles < 2 )
+            files[nfiles++] = *argv;
+        else {
+            printHelp();
+            exit( 1 );
+        }
+        argc--; argv++;
+    }
+    if ( nfiles != 2 ) {
+        printHelp();
+        exit( 1 );
+    }
+    if ( THREADS < 1 ) THREADS = 1;
+    if ( MEM < 16 ) MEM = 16;
+    /* a partition of the old run, about half the CSV size, fits per thread */
+    NPART = 64;
+    if ( stat( files[0], &st ) == 0 ) {
+        NPART = st.st_size / 2 / ((MEM << 20) / THREADS) + 1;
+        if ( NPART < THREADS * 2 ) NPART = THREADS * 2;
+        if ( NPART > 1024 ) NPART = 1024;
+    }
+    /* two open temp files per partition, a few descriptors for the rest */
+    if ( getrlimit( RLIMIT_NOFILE, &rl ) == 0 ) {
+        if ( rl.rlim_cur < rl.rlim_max && rl.rlim_cur < 2 * 1024 + 32 ) {
+            rl.rlim_cur = rl.rlim_max < 2 * 1024 + 32 ? rl.rlim_max : 2 * 1024 + 32;
+            setrlimit( RLIMIT_NOFILE, &rl );
+            getrlimit( RLIMIT_NOFILE, &rl );
+        }
+        if ( rl.rlim_cur != RLIM_INFINITY && NPART > ((long)rl.rlim_cur - 32) / 2 )
+            NPART = ((long)rl.rlim_cur - 32) / 2;
+        if ( NPART < 1 ) {
+            fprintf( stderr, "%s: too few file descriptors\n", whoami );
+            exit( 1 );
+        }
+    }
+    oldPart = xrealloc( NULL, NPART * sizeof(FILE *) );
+    newPart = xrealloc( NULL, NPART * sizeof(FILE *) );
+    for ( i = 0; i < NPART; i++ ) {
+        oldPart[i] = tempFile( );
+        newPart[i] = tempFile( );
+    }
+    nold = partition( files[0], oldPart );
+    nnew = partition( files[1], newPart );
+    fprintf( stderr, "%s: %ld old records, %ld new records, %d partitions\n",
+             whoami, nold, nnew, NPART );
+
+    W = calloc( THREADS, sizeof(struct workerState) );
+    join = pipelineStart( THREADS, NPART, joinPart );
+    for ( i = 0; i < NPART; i++ ) {
+        pt = xrealloc( NULL, sizeof(struct part) );
+        pt->id = i;
+        pipelinePut( join, pt );
+    }
+    pipelineFinish( join );
+    fflush( stdout );
+    summary( );
+    exit( 0 );
+}
@@ -0,0 +1,264 @@
+/*
+ *  pwalk-query.c  answer du style questions from a pwalk --index file
+
+Copyright (C) (2013-2016) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+/*
+
+The index is memory mapped, nothing is read that the query does not touch.
+A path is found with one binary search of the hash table. Subtree totals
+are stored, top-N children are a walk of the sibling chain and a
+depth-limited rollup is a scan of the pre-order range of the subtree.
+The offsets of the header are checked against the file size and every
+directory record against the header before it is used, so a cut off or
+stale index is an error, not a crash.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pwindex.h"
+
+static char *whoami = "pwalk-query";
+static char *indexName;
+
+struct pwIndexHeader *H;
+struct pwIndexDir *Dir;
+struct pwIndexHash *Hash;
+char *Names;
+
+void
+printHelp()
+{
+    printf("Useage : %s INDEX [path] [--top n] [--depth n]\n", whoami);
+    printf("Report totals for path (default: the root of the walk) from an\n");
+    printf("index written by pwalk --index.\n");
+    printf("       --top n    list the n biggest children (default 10)\n");
+    printf("       --depth n  list every directory n levels below path\n");
+    printf("Columns are cumulative bytes, files, directories and path\n");
+}
+
+static void
+corrupt( )
+{
+    fprintf( stderr, "%s: %s is corrupt or cut off\n", whoami, indexName );
+    exit( 1 );
+}
+
+/* dir i, its name, parent and subtree range must be inside the index */
+void
+checkDir( uint64_t i )
+{
+    struct pwIndexDir *r;
+
+    if ( i >= H->ndirs )
+        corrupt( );
+    r = &Dir[i];
+    if ( r->name > H->namesLen || r->nlen > H->namesLen - r->name ||
+         r->parent >= H->ndirs || r->end <= i || r->end > H->ndirs ||
+         (r->parent == i ? r->depth != 0 :
+          r->depth == 0 || Dir[r->parent].depth != r->depth - 1) )
+        corrupt( );
+}
+
+/*
+ * Full path of dir i, in a buffer every call reuses; *lenp gets its
+ * length.  The path is built from the end so depth and length have no
+ * limit.
+ */
+char *
+dirPath( uint64_t i, size_t *lenp )
+{
+    static char *buf;
+    static size_t max;
+    uint64_t j, p;
+    size_t len = 0, pos;
+
+    for ( j = i; ; j = Dir[j].parent ) {   /* every name and a / */
+        checkDir( j );                  /* the depth goes down to the root */
+        len += Dir[j].nlen + 1;
+        if ( Dir[j].parent == j )
+            break;
+    }
+    if ( len + 1 > max ) {
+        max = len + 1;
+        if ( (buf = realloc( buf, max )) == NULL ) {
+            fprintf( stderr, "%s: out of memory\n", whoami );
+            exit( 1 );
+        }
+    }
+    buf[len] = '\0';
+    pos = len;
+    for ( j = i; ; j = p ) {
+        pos -= Dir[j].nlen;
+        memcpy( buf + pos, Names + Dir[j].name, Dir[j].nlen );
+        if ( (p = Dir[j].parent) == j )
+            break;
+        if ( Dir[p].nlen && Names[Dir[p].name + Dir[p].nlen - 1] != '/' )
+            buf[--pos] = '/';
+    }
+    len -= pos;
+    while ( len > 1 && buf[pos + len - 1] == '/' ) /* same as the writer's root */
+        buf[pos + --len] = '\0';
+    *lenp = len;
+    return buf + pos;
+}
+
+/* pre-order index of path or -1 */
+long
+lookup( const char *path )
+{
+    char *p;
+    size_t len = strlen( path ), plen;
+    uint64_t h, lo = 0, hi = H->ndirs, mid;
+
+    while ( len > 1 && path[len - 1] == '/' )
+        len--;
+    h = pwIndexHash( path, len );
+    while ( lo < hi ) {
+        mid = (lo + hi) / 2;
+        if ( Hash[mid].hash < h ) lo = mid + 1;
+        else hi = mid;
+    }
+    for ( ; lo < H->ndirs && Hash[lo].hash == h; lo++ ) {
+        if ( Hash[lo].dir >= H->ndirs )
+            corrupt( );
+        p = dirPath( Hash[lo].dir, &plen );
+        if ( plen == len && !memcmp( p, path, len ) )
+            return Hash[lo].dir;
+    }
+    return -1;
+}
+
+void
+printDir( uint64_t i )
+{
+    size_t len;
+    char *p = dirPath( i, &len );
+
+    printf( "%16ju %12ju %10ju  %s\n", (uintmax_t)Dir[i].cbytes,
+            (uintmax_t)Dir[i].cfiles, (uintmax_t)Dir[i].cdirs, p );
+}
+
+static int
+bigger( const void *a, const void *b )
+{
+    uint64_t x = Dir[*(const uint64_t *)a].cbytes;
+    uint64_t y = Dir[*(const uint64_t *)b].cbytes;
+
+    return (x < y) - (x > y);
+}
+
+int
+main( int argc, char *argv[] )
+{
+    char *index = NULL, *path = NULL;
+    int fd, top = 10, depth = -1;
+    long d;
+    uint64_t c, n = 0, *kids;
+    struct stat st;
+    uint64_t size;
+    void *map;
+
+    argc--; argv++;
+    while ( argc > 0 ) {
+        if ( !strcmp( *argv, "--help" ) ) {
+            printHelp();
+            exit( 0 );
+        } else if ( !strcmp( *argv, "--top" ) && argc > 1 ) {
+            argc--; argv++;
+            top = atoi( *argv );
+        } else if ( !strcmp( *argv, "--depth" ) && argc > 1 ) {
+            argc--; argv++;
+            depth = atoi( *argv );
+        } else if ( index == NULL )
+            index = *argv;
+        else if ( path == NULL )
+            path = *argv;
+        else {
+            printHelp();
+            exit( 1 );
+        }
+        argc--; argv++;
+    }
+    if ( index == NULL ) {
+        printHelp();
+        exit( 1 );
+    }
+    indexName = index;
+    if ( (fd = open( index, O_RDONLY )) == -1 || fstat( fd, &st ) == -1 ) {
+        fprintf( stderr, "%s: %s: %s\n", whoami, index, strerror(errno) );
+        exit( 1 );
+    }
+    map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    if ( map == MAP_FAILED || st.st_size < sizeof(struct pwIndexHeader) ||
+         memcmp( map, PWINDEX_MAGIC, 8 ) ) {
+        fprintf( stderr, "%s: %s is not a pwalk index\n", whoami, index );
+        exit( 1 );
+    }
+    H = map;
+    size = st.st_size;
+    if ( H->dirOff % 8 || H->hashOff % 8 ||
+         H->dirOff > size || H->ndirs > (size - H->dirOff) / sizeof(struct pwIndexDir) ||
+         H->hashOff > size || H->ndirs > (size - H->hashOff) / sizeof(struct pwIndexHash) ||
+         H->namesOff > size || H->namesLen > size - H->namesOff )
+        corrupt( );
+    Dir = (struct pwIndexDir *)((char *)map + H->dirOff);
+    Hash = (struct pwIndexHash *)((char *)map + H->hashOff);
+    Names = (char *)map + H->namesOff;
+
+    d = path ? lookup( path ) : 0;
+    if ( d < 0 ) {
+        fprintf( stderr, "%s: %s is not in the index\n", whoami, path );
+        exit( 1 );
+    }
+    checkDir( d );
+    printf( "%16s %12s %10s  %s\n", "bytes", "files", "dirs", "path" );
+    printDir( d );
+    printf( "  blocks: %ju  own files: %ju  own bytes: %ju\n",
+            (uintmax_t)Dir[d].cblocks, (uintmax_t)Dir[d].files,
+            (uintmax_t)Dir[d].bytes );
+    if ( depth >= 0 ) {   /* pre-order range of the subtree */
+        printf( "\n" );
+        for ( c = d + 1; c < Dir[d].end; c++ )
+            if ( Dir[c].depth - Dir[d].depth <= depth )
+                printDir( c );
+    } else if ( top > 0 ) {
+        for ( c = d + 1; c < Dir[d].end; c = Dir[c].end ) {
+            checkDir( c );
+            n++;
+        }
+        if ( n == 0 )
+            exit( 0 );
+        kids = malloc( n * sizeof(uint64_t) );
+        for ( n = 0, c = d + 1; c < Dir[d].end; c = Dir[c].end )
+            kids[n++] = c;
+        qsort( kids, n, sizeof(uint64_t), bigger );
+        printf( "\n" );
+        for ( c = 0; c < n && c < top; c++ )
+            printDir( kids[c] );
+    }
+    exit( 0 );
+}
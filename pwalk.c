@@ -29,7 +29,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <errno.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include "pwalk.h"
+#include "pipeline.h"
+#include "journal.h"
+#include "perf.h"
+#include "trace.h"
 
 /* #define THRD_DEBUG */
 
@@ -57,13 +62,39 @@ int SNAPSHOT =0; /* if set ignore directories called .snapshot */
 int DEPTH = 0; /* if set do not traverse beyond directory depth */
 int ONE_FS =0; /* skip directories on different file systems -x */
 dev_t ST_DEV;  /* save st_dev of root file */
+char *ROOTS_FROM = NULL;  /* --roots-from FILE, more roots one per line */
+int ROOT_ID = 0;          /* more than one root, records carry the root */
+struct filter *WHERE = NULL; /* only report entries matching --where */
+struct filter *PRUNE = NULL; /* skip directories matching --prune */
+char *INDEX = NULL;  /* write subtree index for pwalk-query */
+char *PROFILE = NULL;   /* --profile FILE, read at start and written at end */
+int ESTIMATE = 0;       /* --estimate, sample instead of walking */
+double EST_TIME = 60;   /* --estimate-time seconds */
+double EST_ERROR = 1;   /* --estimate-error percent */
+char *WATCH = NULL;     /* --watch FILE, keep the walk up to date in FILE */
+long WATCH_INTERVAL = 300; /* --watch-interval seconds between checkpoints */
+int DEDUPE = 0;         /* --dedupe-scan, report files with the same content */
+int DEDUPE_THREADS = 8; /* --dedupe-threads hashing the candidates */
+char *FORMAT = "csv";   /* --format csv, pgcopy or sqlite */
+char *SQLITE_DB = NULL;
+int HEADER = 0;         /* --header, CSV only */
 
-#define MAXTHRDS 32
-int ThreadCNT  = 1; /* ThreadCNT < MAXTHRDS */
+int ThreadCNT  = 0; /* ThreadCNT < MAXTHRDS */
 int totalTHRDS =0;
 struct threadData tdslot[MAXTHRDS];
 pthread_mutex_t mutexFD;
 pthread_mutex_t mutexPrintStat;
+pthread_cond_t  walkDone;   /* signaled when a walker exits */
+
+/* the roots of the walk, from the command line and --roots-from */
+struct walkRoot {
+    char   *path;
+    struct stat st;
+    };
+struct walkRoot *Roots;
+int NRoots, MaxRoots;
+int RootsLeft;      /* not started yet, walkers recurse while there are */
+int PROCESS_LOCK = 1;       /* fileProcess needs mutexPrintStat */
 
 int check_exclude_list(char *fname);
 void verify_paths(char *list[]);
@@ -73,6 +104,13 @@ void get_exclude_list(char *fname, char *list[]);
 uid_t UID_orig, UID_new;
 gid_t GID_new;
 int chown_flag =0;
+int DRY_RUN =0;        /* mutators report but do not change anything */
+int MUTATORS =16;      /* mutator threads */
+int INFLIGHT =1024;    /* queued mutations before walkers wait */
+char *JOURNAL = NULL;  /* --journal FILE of the changes made */
+char *ROLLBACK = NULL; /* --rollback JOURNAL */
+void mutateStart( int nthreads, int inflight );
+void mutateFinish( );
 
 /* Process files */
 void
@@ -94,6 +132,20 @@ printStat( struct threadData *cur, char *exten, struct stat *f,
         long fileCnt, /* directory only - count files in directory */
         long dirSz );  /* directory only - sum of files within directory */
 
+/* binary output formats, same fields as printStat */
+void printPgCopy( struct threadData *cur, char *exten, struct stat *f,
+        long fileCnt, long dirSz );
+void pgcopyHeader( );
+void pgcopyTrailer( );
+#ifdef HAVE_SQLITE
+void printSqlite( struct threadData *cur, char *exten, struct stat *f,
+        long fileCnt, long dirSz );
+void sqliteOpen( const char *db );
+void sqliteClose( );
+#endif
+
+
+void *walkThread( void *arg );
 
 void
 printVersion( ) {
@@ -107,21 +159,15 @@ printVersion( ) {
    fprintf(stderr, " later version.\n\n" );
 }
 
-void
-printHeader()
-{
-   printf("inode,parent-inode,directory-depth,\"filename\"");
-   printf(",\"fileExtension\",UID,GID,st_size,st_dev,st_blocks" );
-   printf(",st_nlink,\"st_mode\",st_atime,st_mtime,st_ctime,pw_fcount");
-   printf(",pw_dirsum\n");
-}
-
 void
 printHelp()
 {
-   printf("Useage : %s (fully qualified file name)\n", whoami);
+   printf("Useage : %s (fully qualified file name) ...\n", whoami);
    printf("Flags: --help --version \n" );
    printf("       --depth n Stop walking when (n) depth is reached\n");
+   printf("       --roots-from FILE walk the directories in FILE, one per");
+   printf(" line, too;\n         with more than one root every record");
+   printf(" ends with its root, 0\n         for the first\n");
    printf("       --NoSnap Ignore directories with name .snapshot\n");
    printf("       --exclude filename <file> contains a list of");
    printf(" directories \n");
@@ -129,9 +175,68 @@ printHelp()
    printf("       --one-file-system skip directories on different file");
    printf(" systems\n");
    printf("       --header write CSV header with output\n");
+   printf("       --format=pgcopy write PostgreSQL binary COPY format\n");
+   printf("         CREATE TABLE pwalk (inode bigint, parent_inode bigint,");
+   printf(" directory_depth bigint,\n         filename bytea,");
+   printf(" fileextension bytea, uid bigint, gid bigint, st_size bigint,\n");
+   printf("         st_dev bigint, st_blocks bigint, st_nlink bigint,");
+   printf(" st_mode integer, st_atime bigint,\n         st_mtime bigint,");
+   printf(" st_ctime bigint, pw_fcount bigint, pw_dirsum bigint);\n");
+   printf("         COPY pwalk FROM 'file' WITH (FORMAT binary);\n");
+#ifdef HAVE_SQLITE
+   printf("       --format=sqlite DB insert into table pwalk of SQLite");
+   printf(" database DB\n");
+#endif
+   printf("       --sorted=path|inode write records in path or inode order\n");
+   printf("       --sort-mem MB memory for sorting (default 256)\n");
+   printf("       --tmpdir DIR directory for sort runs (default $TMPDIR)\n");
+   printf("       --max-buffer-mb MB buffer output in at most MB, written");
+   printf(" by its own\n         thread, and report time blocked on");
+   printf(" output\n");
+   printf("       --perf-report at the end print latency percentiles of");
+   printf(" every\n         syscall and lock by depth and st_dev, and");
+   printf(" thread utilization\n");
+   printf("       --trace FILE write a timeline of directories, walker");
+   printf(" threads, lock waits\n         and output as Chrome trace JSON");
+   printf(" (chrome://tracing, ui.perfetto.dev)\n");
+   printf("       --trace-sample n trace 1 in n directories and threads");
+   printf(" (default 1)\n");
+   printf("       --index FILE write a subtree index for pwalk-query\n");
+   printf("       --profile FILE walk the subtrees that were expensive in the");
+   printf(" last run\n         first and write this run's costs to FILE\n");
+   printf("       --estimate report estimated files, dirs, bytes and top");
+   printf(" uids from random\n         probes with 95%% intervals instead");
+   printf(" of walking everything\n");
+   printf("       --estimate-time SEC stop probing after SEC (default 60)\n");
+   printf("       --estimate-error PCT stop when within PCT percent");
+   printf(" (default 1)\n");
+   printf("       --dedupe-scan report groups of files with the same");
+   printf(" content and the\n         bytes they take twice instead of");
+   printf(" the walk\n");
+   printf("       --dedupe-threads n threads reading and hashing");
+   printf(" candidates (default 8)\n");
+   printf("       --watch FILE after the walk follow fanotify events and");
+   printf(" write the\n         updated walk to FILE every interval, on");
+   printf(" SIGUSR1 and at exit\n");
+   printf("       --watch-interval SEC seconds between --watch checkpoints");
+   printf(" (default 300)\n");
+   printf("       --where EXPR only report entries matching EXPR\n");
+   printf("       --prune EXPR do not walk directories matching EXPR\n");
+   printf("         EXPR: field op value joined with and, or, not, ( )\n");
+   printf("         fields uid gid size blocks nlink ino dev mode depth\n");
+   printf("         atime mtime ctime name ext path type; op = != < <= > >=\n");
+   printf("         or 'in (a,b)'. Example: 'uid=1234 and mtime > 90d");
+   printf(" and size > 1G'\n");
    printf("Conditionally Change File Owner. Two Flags are required.\n");
    printf("       --chown_from UID\n");
-   printf("       --chown_to UID:GID\n\n");
+   printf("       --chown_to UID:GID\n");
+   printf("       --dry-run list files that would change, change nothing\n");
+   printf("       --mutators n threads running chown (default 16)\n");
+   printf("       --inflight n queued changes before walkers wait");
+   printf(" (default 1024)\n");
+   printf("       --journal FILE record every change made to FILE\n");
+   printf("       --rollback JOURNAL undo the changes in JOURNAL that are");
+   printf(" still as made,\n         with --mutators threads\n\n");
    printf("Each line of output represents one file. st_* fields are direct ");
    printf("from the inode\ndata structure. pwalk provides additional ");
    printf("data for directories.\n\n");
@@ -143,17 +248,234 @@ printHelp()
    printf(" - pw_dirsum: Sum of file sizes in single directory. Value ");
    printf("of -1 if\n   file is not a directory\n\n");
    printf("File Header:\n");
-   printHeader();
+   pwHeader( stdout, 0 );
+}
+
+/* grow the frame arena and push a frame; returns its index */
+int
+pushFrame( struct threadData *t, const char *name, size_t nlen )
+{
+    struct dirFrame *fr;
+
+    if ( t->nframe == t->maxframe ) {
+        t->maxframe = t->maxframe ? t->maxframe * 2 : 64;
+        if ( (fr = realloc( t->frame, t->maxframe * sizeof(*fr) )) == NULL ) {
+            fprintf( stderr, "out of memory: frame arena\n" );
+            exit( 1 );
+        }
+        t->frame = fr;
+    }
+    if ( t->nameLen + nlen + 1 > t->nameMax ) {
+        while ( t->nameLen + nlen + 1 > t->nameMax )
+            t->nameMax = t->nameMax ? t->nameMax * 2 : 4096;
+        if ( (t->names = realloc( t->names, t->nameMax )) == NULL ) {
+            fprintf( stderr, "out of memory: name arena\n" );
+            exit( 1 );
+        }
+    }
+    fr = &t->frame[t->nframe];
+    fr->parent = t->nframe - 1;
+    fr->ref = NULL;
+    fr->name = t->nameLen;
+    fr->nlen = nlen;
+    memcpy( t->names + t->nameLen, name, nlen );
+    t->nameLen += nlen;
+    t->names[t->nameLen++] = '\0';
+    return t->nframe++;
+}
+
+/* pop the top frame, names are released in the same order they were made */
+void
+popFrame( struct threadData *t )
+{
+    struct dirFrame *fr = &t->frame[--t->nframe];
+
+    t->nameLen = fr->name;
+    if ( t->pathFrame == t->nframe )
+        t->pathFrame = -1;
+}
+
+/*
+ * Full path of the entry being processed.  The directory part is rebuilt
+ * from the frame chain only when the current frame changed since the last
+ * call; the entry name is appended after it.
+ */
+char *
+pwPath( struct threadData *t )
+{
+    struct dirFrame *fr;
+    size_t len, elen = 0, need;
+    int i;
+    char *s;
+
+    if ( t->pathFrame != t->cur ) {
+        for ( len = 0, i = t->cur; i >= 0; i = t->frame[i].parent )
+            len += t->frame[i].nlen + 1;
+        t->pathLen = len - 1;
+    }
+    if ( t->ename )
+        elen = strlen( t->ename ) + 1;
+    need = t->pathLen + elen + 1;
+    if ( need > t->pathMax ) {
+        while ( need > t->pathMax )
+            t->pathMax = t->pathMax ? t->pathMax * 2 : FILENAME_MAX+1;
+        if ( (t->path = realloc( t->path, t->pathMax )) == NULL ) {
+            fprintf( stderr, "out of memory: path\n" );
+            exit( 1 );
+        }
+    }
+    if ( t->pathFrame != t->cur ) {
+        s = t->path + t->pathLen;
+        for ( i = t->cur; i >= 0; i = fr->parent ) {
+            fr = &t->frame[i];
+            s -= fr->nlen;
+            memcpy( s, t->names + fr->name, fr->nlen );
+            if ( fr->parent >= 0 )
+                *--s = '/';
+        }
+        t->pathFrame = t->cur;
+    }
+    s = t->path + t->pathLen;
+    if ( t->ename ) {
+        *s++ = '/';
+        memcpy( s, t->ename, elen - 1 );
+        s += elen - 1;
+    }
+    *s = '\0';
+    return t->path;
+}
+
+void
+saveStat( struct dirStat *d, struct stat *f )
+{
+    d->ino = f->st_ino;      d->dev = f->st_dev;
+    d->uid = f->st_uid;      d->gid = f->st_gid;
+    d->mode = f->st_mode;    d->nlink = f->st_nlink;
+    d->size = f->st_size;    d->blocks = f->st_blocks;
+    d->atime = f->st_atime;  d->mtime = f->st_mtime;  d->ctime = f->st_ctime;
+}
+
+void
+loadStat( struct stat *f, struct dirStat *d )
+{
+    memset( f, 0, sizeof( struct stat ) );
+    f->st_ino = d->ino;      f->st_dev = d->dev;
+    f->st_uid = d->uid;      f->st_gid = d->gid;
+    f->st_mode = d->mode;    f->st_nlink = d->nlink;
+    f->st_size = d->size;    f->st_blocks = d->blocks;
+    f->st_atime = d->atime;  f->st_mtime = d->mtime;  f->st_ctime = d->ctime;
+}
+
+/* take a walker lock, timed for --perf-report and --trace */
+static void
+walkLock( struct threadData *t, pthread_mutex_t *m, int op )
+{
+    long t0 = traceNow( );
+
+    perfLock( m, op, t->frame[t->cur].depth, t->frame[t->cur].st.dev );
+    traceLock( op == PERF_LOCK_FD ? "mutexFD" : "print", t0 );
+}
+
+/* call fileProcess, under the print lock unless it does its own locking */
+void
+processEntry( struct threadData *t, char *exten, struct stat *f,
+              long fileCnt, long dirSz )
+{
+    if ( PROCESS_LOCK ) {
+        walkLock( t, &mutexPrintStat, PERF_LOCK_PRINT );
+        (*fileProcess)( t, exten, f, fileCnt, dirSz );
+        pthread_mutex_unlock (&mutexPrintStat);
+    } else
+        (*fileProcess)( t, exten, f, fileCnt, dirSz );
+}
+
+void fileDir( struct threadData *t, int fi );
+
+/*
+ * Subdirectory name of frame fi, f is its stat.  If maxthread is not
+ * reached hand it to a new walker as its root frame, otherwise push a
+ * frame and recurse.  pn is its --profile node, NULL if it was cheap.
+ */
+void
+subDir( struct threadData *t, int fi, int dfd, const char *name,
+        struct stat *f, struct profNode *pn )
+{
+    int  slot, subfd, ni;
+    struct dirFrame *fr;
+    struct threadData *new;
+
+    if ( SNAPSHOT && !strcmp( ".snapshot", name ) )
+       return;
+    if ( DEPTH && DEPTH == t->frame[fi].depth )
+       return; /* don't do any deeper than this */
+    if ( exclude_list[0] && check_exclude_list(pwPath(t)) )
+       return;
+    if ( PRUNE && filterMatch( PRUNE, t, name, NULL, f, t->frame[fi].depth ) )
+       return;
+    if ( (subfd = perfOpenat( dfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW,
+                              t->frame[fi].depth, f->st_dev )) == -1 ) {
+        fprintf( stderr, "Locked Dir: %s\n", pwPath(t) );
+        return;
+    }
+    new = t;
+    walkLock( t, &mutexFD, PERF_LOCK_FD );
+    if ( ThreadCNT < MAXTHRDS && !RootsLeft ) {
+        slot = 0;
+        while ( slot < MAXTHRDS ) {
+            if ( tdslot[slot].THRDid == -1 ) {
+                new = &tdslot[slot];
+                new->THRDid = totalTHRDS++;
+                new->flag = 0;   /* recurse flag reset for new thread */
+                break;
+            }
+            slot++;
+        }
+        if ( slot == MAXTHRDS )  { /* this would be bad */
+           fprintf( stderr, "error=%s,threadID=%ld,rdepth=%d,ThreadCNT=%d\n",
+           "\"no available threads\"", t->THRDid, t->flag, ThreadCNT );
+           exit( 1 );
+        }
+        ThreadCNT++; /* allocate the thread */
+    }
+    pthread_mutex_unlock (&mutexFD);
+    /* new walker gets the full path as its root frame name,
+       recursion only needs the entry name */
+    if ( new != t ) {
+        pwPath( t );
+        new->nframe = 0; new->nameLen = 0; new->pathFrame = -1;
+        ni = pushFrame( new, t->path, strlen( t->path ) );
+    } else
+        ni = pushFrame( t, name, strlen( name ) );
+    fr = &new->frame[ni];
+    fr->fd = subfd;
+    saveStat( &fr->st, f );
+    fr->depth  = t->frame[fi].depth + 1;
+    fr->pinode = t->frame[fi].st.ino; /* Parent Inode */
+    fr->id = __sync_add_and_fetch( &dirIds, 1 );
+    fr->pid = t->frame[fi].id;
+    fr->root = t->frame[fi].root;
+    fr->pnode = pn;
+    if ( new != t ) {  /* new thread available */
+        if ( traceSampled( new->THRDid ) )
+            traceFlow( 's', new->THRDid );
+        pthread_create( &new->thread_id, &new->tattr,
+                        walkThread, (void*)new );
+    } else {
+        t->flag++;
+        fileDir( t, ni );
+        t->flag--;
+        popFrame( t );
+    }
 }
 
 /********************************
     Open a directory and read the conents.
-    call opendir with path passed in as an argument
-    stat every file from opendir
+    The directory is the top frame (fi) of walker t, its fd is already open.
+    stat every file from readdir relative to the directory fd
 
-    If maxthread is not reached creat a new thread and call self
-    If no threads available Recursively call self for each directory
-    from opendir.
+    Subdirectories that were expensive in the --profile of the last run
+    are handed out first, most expensive first; the rest go to subDir in
+    readdir order.
 
     print inode meta data for each file, one line per file in CSV format
     print directory information after every file is processed from
@@ -161,140 +483,222 @@ printHelp()
 
 *********************************/
 void
-*fileDir( void *arg )
+fileDir( struct threadData *t, int fi )
 {
-    char *s, *t, *u, *dot, *end_dname;
-    int  i, slot, status;
+    char *dot, *s, *u;
+    int  k;
     DIR *dirp;
     long localCnt =0; /* number of files in a specific directory */
     long localSz  =0; /* byte cnt of files in the local directory 2010.07 */
+    long ownCnt =0, ownSz =0, ownBlk =0; /* files only, for --index */
     struct dirent *d;
     struct stat f;
-    struct threadData *cur, *new, local;
+    struct dirFrame *fr;
+    struct profNode *pn;
+    long t0 = traceSampled( t->frame[fi].id ) ? traceNow( ) : 0;
+    dev_t rdev = Roots[t->frame[fi].root].st.st_dev;
 
-    cur = (struct threadData *) arg;
+    t->cur = fi; t->ename = NULL;
+    if ( PROFILE ) {
+        t->frame[fi].t0 = profileNow( );
+        t->frame[fi].kidUs = 0;
+    }
 #ifdef THRD_DEBUG
     fprintf( stderr, "msg=fileDir,threadID=%ld,rdepth=%d,file=%s\n",
-        cur->THRDid, cur->flag, cur->dname );
+        t->THRDid, t->flag, pwPath(t) );
 #endif /* THRD_DEBUG */
-    if ( (dirp = opendir( cur->dname )) == NULL ) {
-        fprintf( stderr, "Locked Dir: %s\n", cur->dname );
-        return arg;
-    }
-    /* find the end of fs->name and put '/' at the end <end_dname>
-       points to char after '/' */
-    s = cur->dname + strlen(cur->dname);
-    *s++ = '/';
-    end_dname = s;
-    while ( (d = readdir( dirp )) != NULL ) {
-        if ( strcmp(".",d->d_name) == 0 ) continue;
-        if ( strcmp("..",d->d_name) == 0 ) continue;
+    if ( (dirp = fdopendir( t->frame[fi].fd )) == NULL ) {
+        fprintf( stderr, "Locked Dir: %s\n", pwPath(t) );
+        close( t->frame[fi].fd );
+        return;
+    }
+    if ( (pn = t->frame[fi].pnode) != NULL )
+        for ( k = 0; k < pn->nkid; k++ ) {
+            t->cur = fi; t->ename = pn->kid[k]->name;
+            if ( perfFstatat( dirfd(dirp), t->ename, &f, AT_SYMLINK_NOFOLLOW,
+                              t->frame[fi].depth, t->frame[fi].st.dev ) == -1 ||
+                 !S_ISDIR(f.st_mode) || (ONE_FS && f.st_dev != rdev) )
+                continue;   /* gone or changed, readdir will see it */
+            pn->kid[k]->started = 1;
+            subDir( t, fi, dirfd(dirp), t->ename, &f, pn->kid[k] );
+        }
+    while ( (d = perfReaddir( dirp, t->frame[fi].depth,
+                              t->frame[fi].st.dev )) != NULL ) {
+        if ( d->d_name[0] == '.' &&
+             (!d->d_name[1] || (d->d_name[1]=='.' && !d->d_name[2]))) continue;
         localCnt++;
-        s = d->d_name; t = end_dname;
-        while ( *s )  /* copy file name to end of current path */
-            *t++ = *s++;
-        *t = '\0';
-        if ( lstat ( cur->dname, &f ) == -1 ) {
+        t->cur = fi; t->ename = d->d_name;
+        if ( perfFstatat( dirfd(dirp), d->d_name, &f, AT_SYMLINK_NOFOLLOW,
+                          t->frame[fi].depth, t->frame[fi].st.dev ) == -1 ) {
             fprintf( stderr, "threadID=%ld,rdepth=%d lstat: '%s' %s\n",
-              cur->THRDid, cur->flag, strerror(errno), cur->dname);
+              t->THRDid, t->flag, strerror(errno), pwPath(t));
             continue;
         }
         /* don't report data from foreign file systems */
-        if ( ONE_FS && f.st_dev != ST_DEV )
+        if ( ONE_FS && f.st_dev != rdev )
             continue;
         /* Follow Sub dirs recursivly but don't follow links */
         localSz += f.st_size;
         if ( S_ISDIR(f.st_mode) ) {
-            if ( SNAPSHOT && !strcmp( ".snapshot", d->d_name ) )
-               continue; /* next file from readdir */
-            if ( DEPTH && DEPTH == cur->depth )
-               continue; /* don't do any deeper than this */
-            if ( exclude_list[0] && check_exclude_list(cur->dname) )
-                    continue;
-            pthread_mutex_lock (&mutexFD);
-            if ( ThreadCNT < MAXTHRDS ) {
-                slot = 0;
-                while ( slot < MAXTHRDS ) {
-                    if ( tdslot[slot].THRDid == -1 ) {
-                        new = &tdslot[slot];
-                        new->THRDid = totalTHRDS++;
-                        new->flag = 0;   /* recurse flag reset for new thread */
-                        break;
-                    }
-                    slot++;
-                }
-                if ( slot == MAXTHRDS )  { /* this would be bad */
-                   fprintf( stderr, "error=%s,threadID=%ld,rdepth=%d,ThreadCNT=%d\n",
-                   "\"no available threads\"", cur->THRDid, cur->flag, ThreadCNT );
-                   exit( 1 );
-                }
-                ThreadCNT++; /* allocate the thread */
-            } else {
-                new = &local;
-                new->THRDid = cur->THRDid;
-                new->flag = cur->flag + 1;
-            }
-            pthread_mutex_unlock (&mutexFD);
-            /* create ponter to tdslot that will be used for next
-               call to fileDir - local or from array - shorten next block of
-               code
-             */
-            memcpy( &(new->pstat), &f, sizeof( struct stat ) );
-            strcpy( new->dname, (const char*)cur->dname );
-            new->depth  = cur->depth + 1;
-            new->pinode = cur->pstat.st_ino; /* Parent Inode */
-            if ( new->THRDid != cur->THRDid ) {  /* new thread available */
-                pthread_create( &tdslot[slot].thread_id, &tdslot[slot].tattr,
-                                fileDir, (void*)new );
-            } else {
-                fileDir( (void*) new );
-            }
+            pn = NULL;
+            if ( t->frame[fi].pnode &&
+                 (pn = profileKid( t->frame[fi].pnode, d->d_name )) &&
+                 pn->started )
+                continue;   /* handed out before readdir */
+            subDir( t, fi, dirfd(dirp), d->d_name, &f, pn );
         } else {
-           s = end_dname + 1; dot = NULL; /* file extension */
-           while ( *s ) {
-               if (*s == '.') dot = s+1;
-               s++;
-           }
-           pthread_mutex_lock (&mutexPrintStat);
-           (*fileProcess)( cur, dot, &f, (long)-1, (long)0 );
-           pthread_mutex_unlock (&mutexPrintStat);
+           ownCnt++; ownSz += f.st_size; ownBlk += f.st_blocks;
+           dot = fileExten( d->d_name );
+           if ( WHERE && !filterMatch( WHERE, t, d->d_name, dot, &f,
+                                       t->frame[fi].depth ) )
+               continue;
+           processEntry( t, dot, &f, (long)-1, (long)0 );
         }
     }
+    t->cur = fi; t->ename = NULL;
+    if ( INDEX )
+        indexRecord( t, fi, ownCnt, ownSz, ownBlk );
+    fr = &t->frame[fi];
+    dot = NULL;     /* directories have no extension */
+    loadStat( &f, &fr->st );
+    s = t->names + fr->name;
+    if ( (u = strrchr( s, '/' )) != NULL && u[1] )
+        s = u + 1;
+    if ( !WHERE || filterMatch( WHERE, t, s, dot, &f, fr->depth - 1 ) )
+        processEntry( t, dot, &f, localCnt, localSz);
+    traceSpan( fi ? "recursion" : "new-thread", s, t0, fr->id, fr->depth,
+               localCnt );
     closedir( dirp );
-    *--end_dname = '\0';
-    s = end_dname - 1; dot = NULL;
-    while ( *s != '/' ) {
-       if (*s == '.') { dot = s+1; break; }
-       s--; }
-    if ( s+1 == dot ) /* Dot file is not an extension Exp: /.bashrc */
-       dot = NULL;
-    pthread_mutex_lock (&mutexPrintStat);
-    (*fileProcess)( cur, dot, &cur->pstat, localCnt, localSz);
-    pthread_mutex_unlock (&mutexPrintStat);
-    if ( cur->flag == 0 ) { /* this instance of fileDir is a thread */
-        pthread_mutex_lock ( &mutexFD );
-#ifdef THRD_DEBUG
-        fprintf( stderr, "msg=endTHRD,threadID=%ld,rdepth=%d,file=<%s>\n",
-        cur->THRDid, cur->flag, cur->dname );
-#endif
-        --ThreadCNT;
-        cur->THRDid = -1;
-        pthread_mutex_unlock ( &mutexFD );
-        pthread_exit( EXIT_SUCCESS );
-    }
-    /* else return ; */
+    if ( fr->ref )  /* queued mutations keep their own dup of the fd */
+        dirRefRelease( fr->ref );
+    if ( PROFILE )
+        profileRecord( t, fi, localCnt );
 #ifdef THRD_DEBUG
     fprintf( stderr, "msg=endRecurse,threadID=%ld,rdepth=%d,file=<%s>\n",
-        cur->THRDid, cur->flag, cur->dname );
+        t->THRDid, t->flag, pwPath(t) );
 #endif /* THRD_DEBUG */
 }
 
+/* a walker thread; walk the root frame and give the slot back */
+void
+*walkThread( void *arg )
+{
+    struct threadData *t = (struct threadData *) arg;
+    long t0 = MAX_BUFFER ? profileNow( ) : 0;
+    long tt = traceSampled( t->THRDid ) ? traceNow( ) : 0;
+    char name[32];
+
+    traceThread( t - tdslot );
+    if ( tt )
+        traceFlow( 'f', t->THRDid );
+    fileDir( t, 0 );
+    popFrame( t );
+    if ( MAX_BUFFER )
+        __sync_fetch_and_add( &WalkUs, profileNow( ) - t0 );
+    if ( tt ) {
+        sprintf( name, "thread %ld", t->THRDid );
+        traceSpan( "thread", name, tt, t->THRDid, -1, 0 );
+    }
+    perfDone( );
+    pthread_mutex_lock ( &mutexFD );
+#ifdef THRD_DEBUG
+    fprintf( stderr, "msg=endTHRD,threadID=%ld,rdepth=%d\n",
+        t->THRDid, t->flag );
+#endif
+    ThreadCNT--;
+    t->THRDid = -1;
+    pthread_cond_signal( &walkDone );
+    pthread_mutex_unlock ( &mutexFD );
+    pthread_exit( EXIT_SUCCESS );
+}
+
+/* add a walk root; lstat now so a bad root stops pwalk before the walk */
+void
+rootAdd( const char *path )
+{
+    struct walkRoot *r;
+
+    if ( NRoots == MaxRoots ) {
+        MaxRoots = MaxRoots ? MaxRoots * 2 : 16;
+        if ( (Roots = realloc( Roots, MaxRoots * sizeof(*Roots) )) == NULL ) {
+            fprintf( stderr, "out of memory: roots\n" );
+            exit( 1 );
+        }
+    }
+    r = &Roots[NRoots];
+    if ( (r->path = strdup( path )) == NULL ) {
+        fprintf( stderr, "out of memory: roots\n" );
+        exit( 1 );
+    }
+    if ( lstat( path, &r->st ) == -1 ) {
+        fprintf( stderr, "lstat: '%s' %s\n", path, strerror(errno));
+        exit(errno);
+    }
+    NRoots++;
+}
+
+/* --roots-from FILE; one directory per line, blank lines are skipped */
+void
+rootsRead( const char *fname )
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t max = 0;
+    ssize_t len;
+
+    if ( (fp = fopen( fname, "r" )) == NULL ) {
+        fprintf( stderr, "--roots-from: '%s' %s\n", fname, strerror(errno));
+        exit( 1 );
+    }
+    while ( (len = getline( &line, &max, fp )) != -1 ) {
+        if ( len && line[len - 1] == '\n' )
+            line[--len] = '\0';
+        if ( len )
+            rootAdd( line );
+    }
+    free( line );
+    fclose( fp );
+}
+
+/*
+ * Start root r on walker slot t, which the caller took.  Every root has
+ * its own depth and parent inode numbering.  Returns -1 if it could not
+ * be opened, the slot is free again.
+ */
+int
+rootStart( struct threadData *t, int r )
+{
+    struct dirFrame *fr;
+    int fd, i;
+
+    if ( (fd = open( Roots[r].path, O_RDONLY|O_DIRECTORY )) == -1 ) {
+        fprintf( stderr, "open: '%s' %s\n", Roots[r].path, strerror(errno));
+        pthread_mutex_lock( &mutexFD );
+        ThreadCNT--;
+        t->THRDid = -1;
+        pthread_mutex_unlock( &mutexFD );
+        return -1;
+    }
+    t->nframe = 0; t->nameLen = 0; t->pathFrame = -1;
+    i = pushFrame( t, Roots[r].path, strlen( Roots[r].path ) );
+    fr = &t->frame[i];
+    fr->fd = fd;
+    saveStat( &fr->st, &Roots[r].st );
+    fr->depth = 0;
+    fr->pinode = 0;
+    fr->id = __sync_add_and_fetch( &dirIds, 1 );
+    fr->pid = 0;
+    fr->root = r;
+    fr->pnode = PROFILE ? profileLoad( PROFILE ) : NULL;
+    pthread_create( &t->thread_id, &t->tattr, walkThread, (void*)t );
+    return 0;
+}
+
 int
 main( int argc, char* argv[] )
 {
-    int error, i, colon =':';
+    int error, i, r, failed =0, colon =':';
     char *s, *c, *gid_ptr;
-    struct stat root;
 
     if ( argc < 2 ) {
         printHelp( );
@@ -314,12 +718,95 @@ main( int argc, char* argv[] )
            exit(0); }
         if ( !strcmp(*argv, "--version" ) || !strcmp(*argv, "-v") )
            printVersion( );
-        if ( !strcmp(*argv, "--header" ) || !strcmp(*argv, "-v") )
-           printHeader();
+        if ( !strcmp(*argv, "--header" ) )
+           HEADER = 1;
+        if ( !strcmp(*argv, "--roots-from" )) {
+           argc--; argv++;
+           ROOTS_FROM = *argv;
+        }
         if ( !strcmp(*argv, "--exclude" )) {
            argc--; argv++;
            get_exclude_list(*argv, exclude_list);
            verify_paths(exclude_list); }
+        if ( !strncmp(*argv, "--format=", 9 )) {
+           FORMAT = *argv + 9;
+           if ( !strcmp(FORMAT, "sqlite") ) {
+              argc--; argv++;
+              SQLITE_DB = *argv;
+           }
+        }
+        if ( !strncmp(*argv, "--sorted=", 9 )) {
+           if ( !strcmp(*argv + 9, "path") )
+              SORTED = SORT_PATH;
+           else if ( !strcmp(*argv + 9, "inode") )
+              SORTED = SORT_INODE;
+           else {
+              fprintf(stderr, "--sorted=path or --sorted=inode\n");
+              exit(1);
+           }
+        }
+        if ( !strcmp(*argv, "--sort-mem" )) {
+           argc--; argv++;
+           SORT_MEM = atol(*argv);
+        }
+        if ( !strcmp(*argv, "--tmpdir" )) {
+           argc--; argv++;
+           SORT_TMP = *argv;
+        }
+        if ( !strcmp(*argv, "--max-buffer-mb" )) {
+           argc--; argv++;
+           MAX_BUFFER = atol(*argv);
+        }
+        if ( !strcmp(*argv, "--perf-report" ))
+           PERF = 1;
+        if ( !strcmp(*argv, "--trace" )) {
+           argc--; argv++;
+           TRACE = *argv;
+        }
+        if ( !strcmp(*argv, "--trace-sample" )) {
+           argc--; argv++;
+           TRACE_SAMPLE = atol(*argv);
+        }
+        if ( !strcmp(*argv, "--index" )) {
+           argc--; argv++;
+           INDEX = *argv;
+        }
+        if ( !strcmp(*argv, "--profile" )) {
+           argc--; argv++;
+           PROFILE = *argv;
+        }
+        if ( !strcmp(*argv, "--estimate" ))
+           ESTIMATE = 1;
+        if ( !strcmp(*argv, "--estimate-time" )) {
+           argc--; argv++;
+           EST_TIME = atof(*argv);
+        }
+        if ( !strcmp(*argv, "--estimate-error" )) {
+           argc--; argv++;
+           EST_ERROR = atof(*argv);
+        }
+        if ( !strcmp(*argv, "--dedupe-scan" ))
+           DEDUPE = 1;
+        if ( !strcmp(*argv, "--dedupe-threads" )) {
+           argc--; argv++;
+           DEDUPE_THREADS = atoi(*argv);
+        }
+        if ( !strcmp(*argv, "--watch" )) {
+           argc--; argv++;
+           WATCH = *argv;
+        }
+        if ( !strcmp(*argv, "--watch-interval" )) {
+           argc--; argv++;
+           WATCH_INTERVAL = atol(*argv);
+        }
+        if ( !strcmp(*argv, "--where" )) {
+           argc--; argv++;
+           WHERE = filterCompile(*argv);
+        }
+        if ( !strcmp(*argv, "--prune" )) {
+           argc--; argv++;
+           PRUNE = filterCompile(*argv);
+        }
         if ( !strcmp(*argv, "--one-file-system" ) || !strcmp(*argv, "-x") )
            ONE_FS = 1;
         if ( !strcmp(*argv, "--chown_from")) {
@@ -327,6 +814,24 @@ main( int argc, char* argv[] )
            UID_orig = atoi(*argv);
            chown_flag++;
         }
+        if ( !strcmp(*argv, "--dry-run"))
+           DRY_RUN = 1;
+        if ( !strcmp(*argv, "--journal")) {
+           argc--; argv++;
+           JOURNAL = *argv;
+        }
+        if ( !strcmp(*argv, "--rollback")) {
+           argc--; argv++;
+           ROLLBACK = *argv;
+        }
+        if ( !strcmp(*argv, "--mutators")) {
+           argc--; argv++;
+           MUTATORS = atoi(*argv);
+        }
+        if ( !strcmp(*argv, "--inflight")) {
+           argc--; argv++;
+           INFLIGHT = atoi(*argv);
+        }
         if ( !strcmp(*argv, "--chown_to")) {
            argc--; argv++;
            UID_new = atoi(*argv);
@@ -343,10 +848,87 @@ main( int argc, char* argv[] )
     if (setuid((uid_t) 0)) {
        fprintf(stderr, "unable to setuid root; not all files will be processed\n");
     }
+    if ( ROLLBACK ) {
+       journalRollback( ROLLBACK, MUTATORS, DRY_RUN );
+       exit( EXIT_SUCCESS );
+    }
+    if ( JOURNAL && chown_flag != 2 ) {
+       fprintf(stderr, "--journal records the changes of --chown_from and --chown_to\n");
+       exit(1);
+    }
+    for ( ; argc > 0; argc--, argv++ )
+       rootAdd( *argv );
+    if ( ROOTS_FROM )
+       rootsRead( ROOTS_FROM );
+    if ( NRoots == 0 ) {
+       printHelp( );
+       exit( EXIT_FAILURE );
+    }
+    if ( NRoots > 1 && (ESTIMATE || WATCH || INDEX || PROFILE) ) {
+       fprintf(stderr, "--estimate, --watch, --index and --profile take one"
+               " root\n");
+       exit(1);
+    }
+    ROOT_ID = NRoots > 1;
     fileProcess = &printStat;
+    if ( !strcmp(FORMAT, "pgcopy") ) {
+       fileProcess = &printPgCopy;
+       pgcopyHeader( );
+#ifdef HAVE_SQLITE
+    } else if ( !strcmp(FORMAT, "sqlite") && SQLITE_DB ) {
+       fileProcess = &printSqlite;
+       PROCESS_LOCK = 0;
+       sqliteOpen( SQLITE_DB );
+#endif
+    } else if ( strcmp(FORMAT, "csv") ) {
+       fprintf(stderr, "unknown --format=%s\n", FORMAT);
+       exit(1);
+    } else if ( HEADER && !DEDUPE && !WATCH )
+       pwHeader( stdout, ROOT_ID ? PW_HDR_ROOT : 0 );
+    if ( SORTED && fileProcess != &changeOwner
+#ifdef HAVE_SQLITE
+         && fileProcess != &printSqlite
+#endif
+       )
+       PROCESS_LOCK = 0;   /* records go to per walker run buffers */
     if ( chown_flag == 2 ) {
        fprintf(stderr, "chown UID_orig: %d  UID_new: %d GID_new: %d\n", (int)UID_orig, (int)UID_new, (int)GID_new);
        fileProcess = &changeOwner;
+       PROCESS_LOCK = 0;
+       if ( JOURNAL && !DRY_RUN )
+          journalOpen( JOURNAL, MUTATORS );
+       mutateStart( MUTATORS, INFLIGHT );
+    }
+    if ( DEDUPE ) {
+       if ( SORTED || chown_flag || WATCH || strcmp(FORMAT, "csv") ) {
+          fprintf(stderr, "--dedupe-scan writes its own report; no --sorted,"
+                  " --format, --watch or --chown_*\n");
+          exit(1);
+       }
+       if ( DEDUPE_THREADS < 1 )
+          DEDUPE_THREADS = 1;
+       fileProcess = &dedupeEntry;
+       PROCESS_LOCK = 0;
+    }
+    if ( WATCH ) {
+       if ( WHERE || PRUNE || SORTED || chown_flag || strcmp(FORMAT, "csv") ) {
+          fprintf(stderr, "--watch writes csv of the whole walk; no --where,"
+                  " --prune, --sorted, --format or --chown_*\n");
+          exit(1);
+       }
+       fileProcess = &watchEntry;
+       PROCESS_LOCK = 1;
+    }
+    if ( TRACE )
+       traceOpen( );
+    if ( MAX_BUFFER ) {
+       if ( SORTED || (fileProcess != &printStat && fileProcess != &printPgCopy) ) {
+          fprintf(stderr, "--max-buffer-mb buffers csv and pgcopy output;"
+                  " --sorted has --sort-mem\n");
+          exit(1);
+       }
+       PROCESS_LOCK = 0;   /* records go to per walker chunks */
+       outputStart( );
     }
     for ( i=0; i<MAXTHRDS; i++ ) {
         tdslot[i].THRDid = -1;
@@ -361,19 +943,58 @@ main( int argc, char* argv[] )
     }
     pthread_mutex_init(&mutexFD, NULL);
     pthread_mutex_init(&mutexPrintStat, NULL);
+    pthread_cond_init(&walkDone, NULL);
 
-    strcpy( tdslot[0].dname, (const char*) *argv );
-    if ( lstat( *argv, &root ) == -1 ) {
-        fprintf( stderr, "lstat: '%s' %s\n", *argv, strerror(errno));
-        exit(errno);
+    ST_DEV = Roots[0].st.st_dev;
+    if ( ESTIMATE ) {
+        estimate( Roots[0].path, EST_TIME, EST_ERROR );
+        exit( EXIT_SUCCESS );
+    }
+    if ( WATCH )
+        watchStart( Roots[0].path, WATCH, WATCH_INTERVAL );
+    /*
+     * Roots take walker slots as they come free, in the order given.
+     * Until the last one has a slot walkers recurse instead of taking
+     * free slots, then the big roots get the idle threads.
+     */
+    RootsLeft = NRoots;
+    pthread_mutex_lock( &mutexFD );
+    for ( r = 0; r < NRoots; r++ ) {
+        while ( ThreadCNT == MAXTHRDS )
+            pthread_cond_wait( &walkDone, &mutexFD );
+        for ( i = 0; tdslot[i].THRDid != -1; i++ )
+            ;
+        tdslot[i].THRDid = totalTHRDS++;
+        tdslot[i].flag = 0;
+        ThreadCNT++;
+        RootsLeft--;
+        pthread_mutex_unlock( &mutexFD );
+        if ( rootStart( &tdslot[i], r ) )
+            failed++;
+        pthread_mutex_lock( &mutexFD );
     }
-    ST_DEV = root.st_dev;
-    memcpy( &tdslot[0].pstat, &root, sizeof( struct stat ) );
-    tdslot[0].THRDid = totalTHRDS++; /* first thread is zero */
-    tdslot[0].flag = 0;
-    tdslot[0].depth = 0;
-    tdslot[0].pinode = 0;
-    pthread_create( &(tdslot[0].thread_id), &tdslot[0].tattr, fileDir,
-                    (void*)&tdslot[0] );
-    pthread_exit( NULL );
+    while ( ThreadCNT > 0 )
+        pthread_cond_wait( &walkDone, &mutexFD );
+    pthread_mutex_unlock( &mutexFD );
+    if ( fileProcess == &changeOwner )
+        mutateFinish( );
+    outputFinish( );
+    if ( fileProcess == &dedupeEntry )
+        dedupeReport( DEDUPE_THREADS );
+    if ( fileProcess == &printPgCopy )
+        pgcopyTrailer( );
+#ifdef HAVE_SQLITE
+    if ( fileProcess == &printSqlite )
+        sqliteClose( );
+#endif
+    fflush( stdout );
+    perfReport( MAXTHRDS );
+    traceWrite( );
+    if ( INDEX && indexWrite( INDEX ) )
+        exit( EXIT_FAILURE );
+    if ( PROFILE && profileWrite( PROFILE ) )
+        exit( EXIT_FAILURE );
+    if ( WATCH )
+        watchRun( );
+    exit( failed ? EXIT_FAILURE : EXIT_SUCCESS );
 }
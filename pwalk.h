@@ -1,10 +1,109 @@
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include "pwrecord.h"
+
+#define MAXTHRDS 32
+
+/* stat fields kept for a directory while it is being walked */
+struct dirStat {
+    ino_t    ino;
+    dev_t    dev;
+    uid_t    uid;
+    gid_t    gid;
+    mode_t   mode;
+    nlink_t  nlink;
+    off_t    size;
+    blkcnt_t blocks;
+    time_t   atime, mtime, ctime;
+    };
+
+/*
+ * One frame per directory on a walker's stack.  Frames live in the walker's
+ * frame arena and refer to their name by offset into the walker's name
+ * arena; the full path is only rebuilt when somebody asks for it.
+ */
+struct dirFrame {
+    int    parent;              /* index of parent frame, -1 for walker root */
+    int    fd;                  /* open directory */
+    size_t name;                /* offset in name arena, root holds full path */
+    size_t nlen;                /* length of name */
+    long   depth;               /* directory depth */
+    long   id, pid;             /* unique directory id, parent id */
+    int    root;                /* walk root, 0 for the first */
+    ino_t  pinode;              /* Parent Inode */
+    struct dirStat st;          /* this directory */
+    struct dirRef *ref;         /* fd shared with queued mutations */
+    struct profNode *pnode;     /* --profile of the last run, NULL if cheap */
+    long   t0, kidUs;           /* --profile start, time of recursed dirs */
+    };
+
 struct threadData {
-    char dname[FILENAME_MAX+1]; /* full path and basename */
-    ino_t pinode;               /* Parent Inode */
-    long depth;                 /* directory depth */
     long THRDid;                /* unique ID increaments with each new THRD */
     int  flag;                  /* 0 if thread; recursion > 0 */
-    struct stat pstat;          /* Parent inode stat struct */
     pthread_t thread_id;        /* system assigned */
     pthread_attr_t tattr;
+    struct dirFrame *frame;     /* frame arena, frame[0] is the thread root */
+    int  nframe, maxframe;
+    char *names;                /* name arena */
+    size_t nameLen, nameMax;
+    char *path;                 /* lazily rebuilt path of frame pathFrame */
+    size_t pathLen, pathMax;
+    int  pathFrame;             /* -1 if path is stale */
+    int  cur;                   /* frame being processed */
+    const char *ename;          /* entry of cur being processed, NULL is cur */
+    struct idxSlot *idx;        /* directories recorded for --index */
+    struct runBuf *run;         /* --sorted run buffer */
+    struct profSlot *prof;      /* directories recorded for --profile */
+    struct dupSlot *dup;        /* files recorded for --dedupe-scan */
+    };
+
+#define curFrame(t) (&(t)->frame[(t)->cur])
+
+extern int ROOT_ID;             /* records carry the root, more than one */
+
+char *pwPath( struct threadData *t );
+void saveStat( struct dirStat *d, struct stat *f );
+void loadStat( struct stat *f, struct dirStat *d );
+
+/* filter.c  --where and --prune expressions */
+struct filter;
+struct filter *filterCompile( const char *expr );
+int filterMatch( struct filter *flt, struct threadData *t, const char *name,
+                 const char *exten, struct stat *f, long depth );
+
+/* index.c  --index subtree index */
+extern long dirIds;
+void indexRecord( struct threadData *t, int fi, long files, long bytes,
+                  long blocks );
+int indexWrite( const char *fname );
+
+/* profile.c  --profile history-guided scheduling */
+struct profNode {               /* an expensive subtree of the last run */
+    const char *name;
+    long   entries, usec;       /* whole subtree */
+    struct profNode **kid;      /* most expensive first */
+    int    nkid;
+    int    started;             /* handed out before readdir */
+    char   path[];
     };
+long profileNow( );
+void profileRecord( struct threadData *t, int fi, long entries );
+int profileWrite( const char *fname );
+struct profNode *profileLoad( const char *fname );
+struct profNode *profileKid( struct profNode *p, const char *name );
+
+/* estimate.c  --estimate sampling */
+void estimate( const char *root, double seconds, double error );
+
+/* dedupe.c  --dedupe-scan duplicate files */
+void dedupeEntry( struct threadData *cur, char *exten, struct stat *f,
+                  long fileCnt, long dirSz );
+void dedupeReport( int threads );
+
+/* watch.c  --watch fanotify daemon */
+void watchEntry( struct threadData *cur, char *exten, struct stat *f,
+                 long fileCnt, long dirSz );
+void watchStart( const char *root, const char *ckpt, long interval );
+void watchRun( );
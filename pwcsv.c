@@ -0,0 +1,242 @@
+/*
+ *  pwcsv.c  read pwalk output back; CSV or --format=pgcopy
+
+Copyright (C) (2013-2016) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+/*
+
+CSV records are one per line; csv_escape() drops control characters so a
+newline never appears inside a quoted name. Quotes inside a name are
+doubled. The reader undoes the doubling in place. Columns after the 17th,
+like the action of ppurge --report, are ignored, and so are the fields of
+a pgcopy tuple after the 17th, like the root id of a walk of several roots.
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "pwcsv.h"
+
+#define NFIELDS 17
+
+/*
+ * split one CSV line (without the newline) into r; returns 0 or -1 if the
+ * line is not a pwalk record
+ */
+int
+pwParseLine( char *s, size_t len, struct pwRec *r )
+{
+    char *end = s + len, *f[NFIELDS], *o;
+    size_t flen[NFIELDS];
+    int n = 0;
+
+    while ( n < NFIELDS && s <= end ) {
+        if ( s < end && *s == '"' ) {   /* quoted, "" is a quote */
+            f[n] = o = ++s;
+            while ( s < end ) {
+                if ( *s == '"' ) {
+                    if ( s + 1 < end && s[1] == '"' ) {
+                        *o++ = '"'; s += 2;
+                        continue;
+                    }
+                    break;
+                }
+                *o++ = *s++;
+            }
+            if ( s == end )
+                return -1;
+            flen[n] = o - f[n];
+            s++;                        /* closing quote */
+        } else {
+            f[n] = s;
+            while ( s < end && *s != ',' )
+                s++;
+            flen[n] = s - f[n];
+        }
+        n++;
+        if ( s < end && *s != ',' )
+            return -1;
+        s++;
+    }
+    if ( n != NFIELDS )
+        return -1;
+    r->ino = strtoull( f[0], NULL, 10 );
+    r->pino = strtoull( f[1], NULL, 10 );
+    r->depth = strtol( f[2], NULL, 10 );
+    r->name = f[3]; r->nlen = flen[3];
+    r->ext = f[4];  r->elen = flen[4];
+    r->uid = strtol( f[5], NULL, 10 );
+    r->gid = strtol( f[6], NULL, 10 );
+    r->size = strtol( f[7], NULL, 10 );
+    r->dev = strtol( f[8], NULL, 10 );
+    r->blocks = strtol( f[9], NULL, 10 );
+    r->nlink = strtol( f[10], NULL, 10 );
+    r->mode = strtol( f[11], NULL, 8 );
+    r->atime = strtol( f[12], NULL, 10 );
+    r->mtime = strtol( f[13], NULL, 10 );
+    r->ctime = strtol( f[14], NULL, 10 );
+    r->fcount = strtol( f[15], NULL, 10 );
+    r->dirsum = strtol( f[16], NULL, 10 );
+    return 0;
+}
+
+int
+pwOpen( struct pwReader *rd, const char *fname )
+{
+    char sig[19];
+
+    memset( rd, 0, sizeof(*rd) );
+    if ( !strcmp( fname, "-" ) )
+        rd->fp = stdin;
+    else if ( (rd->fp = fopen( fname, "r" )) == NULL ) {
+        fprintf( stderr, "%s: %s\n", fname, strerror(errno) );
+        return -1;
+    }
+    setvbuf( rd->fp, NULL, _IOFBF, 1 << 20 );
+    /* PGCOPY signature, flags and header extension */
+    if ( fread( sig, 1, 19, rd->fp ) == 19 &&
+         !memcmp( sig, "PGCOPY\n\377\r\n\0", 11 ) ) {
+        rd->pgcopy = 1;
+        return 0;
+    }
+    if ( rd->fp == stdin ) {
+        fprintf( stderr, "stdin must be pgcopy or seekable\n" );
+        return -1;
+    }
+    rewind( rd->fp );
+    return 0;
+}
+
+static int64_t
+be64( const unsigned char *p )
+{
+    uint64_t v = 0;
+    int i;
+
+    for ( i = 0; i < 8; i++ )
+        v = v << 8 | p[i];
+    return (int64_t)v;
+}
+
+static uint32_t
+be32( const unsigned char *p )
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* 1 a record, 0 the trailer, -1 a bad or cut off tuple */
+static int
+pgNext( struct pwReader *rd, struct pwRec *r )
+{
+    unsigned char hdr[4];
+    int64_t v[NFIELDS];
+    char *s[2];
+    size_t sl[2], need;
+    uint32_t len;
+    int i, nf, ns = 0;
+
+    if ( fread( hdr, 1, 2, rd->fp ) != 2 )
+        goto cut;
+    if ( hdr[0] == 0xff && hdr[1] == 0xff )
+        return 0;
+    if ( (nf = hdr[0] << 8 | hdr[1]) < NFIELDS ) {
+        fprintf( stderr, "pgcopy: bad tuple after record %ld\n", rd->line );
+        return -1;
+    }
+    need = 0;
+    for ( i = 0; i < nf; i++ ) {
+        if ( fread( hdr, 1, 4, rd->fp ) != 4 )
+            goto cut;
+        len = be32( hdr );
+        if ( i >= NFIELDS ) {           /* root id and the like */
+            if ( len == 0xffffffff )    /* NULL */
+                continue;
+            while ( len > 0 && getc( rd->fp ) != EOF )
+                len--;
+            if ( len )
+                goto cut;
+            continue;
+        }
+        if ( need + len + 8 > rd->max ) {
+            rd->max = (need + len + 8) * 2;
+            rd->buf = realloc( rd->buf, rd->max );
+        }
+        if ( fread( rd->buf + need, 1, len, rd->fp ) != len )
+            goto cut;
+        if ( i == 3 || i == 4 ) {   /* names are offsets until buf is final */
+            s[ns] = (char *)need; sl[ns++] = len;
+            need += len;
+        } else if ( len == 8 )
+            v[i] = be64( (unsigned char *)rd->buf + need );
+        else
+            v[i] = (int32_t)be32( (unsigned char *)rd->buf + need );
+    }
+    r->ino = v[0]; r->pino = v[1]; r->depth = v[2];
+    r->name = rd->buf + (size_t)s[0]; r->nlen = sl[0];
+    r->ext = rd->buf + (size_t)s[1];  r->elen = sl[1];
+    r->uid = v[5]; r->gid = v[6]; r->size = v[7]; r->dev = v[8];
+    r->blocks = v[9]; r->nlink = v[10]; r->mode = v[11];
+    r->atime = v[12]; r->mtime = v[13]; r->ctime = v[14];
+    r->fcount = v[15]; r->dirsum = v[16];
+    return 1;
+cut:
+    fprintf( stderr, "pgcopy: input is cut off after record %ld\n", rd->line );
+    return -1;
+}
+
+/*
+ * next record; 1 found, 0 end of input, -1 a line that is not a record or
+ * a bad pgcopy tuple. After a bad CSV line the next call goes on with the
+ * line after it; pgcopy can not go on.
+ */
+int
+pwNext( struct pwReader *rd, struct pwRec *r )
+{
+    ssize_t len;
+    int ret;
+
+    if ( rd->pgcopy ) {
+        if ( (ret = pgNext( rd, r )) == 1 )
+            rd->line++;
+        return ret;
+    }
+    while ( (len = getline( &rd->buf, &rd->max, rd->fp )) > 0 ) {
+        rd->line++;
+        if ( rd->buf[len - 1] == '\n' )
+            len--;
+        if ( rd->line == 1 && !strncmp( rd->buf, "inode,", 6 ) )
+            continue;                   /* --header */
+        if ( pwParseLine( rd->buf, len, r ) == 0 )
+            return 1;
+        fprintf( stderr, "line %ld is not a pwalk record\n", rd->line );
+        return -1;
+    }
+    return 0;
+}
+
+void
+pwClose( struct pwReader *rd )
+{
+    if ( rd->fp && rd->fp != stdin )
+        fclose( rd->fp );
+    free( rd->buf );
+}
@@ -0,0 +1,35 @@
+/*
+ *  pwcsv.h  read pwalk output back; CSV or --format=pgcopy
+ */
+#ifndef PWCSV_H
+#define PWCSV_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* one pwalk record; name and ext point into the reader's buffer */
+struct pwRec {
+    uint64_t ino, pino;
+    long   depth;
+    char   *name, *ext;
+    size_t nlen, elen;
+    long   uid, gid, size, dev, blocks, nlink;
+    int    mode;
+    long   atime, mtime, ctime;
+    long   fcount, dirsum;
+    };
+
+struct pwReader {
+    FILE   *fp;
+    int    pgcopy;              /* binary COPY input */
+    char   *buf;
+    size_t max;
+    long   line;                /* records read, for error messages */
+    };
+
+int pwOpen( struct pwReader *rd, const char *fname );
+int pwNext( struct pwReader *rd, struct pwRec *r );
+void pwClose( struct pwReader *rd );
+int pwParseLine( char *s, size_t len, struct pwRec *r );
+
+#endif /* PWCSV_H */
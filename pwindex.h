@@ -0,0 +1,60 @@
+/*
+ *  pwindex.h  on-disk subtree index written by pwalk --index, read by
+ *             pwalk-query
+ *
+ *  Directories are stored in DFS pre-order.  The subtree of dir[i] is
+ *  dir[i] .. dir[end-1]; its first child is dir[i+1] and the next sibling
+ *  of a child c is dir[c.end].  Every directory carries its own counts and
+ *  the cumulative counts of its subtree.  A table of path hashes sorted by
+ *  hash finds a directory by name with a binary search.
+ */
+#ifndef PWINDEX_H
+#define PWINDEX_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PWINDEX_MAGIC "PWIDX001"
+
+struct pwIndexHeader {
+    char     magic[8];
+    uint64_t ndirs;
+    uint64_t dirOff;            /* struct pwIndexDir[ndirs] */
+    uint64_t hashOff;           /* struct pwIndexHash[ndirs] sorted by hash */
+    uint64_t namesOff;          /* names, not terminated */
+    uint64_t namesLen;
+    int64_t  created;           /* time of the walk */
+    };
+
+struct pwIndexDir {
+    uint64_t ino;
+    uint64_t name;              /* offset in names, root holds the full path */
+    uint32_t nlen;
+    uint32_t parent;            /* index of parent, self for the root */
+    uint32_t end;               /* one past the last dir of the subtree */
+    uint32_t depth;             /* 0 for the root */
+    int64_t  mtime;
+    uint32_t uid, gid;
+    uint64_t files, bytes, blocks;          /* this directory only */
+    uint64_t cfiles, cbytes, cblocks, cdirs; /* subtree, including self */
+    };
+
+struct pwIndexHash {
+    uint64_t hash;
+    uint64_t dir;
+    };
+
+/* FNV-1a; pwalk and pwalk-query must agree on it */
+static inline uint64_t
+pwIndexHash( const char *s, size_t len )
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while ( len-- ) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+#endif /* PWINDEX_H */
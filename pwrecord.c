@@ -0,0 +1,118 @@
+/*
+ *  pwrecord.c  the pwalk CSV record
+
+Copyright (C) (2013-2016) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+/*
+
+One line per file in the printStat schema. pwalk prints it for --format=csv,
+ppurge --report prints the same fields from the stat of its own walk and
+adds the action taken as an 18th column. Readers of pwalk output (pwcsv.c)
+ignore columns after the 17th.
+
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "pwrecord.h"
+
+/* Escape CSV delimeters */
+void
+csv_escape(char *in, char *out)
+{
+   char *orig;
+   int cnt = 0;
+
+   orig = in;
+   while ( *in ) {
+      if ( *in == '"' )
+          *out++ = '"';
+      if ( (unsigned char)*in < 32 ) {
+          in++;
+          cnt++;
+      } else
+          *out++ = *in++;
+   }
+   *out = '\0';
+   if ( cnt )
+       fprintf( stderr, "Bad File: %s\n", orig);
+}
+
+/* file extension; last part of name after a dot. Dot files have none */
+char *
+fileExten( char *name )
+{
+    char *s, *dot = NULL;
+
+    if ( (s = strrchr( name, '/' )) != NULL )
+        name = s + 1;
+    for ( s = name + 1; *name && *s; s++ )
+        if ( *s == '.' )
+            dot = s + 1;
+    return dot;
+}
+
+void
+pwHeader( FILE *fp, int cols )
+{
+   fprintf(fp, "inode,parent-inode,directory-depth,\"filename\"");
+   fprintf(fp, ",\"fileExtension\",UID,GID,st_size,st_dev,st_blocks" );
+   fprintf(fp, ",st_nlink,\"st_mode\",st_atime,st_mtime,st_ctime,pw_fcount");
+   fprintf(fp, ",pw_dirsum%s%s\n", cols & PW_HDR_ROOT ? ",root" : "",
+           cols & PW_HDR_ACTION ? ",action" : "");
+}
+
+/*
+ * format one record into o, which has room for PW_RECORD_MAX; returns its
+ * length. fileCnt is -1 for anything but a directory. root -1 and action
+ * NULL leave their columns out.
+ */
+size_t
+pwRecord( char *o, uint64_t ino, uint64_t pino, long depth,
+          char *path, char *exten, struct stat *f,
+          long fileCnt, long dirSz, int root, const char *action )
+{
+   char *p = o;
+
+   p += sprintf( p, "%ju,%ju,%ld,\"", (uintmax_t)ino, (uintmax_t)pino, depth );
+   csv_escape( path, p );
+   p += strlen( p );
+   *p++ = '"'; *p++ = ','; *p++ = '"';
+   *p = '\0';
+   if ( exten ) {
+      csv_escape( exten, p );
+      p += strlen( p );
+   }
+   p += sprintf( p, "\",%ld,%ld,%ld,%ld,%ld,%d,\"%07o\",%ld,%ld,%ld,%ld,%ld",
+            (long)f->st_uid,
+            (long)f->st_gid, (long)f->st_size, (long)f->st_dev,
+            (long)f->st_blocks, (int)f->st_nlink,
+            (int)f->st_mode,
+            (long)f->st_atime, (long)f->st_mtime, (long)f->st_ctime,
+            fileCnt, dirSz );
+   if ( root >= 0 )
+      p += sprintf( p, ",%d", root );
+   if ( action )
+      p += sprintf( p, ",%s", action );
+   *p++ = '\n';
+   *p = '\0';
+   return p - o;
+}
@@ -0,0 +1,43 @@
+/*
+ *  pwrecord.h  the pwalk CSV record and where records go; shared by
+ *  pwalk and ppurge
+ */
+#ifndef PWRECORD_H
+#define PWRECORD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* pwrecord.c  printStat schema */
+void csv_escape( char *in, char *out );
+char *fileExten( char *name );
+void pwHeader( FILE *fp, int cols );
+#define PW_HDR_ACTION 1         /* ppurge action column */
+#define PW_HDR_ROOT   2         /* pwalk root column, more than one root */
+
+/* bytes pwRecord() may need for a path and extension of plen and elen */
+#define PW_RECORD_MAX(plen, elen) (2*(plen) + 2*(elen) + 512)
+
+size_t pwRecord( char *o, uint64_t ino, uint64_t pino, long depth,
+                 char *path, char *exten, struct stat *f,
+                 long fileCnt, long dirSz, int root, const char *action );
+
+/* output.c  record output, --sorted external sort */
+#define SORT_NONE  0
+#define SORT_PATH  1
+#define SORT_INODE 2
+extern int  SORTED;
+extern long SORT_MEM;
+extern char *SORT_TMP;
+extern FILE *OutFp;             /* stdout when NULL */
+extern long MAX_BUFFER;         /* --max-buffer-mb */
+extern long WalkUs;             /* walker time, reported with MAX_BUFFER */
+
+struct runBuf;
+void outputRecord( struct runBuf **run, const void *rec, size_t len,
+                   const char *path, uint64_t ino, uint64_t dev );
+void outputStart( );
+void outputFinish( );
+
+#endif /* PWRECORD_H */
@@ -14,6 +14,20 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+/*
+ * The walk works like pwalk: a directory gets a new thread while fewer than
+ * --threads are running, otherwise the walker recurses. Entries are stat'ed
+ * with fstatat relative to the open directory. Changes are queued with a dup
+ * of the directory fd (pipeline.c) and a pool of --mutators threads runs
+ * fchmodat/fchownat, so the walkers never wait on a metadata update.
+ * Every walker slot and mutator has its own log buffer, flushed with a
+ * single write() when full or when the thread is done; nothing is locked.
+ * Each directory carries the nearest suitable group at or above it, from the
+ * walk root down, so an entry with a private, root or listed group gets its
+ * new group without looking at its ancestors again. Where there is none the
+ * error is given once for the subtree, until a suitable group is found below.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,10 +36,14 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <grp.h>
 #include <stdarg.h>
 #include "repairshr.h"
+#include "pipeline.h"
+#include "journal.h"
+#include "perf.h"
 
 #define MAX_PATH 4096
 #define MAXEXFILES 512
@@ -34,35 +52,73 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 int SNAPSHOT = 0;
 int ONE_FS = 0;
 int DRY_RUN = 0;
+int THREADS = MAXTHRDS;  // walker threads
+int MUTATORS = 16;       // threads running fchmodat/fchownat
+int INFLIGHT = 1024;     // queued changes before walkers wait
+char *JOURNAL = NULL;    // --journal FILE of the changes made
 dev_t ST_DEV;
 
 char *exclude_list[MAXEXFILES];
 gid_t change_groups[MAX_GROUPS];
 int change_groups_count = 0;
 
+struct threadData tdslot[MAXTHRDS];
+struct logBuf slotLog[MAXTHRDS];
+int ThreadCNT = 1;
+long totalTHRDS = 0;
 pthread_mutex_t mutexFD;
-pthread_mutex_t mutexLog;
+pthread_cond_t walkDone = PTHREAD_COND_INITIALIZER;
+
+struct pipeline *Mutator;
+struct logBuf *MutLog;
+long mutChanged, mutFailed;
 
 // Function declarations
 int check_exclude_list(char *fname);
 void get_exclude_list(char* fname, char *list[]);
 void verify_paths(char *list[]);
 
-void log_change(const char *format, ...) {
+void log_flush(struct logBuf *l) {
+    if (l->olen && write(STDOUT_FILENO, l->out, l->olen) == -1) {
+        perror("change log");
+    }
+    if (l->elen && write(STDERR_FILENO, l->err, l->elen) == -1) {
+        perror("error log");
+    }
+    l->olen = l->elen = 0;
+}
+
+// append one line to buf; a line longer than the buffer is written by itself
+static void log_append(struct logBuf *l, char *buf, size_t *len,
+                       const char *format, va_list args) {
+    char line[PIPE_BUF];
+    int n = vsnprintf(line, sizeof(line), format, args);
+
+    if (n < 0) {
+        return;
+    }
+    if (n >= (int)sizeof(line)) {
+        n = sizeof(line) - 1;
+        line[n - 1] = '\n';
+    }
+    if (*len + n > PIPE_BUF) {
+        log_flush(l);
+    }
+    memcpy(buf + *len, line, n);
+    *len += n;
+}
+
+void log_change(struct logBuf *l, const char *format, ...) {
     va_list args;
     va_start(args, format);
-    pthread_mutex_lock(&mutexLog);
-    vprintf(format, args);
-    pthread_mutex_unlock(&mutexLog);
+    log_append(l, l->out, &l->olen, format, args);
     va_end(args);
 }
 
-void log_error(const char *format, ...) {
+void log_error(struct logBuf *l, const char *format, ...) {
     va_list args;
     va_start(args, format);
-    pthread_mutex_lock(&mutexLog);
-    vfprintf(stderr, format, args);
-    pthread_mutex_unlock(&mutexLog);
+    log_append(l, l->err, &l->elen, format, args);
     va_end(args);
 }
 
@@ -76,33 +132,87 @@ int should_change_group(gid_t gid) {
     return 0;
 }
 
-gid_t find_non_private_group(const char *path, gid_t start_gid) {
-    char current_path[MAX_PATH];
-    struct stat st;
-    strncpy(current_path, path, sizeof(current_path));
+// a group an entry can be given: not private, not root and not listed
+int suitable_group(struct stat *st) {
+    return st->st_gid != st->st_uid && st->st_gid != 0 && !should_change_group(st->st_gid);
+}
 
-    while (strlen(current_path) > 1) {
-        if (lstat(current_path, &st) == 0) {
-            if (st.st_gid != st.st_uid && st.st_gid != 0 && !should_change_group(st.st_gid)) {
-                return st.st_gid;
-            }
-        }
-        char *last_slash = strrchr(current_path, '/');
-        if (last_slash != NULL) {
-            *last_slash = '\0';
+// one queued change of an entry in dir; path is for the log, name its tail
+struct repairOp {
+    struct dirRef *dir;
+    struct stat old;     // for the journal
+    mode_t old_mode, new_mode;
+    gid_t old_gid, new_gid;
+    char *name;
+    char path[];
+};
+
+// fchmodat and fchownat, timed for --perf-report
+static int change_mode(struct repairOp *op) {
+    long t0 = perfStart();
+    int ret = fchmodat(op->dir->fd, op->name, op->new_mode & 07777, 0);
+
+    perfAdd(PERF_CHANGE, t0, -1, 0);
+    return ret;
+}
+
+static int change_group(struct repairOp *op) {
+    long t0 = perfStart();
+    int ret = fchownat(op->dir->fd, op->name, -1, op->new_gid, AT_SYMLINK_NOFOLLOW);
+
+    perfAdd(PERF_CHANGE, t0, -1, 0);
+    return ret;
+}
+
+// a mutator; apply one change relative to the directory fd
+void repair_work(void *item, int worker) {
+    struct repairOp *op = (struct repairOp *)item;
+    struct logBuf *l = &MutLog[worker];
+    mode_t mode = op->old_mode;  // what was applied
+    gid_t gid = op->old_gid;
+
+    journalHold(worker);
+    if (op->new_mode != op->old_mode) {
+        if (DRY_RUN) {
+            log_change(l, "Would change mode of %s from %o to %o\n", op->path, op->old_mode, op->new_mode);
+        } else if (change_mode(op) != 0) {
+            __sync_fetch_and_add(&mutFailed, 1);
+            log_error(l, "Error: Failed to change mode for %s: %s\n", op->path, strerror(errno));
         } else {
-            break;
+            __sync_fetch_and_add(&mutChanged, 1);
+            mode = op->new_mode;
+            log_change(l, "Changed mode of %s from %o to %o\n", op->path, op->old_mode, op->new_mode);
         }
     }
 
-    // If we reach here, we didn't find a suitable non-private, non-root group
-    return 0;  // Indicate that no suitable group was found
+    if (op->new_gid != op->old_gid) {
+        if (DRY_RUN) {
+            log_change(l, "Would change group of %s from %d to %d\n", op->path, op->old_gid, op->new_gid);
+        } else if (change_group(op) != 0) {
+            __sync_fetch_and_add(&mutFailed, 1);
+            log_error(l, "Error: Failed to change group for %s: %s\n", op->path, strerror(errno));
+        } else {
+            __sync_fetch_and_add(&mutChanged, 1);
+            gid = op->new_gid;
+            log_change(l, "Changed group of %s from %d to %d\n", op->path, op->old_gid, op->new_gid);
+        }
+    }
+    if (mode != op->old_mode || gid != op->old_gid) {
+        journalAdd(worker, op->path, &op->old, mode, op->old.st_uid, gid);
+    }
+    journalRelease(worker);
+    dirRefRelease(op->dir);
+    free(op);
 }
 
-void repair_permissions(const char *path, struct stat *st) {
+// decide what name in cur needs and queue it; cur->dname is its path
+void repair_permissions(struct threadData *cur, struct dirRef **ref,
+                        const char *name, struct stat *st) {
     mode_t new_mode = st->st_mode;
     gid_t new_gid = st->st_gid;
     int changes = 0;
+    struct repairOp *op;
+    size_t len;
 
     // Set setgid bit on directories
     if (S_ISDIR(st->st_mode) && !(st->st_mode & S_ISGID)) {
@@ -110,14 +220,15 @@ void repair_permissions(const char *path, struct stat *st) {
         changes = 1;
     }
 
-    // Check for private group, root group, or groups to change
-    if (st->st_gid == st->st_uid || st->st_gid == 0 || should_change_group(st->st_gid)) {
-        gid_t non_private_gid = find_non_private_group(path, st->st_gid);
-        if (non_private_gid != 0) {
-            new_gid = non_private_gid;
+    // Private group, root group, or groups to change get the group of the
+    // nearest directory up to the walk root that has a suitable one
+    if (!suitable_group(st)) {
+        if (cur->group != 0) {
+            new_gid = cur->group;
             changes = 1;
-        } else {
-            log_error("Error: No suitable non-private, non-root group found for %s (current gid: %d)\n", path, st->st_gid);
+        } else if (!cur->reported) {
+            cur->reported = 1;
+            log_error(cur->log, "Error: No suitable non-private, non-root group found for %s (current gid: %d) or above it up to the walk root; groups in that part of the tree are not changed\n", cur->dname, st->st_gid);
         }
     }
 
@@ -127,62 +238,71 @@ void repair_permissions(const char *path, struct stat *st) {
             new_mode |= S_IRGRP | S_IXGRP;
             changes = 1;
         }
-    } else {
+    } else if (!S_ISLNK(st->st_mode)) {
         if ((st->st_mode & S_IRGRP) == 0) {
             new_mode |= S_IRGRP;
             changes = 1;
         }
     }
 
-    // Apply changes if needed
-    if (changes) {
-        if (new_mode != st->st_mode) {
-            if (DRY_RUN) {
-                log_change("Would change mode of %s from %o to %o\n", path, st->st_mode, new_mode);
-            } else {
-                if (chmod(path, new_mode) != 0) {
-                    log_error("Error: Failed to change mode for %s: %s\n", path, strerror(errno));
-                } else {
-                    log_change("Changed mode of %s from %o to %o\n", path, st->st_mode, new_mode);
-                }
-            }
-        }
-
-        if (new_gid != st->st_gid) {
-            if (DRY_RUN) {
-                log_change("Would change group of %s from %d to %d\n", path, st->st_gid, new_gid);
-            } else {
-                if (chown(path, -1, new_gid) != 0) {
-                    log_error("Error: Failed to change group for %s: %s\n", path, strerror(errno));
-                } else {
-                    log_change("Changed group of %s from %d to %d\n", path, st->st_gid, new_gid);
-                }
-            }
-        }
+    if (!changes || (new_mode == st->st_mode && new_gid == st->st_gid)) {
+        return;
+    }
+    // Queue the change; the mutator holds a dup of the directory fd
+    if (*ref == NULL && (*ref = dirRefOpen(cur->dirfd)) == NULL) {
+        log_error(cur->log, "Error: dup %s: %s\n", cur->dname, strerror(errno));
+        return;
     }
+    len = strlen(cur->dname);
+    if ((op = malloc(sizeof(struct repairOp) + len + 1)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    op->dir = dirRefHold(*ref);
+    op->old = *st;
+    op->old_mode = st->st_mode;
+    op->new_mode = new_mode;
+    op->old_gid = st->st_gid;
+    op->new_gid = new_gid;
+    memcpy(op->path, cur->dname, len + 1);
+    op->name = op->path + len - strlen(name);
+    pipelinePut(Mutator, op);
 }
 
 void *repair_directory(void *arg) {
     struct threadData *cur = (struct threadData *)arg;
+    struct threadData thrd_inst = {.THRDid = -1}, *new;
+    struct dirRef *ref = NULL;
     DIR *dirp;
     struct dirent *d;
-    char path[MAX_PATH];
     struct stat st;
-
-    if ((dirp = opendir(cur->dname)) == NULL) {
-        log_error("Error: Unable to open directory %s: %s\n", cur->dname, strerror(errno));
-        return NULL;
+    char *end;
+    size_t len;
+    int slot = 0, subfd;
+
+    if ((dirp = fdopendir(cur->dirfd)) == NULL) {
+        log_error(cur->log, "Error: Unable to open directory %s: %s\n", cur->dname, strerror(errno));
+        close(cur->dirfd);
+        goto return_thread;
     }
+    len = strlen(cur->dname);
+    end = cur->dname + len;
+    *end++ = '/';
 
-    while ((d = readdir(dirp)) != NULL) {
+    while ((d = perfReaddir(dirp, cur->depth, cur->dev)) != NULL) {
         if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
             continue;
         }
 
-        snprintf(path, sizeof(path), "%s/%s", cur->dname, d->d_name);
+        if (len + 1 + strlen(d->d_name) >= MAX_PATH) {
+            *end = '\0';
+            log_error(cur->log, "Error: Path too long %s%s\n", cur->dname, d->d_name);
+            continue;
+        }
+        strcpy(end, d->d_name);
 
-        if (lstat(path, &st) == -1) {
-            log_error("Error: Unable to stat %s: %s\n", path, strerror(errno));
+        if (perfFstatat(cur->dirfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW, cur->depth, cur->dev) == -1) {
+            log_error(cur->log, "Error: Unable to stat %s: %s\n", cur->dname, strerror(errno));
             continue;
         }
 
@@ -190,27 +310,77 @@ void *repair_directory(void *arg) {
             continue;
         }
 
-        repair_permissions(path, &st);
+        repair_permissions(cur, &ref, d->d_name, &st);
 
         if (S_ISDIR(st.st_mode)) {
             if (SNAPSHOT && strcmp(d->d_name, ".snapshot") == 0) {
                 continue;
             }
 
-            if (check_exclude_list(path)) {
+            if (check_exclude_list(cur->dname)) {
                 continue;
             }
 
-            struct threadData new_td;
-            strncpy(new_td.dname, path, sizeof(new_td.dname));
-            new_td.pinode = st.st_ino;
-            new_td.depth = cur->depth + 1;
+            if ((subfd = perfOpenat(cur->dirfd, d->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW,
+                                    cur->depth, cur->dev)) == -1) {
+                log_error(cur->log, "Error: Unable to open directory %s: %s\n", cur->dname, strerror(errno));
+                continue;
+            }
 
-            repair_directory(&new_td);
+            // a free slot gets a new thread, otherwise recurse
+            new = &thrd_inst;
+            perfLock(&mutexFD, PERF_LOCK_FD, cur->depth, cur->dev);
+            if (ThreadCNT < THREADS) {
+                for (slot = 0; slot < MAXTHRDS; slot++) {
+                    if (tdslot[slot].THRDid == -1) {
+                        new = &tdslot[slot];
+                        new->THRDid = totalTHRDS++;
+                        new->flag = 0;
+                        ThreadCNT++;
+                        break;
+                    }
+                }
+            }
+            pthread_mutex_unlock(&mutexFD);
+            if (new == &thrd_inst) {
+                new->THRDid = cur->THRDid;
+                new->flag = cur->flag + 1;
+                new->log = cur->log;
+            }
+            strcpy(new->dname, cur->dname);
+            new->dirfd = subfd;
+            new->pinode = st.st_ino;
+            new->group = suitable_group(&st) ? st.st_gid : cur->group;
+            new->reported = new->group ? 0 : cur->reported;
+            new->depth = cur->depth + 1;
+            new->dev = st.st_dev;
+
+            if (new != &thrd_inst) {
+                pthread_create(&new->thread_id, &new->tattr, repair_directory, new);
+            } else {
+                repair_directory(new);
+            }
         }
     }
 
+    *--end = '\0';
     closedir(dirp);
+    if (ref != NULL) {  // queued changes keep their own dup of the fd
+        dirRefRelease(ref);
+    }
+
+return_thread:
+    if (cur->flag == 0) {  // this instance is a thread
+        log_flush(cur->log);
+        perfDone();
+        pthread_mutex_lock(&mutexFD);
+        cur->THRDid = -1;
+        if (--ThreadCNT == 0) {
+            pthread_cond_signal(&walkDone);
+        }
+        pthread_mutex_unlock(&mutexFD);
+        pthread_exit(NULL);
+    }
     return NULL;
 }
 
@@ -230,12 +400,19 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "  -x, --one-file-system  Stay on one file system\n");
         fprintf(stderr, "  --dry-run           Show changes without making them\n");
         fprintf(stderr, "  --change-gids <gids>  Comma-separated list of group IDs to change\n");
+        fprintf(stderr, "  --threads <n>       Walker threads (default and most %d)\n", MAXTHRDS);
+        fprintf(stderr, "  --mutators <n>      Threads changing mode and group (default 16)\n");
+        fprintf(stderr, "  --inflight <n>      Queued changes before walkers wait (default 1024)\n");
+        fprintf(stderr, "  --journal <file>    Record every change made to file\n");
+        fprintf(stderr, "  --rollback <file>   Undo the changes in a journal that are still as made\n");
+        fprintf(stderr, "  --perf-report       Print syscall and lock latency percentiles and thread use\n");
         exit(1);
     }
 
     // Parse command-line arguments
     int i;
     char *directory = NULL;
+    char *rollback = NULL;
     for (i = 1; i < argc; i++) {
         if (argv[i][0] == '-') {
             if (strcmp(argv[i], "--NoSnap") == 0) {
@@ -252,6 +429,8 @@ int main(int argc, char *argv[]) {
                 ONE_FS = 1;
             } else if (strcmp(argv[i], "--dry-run") == 0) {
                 DRY_RUN = 1;
+            } else if (strcmp(argv[i], "--perf-report") == 0) {
+                PERF = 1;
             } else if (strcmp(argv[i], "--change-gids") == 0) {
                 if (++i < argc) {
                     char *token = strtok(argv[i], ",");
@@ -263,6 +442,32 @@ int main(int argc, char *argv[]) {
                     fprintf(stderr, "Error: --change-gids requires a comma-separated list of group IDs\n");
                     exit(1);
                 }
+            } else if (strcmp(argv[i], "--journal") == 0 || strcmp(argv[i], "--rollback") == 0) {
+                if (++i >= argc) {
+                    fprintf(stderr, "Error: %s requires a filename\n", argv[i - 1]);
+                    exit(1);
+                }
+                if (argv[i - 1][2] == 'j') {
+                    JOURNAL = argv[i];
+                } else {
+                    rollback = argv[i];
+                }
+            } else if (strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "--mutators") == 0 ||
+                       strcmp(argv[i], "--inflight") == 0) {
+                int n = (i + 1 < argc) ? atoi(argv[i + 1]) : 0;
+                if (n < 1 || (argv[i][2] == 't' && n > MAXTHRDS)) {
+                    fprintf(stderr, "Error: %s requires a count from 1%s\n", argv[i],
+                            argv[i][2] == 't' ? " to 32" : "");
+                    exit(1);
+                }
+                if (argv[i][2] == 't') {
+                    THREADS = n;
+                } else if (argv[i][2] == 'm') {
+                    MUTATORS = n;
+                } else {
+                    INFLIGHT = n;
+                }
+                i++;
             } else if (argv[i][1] == '-') {
                 fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
                 exit(1);
@@ -281,6 +486,11 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (rollback != NULL) {
+        journalRollback(rollback, MUTATORS, DRY_RUN);
+        return 0;
+    }
+
     if (directory == NULL) {
         fprintf(stderr, "Error: No directory specified\n");
         exit(1);
@@ -291,6 +501,7 @@ int main(int argc, char *argv[]) {
 
     if (DRY_RUN) {
         printf("Dry run mode: No changes will be made to the file system\n");
+        fflush(stdout);  // the logs below are written with write()
     }
 
     struct stat root_st;
@@ -302,17 +513,57 @@ int main(int argc, char *argv[]) {
     ST_DEV = root_st.st_dev;
 
     pthread_mutex_init(&mutexFD, NULL);
-    pthread_mutex_init(&mutexLog, NULL);
+    for (i = 0; i < MAXTHRDS; i++) {
+        int error;
+        tdslot[i].THRDid = -1;
+        tdslot[i].log = &slotLog[i];
+        if ((error = pthread_attr_init(&tdslot[i].tattr)) ||
+            (error = pthread_attr_setdetachstate(&tdslot[i].tattr, PTHREAD_CREATE_DETACHED))) {
+            fprintf(stderr, "Error: pthread attr: %s\n", strerror(error));
+            exit(1);
+        }
+    }
+    if ((MutLog = calloc(MUTATORS, sizeof(struct logBuf))) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    if (JOURNAL != NULL && !DRY_RUN) {
+        journalOpen(JOURNAL, MUTATORS);
+    }
+    Mutator = pipelineStart(MUTATORS, INFLIGHT, repair_work);
 
-    struct threadData root_td;
-    strncpy(root_td.dname, directory, sizeof(root_td.dname));
-    root_td.pinode = 0;
-    root_td.depth = 0;
+    strncpy(tdslot[0].dname, directory, sizeof(tdslot[0].dname) - 1);
+    if ((tdslot[0].dirfd = open(directory, O_RDONLY|O_DIRECTORY)) == -1) {
+        fprintf(stderr, "Error: Unable to open root directory %s: %s\n", directory, strerror(errno));
+        exit(1);
+    }
+    tdslot[0].pinode = 0;
+    tdslot[0].group = suitable_group(&root_st) ? root_st.st_gid : 0;
+    tdslot[0].reported = 0;
+    tdslot[0].depth = 0;
+    tdslot[0].dev = root_st.st_dev;
+    tdslot[0].THRDid = totalTHRDS++;
+    tdslot[0].flag = 0;
+
+    pthread_mutex_lock(&mutexFD);
+    pthread_create(&tdslot[0].thread_id, &tdslot[0].tattr, repair_directory, &tdslot[0]);
+    while (ThreadCNT > 0) {
+        pthread_cond_wait(&walkDone, &mutexFD);
+    }
+    pthread_mutex_unlock(&mutexFD);
 
-    repair_directory(&root_td);
+    pipelineFinish(Mutator);
+    for (i = 0; i < MUTATORS; i++) {
+        log_flush(&MutLog[i]);
+    }
+    journalClose();
+    if (!DRY_RUN) {
+        fprintf(stderr, "repair-shared: %ld changed, %ld failed, walkers waited %ld times\n",
+                mutChanged, mutFailed, Mutator->blocked);
+    }
+    perfReport(THREADS);
 
     pthread_mutex_destroy(&mutexFD);
-    pthread_mutex_destroy(&mutexLog);
 
     return 0;
-}
\ No newline at end of file
+}
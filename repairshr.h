@@ -2,12 +2,31 @@
 #define REPAIRSHR_H
 
 #include <sys/types.h>
+#include <pthread.h>
+#include <limits.h>
+
+#define MAXTHRDS 32
+
+// Changes and errors are batched per thread and written with one write()
+struct logBuf {
+    char out[PIPE_BUF];
+    char err[PIPE_BUF];
+    size_t olen, elen;
+};
 
 struct threadData {
     char dname[4096];  // Assuming MAX_PATH is 4096
+    int dirfd;         // open directory, entries are relative to it
     ino_t pinode;
+    gid_t group;       // nearest suitable group at or above, 0 if none
+    int reported;      // group is 0 and the error was given for this subtree
     long depth;
+    dev_t dev;         // st_dev of the directory, for --perf-report
+    long THRDid;       // -1 when the slot is free
+    int flag;          // 0 if thread; recursion > 0
+    pthread_t thread_id;
+    pthread_attr_t tattr;
+    struct logBuf *log;  // this slot's log
 };
 
 #endif // REPAIRSHR_H
-
@@ -0,0 +1,254 @@
+/*
+ *  trace.c  timeline of the walker threads  (pwalk --trace)
+
+Copyright (C) (2013-2016) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+/*
+
+Each walker slot (tdslot) has a ring of events and the --max-buffer-mb
+writer has one more. Only the thread holding the slot writes its ring,
+so recording is a copy into the next entry without a lock; threads that
+reuse a slot follow each other on the same timeline row, which is what
+shows how well the slots are kept busy.
+
+The events are complete spans: a directory from fileDir to its directory
+record (category new-thread for the root of a walker, recursion for one
+walked by recursion), a walker thread from start to exit (category thread)
+with a flow arrow from the directory that spawned it, lock waits of at least TRACE_MIN_NS, and
+output writes and waits. --trace-sample N keeps one in N directories and
+walker threads, by id, so a large walk stays small; a full ring
+overwrites its oldest events, so the end of the walk is always there.
+
+traceWrite() writes the rings as Chrome trace JSON, which chrome://tracing
+and ui.perfetto.dev open directly.
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include "pwalk.h"
+#include "trace.h"
+
+#define TRACE_RING   16384      /* events per ring, a power of two */
+#define TRACE_MIN_NS 10000      /* shorter lock waits are not recorded */
+#define TRACE_NAME   32
+
+struct traceEvent {
+    int64_t ts, dur;            /* ns from traceOpen() */
+    int64_t id, depth, arg;
+    const char *cat;
+    char ph;
+    char name[TRACE_NAME];
+    };
+
+struct traceRing {
+    struct traceEvent *e;
+    uint64_t n;                 /* events ever recorded */
+    };
+
+char *TRACE = NULL;
+long TRACE_SAMPLE = 1;
+
+static struct traceRing rings[MAXTHRDS + 1];    /* walkers, writer */
+static __thread struct traceRing *myRing;
+static FILE *traceFp;
+static long traceT0;
+
+static long
+now( )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* open the trace file before the walk so a bad name fails early */
+void
+traceOpen( )
+{
+    if ( (traceFp = fopen( TRACE, "w" )) == NULL ) {
+        fprintf( stderr, "trace: %s: %s\n", TRACE, strerror(errno) );
+        exit( 1 );
+    }
+    if ( TRACE_SAMPLE < 1 )
+        TRACE_SAMPLE = 1;
+    traceT0 = now( );
+}
+
+void
+traceThread( int ring )
+{
+    struct traceRing *r = &rings[ring];
+
+    if ( !TRACE )
+        return;
+    if ( r->e == NULL &&
+         (r->e = calloc( TRACE_RING, sizeof(struct traceEvent) )) == NULL ) {
+        fprintf( stderr, "trace: out of memory\n" );
+        exit( 1 );
+    }
+    myRing = r;
+}
+
+long
+traceNow( )
+{
+    return TRACE ? now( ) : 0;
+}
+
+int
+traceSampled( long id )
+{
+    return TRACE && id % TRACE_SAMPLE == 0;
+}
+
+static struct traceEvent *
+event( char ph, const char *cat, const char *name, long ts )
+{
+    struct traceEvent *e;
+    size_t len;
+
+    if ( myRing == NULL )
+        return NULL;
+    e = &myRing->e[myRing->n++ & (TRACE_RING - 1)];
+    e->ph = ph;
+    e->cat = cat;
+    e->ts = ts - traceT0;
+    e->dur = e->id = e->arg = 0;
+    e->depth = -1;
+    len = strlen( name );       /* the tail of a long name */
+    if ( len >= TRACE_NAME )
+        name += len - TRACE_NAME + 1;
+    strcpy( e->name, name );
+    return e;
+}
+
+/* a span from t0 to now on this thread's ring */
+void
+traceSpan( const char *cat, const char *name, long t0, long id, long depth,
+           long arg )
+{
+    struct traceEvent *e;
+
+    if ( t0 == 0 || (e = event( 'X', cat, name, t0 )) == NULL )
+        return;
+    e->dur = now( ) - t0;
+    e->id = id;
+    e->depth = depth;
+    e->arg = arg;
+}
+
+void
+traceLock( const char *name, long t0 )
+{
+    long t;
+    struct traceEvent *e;
+
+    if ( t0 == 0 || (t = now( )) - t0 < TRACE_MIN_NS ||
+         (e = event( 'X', "lock", name, t0 )) == NULL )
+        return;
+    e->dur = t - t0;
+}
+
+/* the start (s) or end (f) of the arrow from a spawn to the new thread */
+void
+traceFlow( char ph, long id )
+{
+    struct traceEvent *e;
+
+    if ( TRACE && (e = event( ph, "spawn", "spawn", now( ) )) != NULL )
+        e->id = id;
+}
+
+static void
+jsonName( FILE *fp, const char *s )
+{
+    for ( ; *s; s++ )
+        if ( *s == '"' || *s == '\\' )
+            fprintf( fp, "\\%c", *s );
+        else if ( (unsigned char)*s < 0x20 )
+            fprintf( fp, "\\u%04x", *s );
+        else
+            putc( *s, fp );
+}
+
+/* write every ring as Chrome trace JSON */
+void
+traceWrite( )
+{
+    struct traceRing *r;
+    struct traceEvent *e;
+    uint64_t i, events = 0, lost = 0;
+    int k, threads = 0;
+    const char *sep = "";
+
+    if ( !TRACE )
+        return;
+    fprintf( traceFp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n" );
+    for ( k = 0; k <= MAXTHRDS; k++ ) {
+        r = &rings[k];
+        if ( r->e == NULL )
+            continue;
+        threads++;
+        fprintf( traceFp, "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                 "\"name\":\"thread_name\",\"args\":{\"name\":\"%s %d\"}}",
+                 sep, k, k < MAXTHRDS ? "walker" : "writer", k );
+        sep = ",\n";
+        i = r->n > TRACE_RING ? r->n - TRACE_RING : 0;
+        lost += i;
+        for ( ; i < r->n; i++, events++ ) {
+            e = &r->e[i & (TRACE_RING - 1)];
+            fprintf( traceFp, "%s{\"ph\":\"%c\",\"pid\":1,\"tid\":%d,"
+                     "\"ts\":%.3f,\"cat\":\"%s\",\"name\":\"", sep, e->ph, k,
+                     e->ts / 1e3, e->cat );
+            jsonName( traceFp, e->name );
+            fputc( '"', traceFp );
+            if ( e->ph == 'X' ) {
+                fprintf( traceFp, ",\"dur\":%.3f", e->dur / 1e3 );
+                if ( e->depth >= 0 )
+                    fprintf( traceFp, ",\"args\":{\"id\":%lld,\"depth\":%lld,"
+                             "\"entries\":%lld}", (long long)e->id,
+                             (long long)e->depth, (long long)e->arg );
+                else if ( e->arg )
+                    fprintf( traceFp, ",\"args\":{\"bytes\":%lld}",
+                             (long long)e->arg );
+            } else
+                fprintf( traceFp, ",\"id\":%lld%s", (long long)e->id,
+                         e->ph == 'f' ? ",\"bp\":\"e\"" : "" );
+            fputc( '}', traceFp );
+        }
+        free( r->e );
+        r->e = NULL;
+    }
+    fprintf( traceFp, "\n]}\n" );
+    if ( fclose( traceFp ) ) {
+        fprintf( stderr, "trace: %s: %s\n", TRACE, strerror(errno) );
+        exit( 1 );
+    }
+    fprintf( stderr, "trace: %llu events of %d threads to %s, %llu overwritten\n",
+             (unsigned long long)events, threads, TRACE,
+             (unsigned long long)lost );
+}
@@ -0,0 +1,20 @@
+/*
+ *  trace.h  --trace timeline of the walker threads, Chrome trace JSON
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+extern char *TRACE;             /* --trace FILE */
+extern long TRACE_SAMPLE;       /* --trace-sample N, 1 in N dirs and threads */
+
+void traceOpen( );
+void traceThread( int ring );   /* this thread records into ring */
+long traceNow( );               /* 0 unless TRACE */
+int traceSampled( long id );
+void traceSpan( const char *cat, const char *name, long t0, long id, long depth,
+                long arg );
+void traceLock( const char *name, long t0 );
+void traceFlow( char ph, long id );
+void traceWrite( );
+
+#endif /* TRACE_H */
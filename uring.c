@@ -0,0 +1,240 @@
+/*
+uring.c  ppurge renameat/unlinkat batched through io_uring
+
+Copyright (C) (2023) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; GPL version 3
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/*
+Each walker slot gets its own ring, so submission needs no lock. An op
+holds the full path of the file and the stat taken before the action;
+the name the kernel sees is the tail of that path. When the submission
+queue is full the walker submits and reaps what has completed. The walker
+drains its ring before it closes a directory, the fds in the ops stay
+valid until their completion is reaped.
+
+No liburing; the three system calls and the ring layout come from
+<linux/io_uring.h>. IORING_OP_RENAMEAT and IORING_OP_UNLINKAT need
+Linux 5.11; uringOpen() probes for them and returns NULL when they are
+missing, ppurge then uses the synchronous calls.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "ppurge.h"
+
+struct pUring {
+    int      fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void     *sqMap, *cqMap;
+    size_t   sqLen, cqLen, sqeLen;
+    unsigned depth;
+    unsigned queued;            /* in the SQ, not yet submitted */
+    unsigned inflight;          /* submitted, not yet reaped */
+    struct purgeOp *ops;        /* one per SQ entry */
+    int      *freeOps, nfree;
+    };
+
+static int
+uringSetup( unsigned entries, struct io_uring_params *p )
+{
+    return syscall( __NR_io_uring_setup, entries, p );
+}
+
+static int
+uringEnter( int fd, unsigned submit, unsigned wait, unsigned flags )
+{
+    return syscall( __NR_io_uring_enter, fd, submit, wait, flags, NULL, 0 );
+}
+
+static int
+uringRegister( int fd, unsigned op, void *arg, unsigned n )
+{
+    return syscall( __NR_io_uring_register, fd, op, arg, n );
+}
+
+/* 1 if the kernel knows both opcodes */
+static int
+probe( int fd )
+{
+    struct io_uring_probe *p;
+    size_t len = sizeof(*p) + 256 * sizeof(struct io_uring_probe_op);
+    int ok = 0;
+
+    if ( (p = calloc( 1, len )) == NULL )
+        return 0;
+    if ( uringRegister( fd, IORING_REGISTER_PROBE, p, 256 ) == 0 &&
+         p->last_op >= IORING_OP_UNLINKAT &&
+         (p->ops[IORING_OP_RENAMEAT].flags & IO_URING_OP_SUPPORTED) &&
+         (p->ops[IORING_OP_UNLINKAT].flags & IO_URING_OP_SUPPORTED) )
+        ok = 1;
+    free( p );
+    return ok;
+}
+
+static void
+uringFree( struct pUring *u )
+{
+    if ( u->sqes && u->sqes != MAP_FAILED ) munmap( u->sqes, u->sqeLen );
+    if ( u->cqMap && u->cqMap != MAP_FAILED && u->cqMap != u->sqMap )
+        munmap( u->cqMap, u->cqLen );
+    if ( u->sqMap && u->sqMap != MAP_FAILED ) munmap( u->sqMap, u->sqLen );
+    if ( u->fd >= 0 ) close( u->fd );
+    free( u->ops );
+    free( u->freeOps );
+    free( u );
+}
+
+/* ring with depth entries, NULL if io_uring can not rename and unlink */
+struct pUring *
+uringOpen( unsigned depth )
+{
+    struct io_uring_params p;
+    struct pUring *u;
+    char *sq, *cq;
+    unsigned i;
+
+    if ( (u = calloc( 1, sizeof(*u) )) == NULL )
+        return NULL;
+    memset( &p, 0, sizeof(p) );
+    if ( (u->fd = uringSetup( depth, &p )) < 0 || !probe( u->fd ) ) {
+        uringFree( u );
+        return NULL;
+    }
+    u->sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ( p.features & IORING_FEAT_SINGLE_MMAP && u->cqLen > u->sqLen )
+        u->sqLen = u->cqLen;
+    u->sqMap = mmap( NULL, u->sqLen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING );
+    if ( p.features & IORING_FEAT_SINGLE_MMAP )
+        u->cqMap = u->sqMap;
+    else
+        u->cqMap = mmap( NULL, u->cqLen, PROT_READ|PROT_WRITE,
+                         MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING );
+    u->sqeLen = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap( NULL, u->sqeLen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                    u->fd, IORING_OFF_SQES );
+    if ( u->sqMap == MAP_FAILED || u->cqMap == MAP_FAILED || u->sqes == MAP_FAILED ) {
+        uringFree( u );
+        return NULL;
+    }
+    sq = u->sqMap; cq = u->cqMap;
+    u->sqHead = (unsigned *)(sq + p.sq_off.head);
+    u->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    u->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sqArray = (unsigned *)(sq + p.sq_off.array);
+    u->cqHead = (unsigned *)(cq + p.cq_off.head);
+    u->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    u->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->depth = p.sq_entries;
+    u->ops = calloc( u->depth, sizeof(struct purgeOp) );
+    u->freeOps = calloc( u->depth, sizeof(int) );
+    if ( u->ops == NULL || u->freeOps == NULL ) {
+        uringFree( u );
+        return NULL;
+    }
+    for ( i = 0; i < u->depth; i++ )
+        u->freeOps[u->nfree++] = i;
+    return u;
+}
+
+/* reap completions; wait for at least one when wait is set */
+static void
+reap( struct pUring *u, int wait )
+{
+    unsigned head, tail;
+    struct io_uring_cqe *c;
+    int id;
+
+    if ( u->queued || wait ) {
+        while ( uringEnter( u->fd, u->queued, wait ? 1 : 0,
+                            wait ? IORING_ENTER_GETEVENTS : 0 ) < 0 ) {
+            if ( errno != EINTR ) {
+                PLOG( NULL, LOG_ERROR, "io_uring_enter: %s\n", strerror(errno) );
+                exit( 1 );
+            }
+        }
+        u->inflight += u->queued;
+        u->queued = 0;
+    }
+    head = *u->cqHead;
+    tail = __atomic_load_n( u->cqTail, __ATOMIC_ACQUIRE );
+    while ( head != tail ) {
+        c = &u->cqes[head & *u->cqMask];
+        id = c->user_data;
+        purgeDone( &u->ops[id], c->res < 0 ? -c->res : 0 );
+        u->freeOps[u->nfree++] = id;
+        u->inflight--;
+        head++;
+    }
+    __atomic_store_n( u->cqHead, head, __ATOMIC_RELEASE );
+}
+
+/* an op to fill in; submits and reaps when the ring is full */
+struct purgeOp *
+uringGet( struct pUring *u )
+{
+    while ( u->nfree == 0 )
+        reap( u, 1 );
+    return &u->ops[u->freeOps[--u->nfree]];
+}
+
+/* queue op from uringGet(); purgeDone() is called when it completes */
+void
+uringQueue( struct pUring *u, struct purgeOp *op )
+{
+    unsigned tail = *u->sqTail, idx = tail & *u->sqMask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+
+    memset( sqe, 0, sizeof(*sqe) );
+    sqe->user_data = op - u->ops;
+    if ( op->type == 'P' ) {
+        sqe->opcode = IORING_OP_RENAMEAT;
+        sqe->fd = op->dirfd;
+        sqe->addr = (unsigned long) op->name;
+        sqe->len = op->todirfd;
+        sqe->addr2 = (unsigned long) op->name;
+    } else {
+        sqe->opcode = IORING_OP_UNLINKAT;
+        sqe->fd = op->dirfd;
+        sqe->addr = (unsigned long) op->name;
+        sqe->unlink_flags = op->flags;
+    }
+    u->sqArray[idx] = idx;
+    __atomic_store_n( u->sqTail, tail + 1, __ATOMIC_RELEASE );
+    if ( ++u->queued >= u->depth / 2 )
+        reap( u, 0 );
+}
+
+/* wait for everything queued; before the walker closes a directory */
+void
+uringDrain( struct pUring *u )
+{
+    if ( u == NULL )
+        return;
+    while ( u->queued || u->inflight )
+        reap( u, 1 );
+}
@@ -0,0 +1,747 @@
+/*
+ *  watch.c  keep a walk up to date from fanotify events  (pwalk --watch)
+
+Copyright (C) (2013-2016) John F Dey
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+ */
+
+/*
+
+The file system of the root is marked with fanotify before the walk, so
+nothing that changes during the walk is missed; events wait in the
+queue. The walk (fileProcess = watchEntry) builds the model: a node for
+every directory, keyed by its file handle, with a hash of its entries and
+their stat. After the walk the daemon reads events. FAN_REPORT_DFID_NAME
+gives the handle of the directory and the entry name. Events for a
+directory that is not in the model are outside the root and are ignored.
+
+An event is not replayed, the entry is looked at again: lstat the name,
+gone is a delete, anything else is a create or an update. Merged and
+reordered events come out the same that way. A directory that is gone is
+moved to the detached list with its subtree; if it shows up again under
+another name (a rename, MOVED_FROM then MOVED_TO) it is found by its
+handle and put back without reading it. A new directory is read. A queue
+overflow reads the whole tree again.
+
+Every --watch-interval seconds, on SIGUSR1 and at SIGTERM or SIGINT the
+model is written to the --watch FILE as pwalk output (tmp file, rename)
+and the totals go to stderr. Detached directories that did not come back
+are freed then.
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/fanotify.h>
+#include "pwalk.h"
+
+extern int SNAPSHOT, DEPTH, ONE_FS, HEADER;
+extern dev_t ST_DEV;
+extern char *exclude_list[];
+int check_exclude_list( char *fname );
+
+#define WATCH_EVENTS (FAN_CREATE|FAN_DELETE|FAN_MOVED_FROM|FAN_MOVED_TO|\
+                      FAN_MODIFY|FAN_ATTRIB|FAN_ONDIR)
+
+struct wDir;
+
+struct wEnt {                   /* an entry of a directory */
+    struct wEnt *next;          /* hash chain */
+    struct wDir *dir;           /* the node if it is a walked directory */
+    unsigned long gen;          /* last scan that saw it */
+    struct dirStat st;
+    char   name[];
+    };
+
+struct wDir {                   /* a directory */
+    struct wDir *parent;        /* NULL for the root and detached */
+    struct wDir *hnext;         /* handle hash chain */
+    struct wDir *dnext;         /* detached list */
+    struct file_handle *fh;
+    char   *name;               /* the root holds the full path */
+    struct dirStat st;
+    long   cnt, sz;             /* entries and the sum of their st_size */
+    struct wEnt **tab;
+    long   n, size;             /* entries, hash buckets */
+    };
+
+static struct wDir **hTab;      /* directories by handle */
+static long hN, hSize;
+static struct wDir *detached;
+static struct wDir *wRoot;
+static struct wDir **byId;      /* directories by walk id during the walk */
+static long byIdMax;
+static unsigned long scanGen;
+static int fanFd = -1;
+static char *CkptFile;
+static long ckptInterval, events;
+static volatile sig_atomic_t sigStop, sigCkpt;
+
+static void *
+xrealloc( void *p, size_t n )
+{
+    if ( (p = realloc( p, n )) == NULL ) {
+        fprintf( stderr, "watch: out of memory\n" );
+        exit( 1 );
+    }
+    return p;
+}
+
+static unsigned long
+hashBytes( const void *p, size_t len )
+{
+    const unsigned char *s = p;
+    unsigned long h = 1469598103934665603UL;
+
+    while ( len-- )
+        h = (h ^ *s++) * 1099511628211UL;
+    return h;
+}
+
+static unsigned long
+fhHash( struct file_handle *fh )
+{
+    return hashBytes( fh->f_handle, fh->handle_bytes ) ^ fh->handle_type;
+}
+
+static int
+fhSame( struct file_handle *a, struct file_handle *b )
+{
+    return a->handle_type == b->handle_type && a->handle_bytes == b->handle_bytes &&
+           !memcmp( a->f_handle, b->f_handle, a->handle_bytes );
+}
+
+static struct wDir *
+hFind( struct file_handle *fh )
+{
+    struct wDir *d;
+
+    if ( hSize == 0 )
+        return NULL;
+    for ( d = hTab[fhHash( fh ) & (hSize - 1)]; d; d = d->hnext )
+        if ( fhSame( d->fh, fh ) )
+            return d;
+    return NULL;
+}
+
+static void
+hAdd( struct wDir *d )
+{
+    struct wDir **t, *x, *next;
+    long i, size;
+
+    if ( hN >= hSize ) {
+        size = hSize ? hSize * 2 : 4096;
+        t = calloc( size, sizeof(struct wDir *) );
+        if ( t == NULL ) {
+            fprintf( stderr, "watch: out of memory\n" );
+            exit( 1 );
+        }
+        for ( i = 0; i < hSize; i++ )
+            for ( x = hTab[i]; x; x = next ) {
+                next = x->hnext;
+                x->hnext = t[fhHash( x->fh ) & (size - 1)];
+                t[fhHash( x->fh ) & (size - 1)] = x;
+            }
+        free( hTab );
+        hTab = t;
+        hSize = size;
+    }
+    d->hnext = hTab[fhHash( d->fh ) & (hSize - 1)];
+    hTab[fhHash( d->fh ) & (hSize - 1)] = d;
+    hN++;
+}
+
+static void
+hDel( struct wDir *d )
+{
+    struct wDir **p;
+
+    for ( p = &hTab[fhHash( d->fh ) & (hSize - 1)]; *p; p = &(*p)->hnext )
+        if ( *p == d ) {
+            *p = d->hnext;
+            hN--;
+            return;
+        }
+}
+
+/* handle of name in dfd ("" for dfd itself); NULL if it has none */
+static struct file_handle *
+handleOf( int dfd, const char *name )
+{
+    struct file_handle *fh = xrealloc( NULL, sizeof(*fh) + MAX_HANDLE_SZ );
+    int mnt;
+
+    fh->handle_bytes = MAX_HANDLE_SZ;
+    if ( name_to_handle_at( dfd, name, fh, &mnt, *name ? 0 : AT_EMPTY_PATH ) ) {
+        free( fh );
+        return NULL;
+    }
+    return xrealloc( fh, sizeof(*fh) + fh->handle_bytes );
+}
+
+static struct wDir *
+dirNew( struct wDir *parent, const char *name )
+{
+    struct wDir *d = calloc( 1, sizeof(struct wDir) );
+
+    if ( d == NULL || (d->name = strdup( name )) == NULL ) {
+        fprintf( stderr, "watch: out of memory\n" );
+        exit( 1 );
+    }
+    d->parent = parent;
+    return d;
+}
+
+static struct wEnt *
+entFind( struct wDir *d, const char *name )
+{
+    struct wEnt *e;
+
+    if ( d->size == 0 )
+        return NULL;
+    for ( e = d->tab[hashBytes( name, strlen( name ) ) & (d->size - 1)]; e; e = e->next )
+        if ( !strcmp( e->name, name ) )
+            return e;
+    return NULL;
+}
+
+static struct wEnt *
+entAdd( struct wDir *d, const char *name, struct stat *f )
+{
+    struct wEnt **t, *x, *next, *e;
+    size_t nlen = strlen( name );
+    long i, size;
+
+    if ( d->n >= d->size ) {
+        size = d->size ? d->size * 2 : 8;
+        t = calloc( size, sizeof(struct wEnt *) );
+        if ( t == NULL ) {
+            fprintf( stderr, "watch: out of memory\n" );
+            exit( 1 );
+        }
+        for ( i = 0; i < d->size; i++ )
+            for ( x = d->tab[i]; x; x = next ) {
+                next = x->next;
+                x->next = t[hashBytes( x->name, strlen( x->name ) ) & (size - 1)];
+                t[hashBytes( x->name, strlen( x->name ) ) & (size - 1)] = x;
+            }
+        free( d->tab );
+        d->tab = t;
+        d->size = size;
+    }
+    e = xrealloc( NULL, sizeof(struct wEnt) + nlen + 1 );
+    memcpy( e->name, name, nlen + 1 );
+    e->dir = NULL;
+    e->gen = scanGen;
+    saveStat( &e->st, f );
+    i = hashBytes( name, nlen ) & (d->size - 1);
+    e->next = d->tab[i];
+    d->tab[i] = e;
+    d->n++;
+    d->cnt++;
+    d->sz += f->st_size;
+    return e;
+}
+
+static void dirFree( struct wDir *d );
+
+/* take a directory out of the tree, it may come back by its handle */
+static void
+detach( struct wDir *d )
+{
+    d->parent = NULL;
+    d->dnext = detached;
+    detached = d;
+}
+
+static void
+undetach( struct wDir *d )
+{
+    struct wDir **p;
+
+    for ( p = &detached; *p; p = &(*p)->dnext )
+        if ( *p == d ) {
+            *p = d->dnext;
+            break;
+        }
+}
+
+/* remove entry e of d; a directory is detached, not freed */
+static void
+entDel( struct wDir *d, struct wEnt *e )
+{
+    struct wEnt **p;
+
+    for ( p = &d->tab[hashBytes( e->name, strlen( e->name ) ) & (d->size - 1)];
+          *p; p = &(*p)->next )
+        if ( *p == e ) {
+            *p = e->next;
+            break;
+        }
+    d->n--;
+    d->cnt--;
+    d->sz -= e->st.size;
+    if ( e->dir )
+        detach( e->dir );
+    free( e );
+}
+
+static void
+dirFree( struct wDir *d )
+{
+    struct wEnt *e, *next;
+    long i;
+
+    for ( i = 0; i < d->size; i++ )
+        for ( e = d->tab[i]; e; e = next ) {
+            next = e->next;
+            if ( e->dir ) {
+                hDel( e->dir );
+                dirFree( e->dir );
+            }
+            free( e );
+        }
+    free( d->tab );
+    free( d->fh );
+    free( d->name );
+    free( d );
+}
+
+/* full path of d into *buf; returns its length */
+static size_t
+dirPath( struct wDir *d, char **buf, size_t *max )
+{
+    size_t len;
+
+    if ( d->parent == NULL )
+        len = 0;
+    else {
+        len = dirPath( d->parent, buf, max );
+        if ( len + 1 >= *max )
+            *buf = xrealloc( *buf, *max = (len + 1) * 2 + 256 );
+        (*buf)[len++] = '/';
+    }
+    if ( len + strlen( d->name ) + 1 > *max )
+        *buf = xrealloc( *buf, *max = (len + strlen( d->name ) + 1) * 2 + 256 );
+    strcpy( *buf + len, d->name );
+    return len + strlen( d->name );
+}
+
+static long
+dirDepth( struct wDir *d )
+{
+    long n = 0;
+
+    while ( (d = d->parent) != NULL )
+        n++;
+    return n;
+}
+
+static void scanDir( struct wDir *d, const char *path, int deep );
+
+/*
+ * entry name of d is f now (path is its full path); add or update it.
+ * A new subdirectory is taken back from the detached list by its handle
+ * or read.
+ */
+static void
+upsert( struct wDir *d, const char *name, const char *path, struct stat *f,
+        int deep )
+{
+    struct wEnt *e = entFind( d, name );
+    struct file_handle *fh;
+    struct wDir *sub;
+
+    if ( e && (e->st.ino != f->st_ino || (e->st.mode ^ f->st_mode) & S_IFMT) ) {
+        entDel( d, e );         /* replaced by another file */
+        e = NULL;
+    }
+    if ( e ) {
+        d->sz += f->st_size - e->st.size;
+        saveStat( &e->st, f );
+        e->gen = scanGen;
+        if ( e->dir ) {
+            e->dir->st = e->st;
+            if ( deep )
+                scanDir( e->dir, path, deep );
+        }
+        return;
+    }
+    e = entAdd( d, name, f );
+    if ( !S_ISDIR(f->st_mode) ||
+         (SNAPSHOT && !strcmp( ".snapshot", name )) ||
+         (DEPTH && DEPTH == dirDepth( d )) ||
+         (exclude_list[0] && check_exclude_list( (char *)path )) ||
+         (fh = handleOf( AT_FDCWD, path )) == NULL )
+        return;
+    if ( (sub = hFind( fh )) == wRoot ) {
+        free( fh );
+        return;
+    }
+    if ( sub != NULL ) {
+        /* moved in; still under its old name if that event is to come */
+        if ( sub->parent && (e = entFind( sub->parent, sub->name )) && e->dir == sub ) {
+            e->dir = NULL;
+            entDel( sub->parent, e );
+        }
+        if ( sub->parent == NULL )
+            undetach( sub );
+        free( sub->name );
+        sub->name = strdup( name );
+        sub->parent = d;
+        sub->st = entFind( d, name )->st;
+        entFind( d, name )->dir = sub;
+        free( fh );
+        return;
+    }
+    sub = dirNew( d, name );
+    sub->fh = fh;
+    sub->st = e->st;
+    e->dir = sub;
+    hAdd( sub );
+    scanDir( sub, path, deep );
+}
+
+/* read d at path; entries not there any more are removed */
+static void
+scanDir( struct wDir *d, const char *path, int deep )
+{
+    char *sub = NULL;
+    size_t plen = strlen( path ), max = 0;
+    unsigned long gen;
+    struct dirent *de;
+    struct wEnt *e, *next;
+    struct stat f;
+    DIR *dirp;
+    long i;
+
+    if ( (dirp = opendir( path )) == NULL ) {
+        fprintf( stderr, "Locked Dir: %s\n", path );
+        return;
+    }
+    gen = ++scanGen;
+    while ( (de = readdir( dirp )) != NULL ) {
+        if ( de->d_name[0] == '.' &&
+             (!de->d_name[1] || (de->d_name[1]=='.' && !de->d_name[2]))) continue;
+        if ( fstatat( dirfd(dirp), de->d_name, &f, AT_SYMLINK_NOFOLLOW ) == -1 )
+            continue;
+        if ( ONE_FS && f.st_dev != ST_DEV )
+            continue;
+        if ( plen + strlen( de->d_name ) + 2 > max )
+            sub = xrealloc( sub, max = (plen + strlen( de->d_name ) + 2) * 2 );
+        sprintf( sub, "%s/%s", path, de->d_name );
+        scanGen = gen;
+        upsert( d, de->d_name, sub, &f, deep );
+    }
+    closedir( dirp );
+    free( sub );
+    for ( i = 0; i < d->size; i++ )
+        for ( e = d->tab[i]; e; e = next ) {
+            next = e->next;
+            if ( e->gen != gen )
+                entDel( d, e );
+        }
+}
+
+/* the node of walk directory id, made on first use; under the print lock */
+static struct wDir *
+nodeOf( long id )
+{
+    long max;
+
+    if ( id >= byIdMax ) {
+        max = byIdMax;
+        byIdMax = (id + 1) * 2;
+        byId = xrealloc( byId, byIdMax * sizeof(struct wDir *) );
+        memset( byId + max, 0, (byIdMax - max) * sizeof(struct wDir *) );
+    }
+    if ( byId[id] == NULL )
+        byId[id] = dirNew( NULL, "" );
+    return byId[id];
+}
+
+/*
+ * fileProcess for --watch; add what the walk found to the model.  Runs
+ * under the print lock (PROCESS_LOCK).
+ */
+void
+watchEntry( struct threadData *cur, char *exten, struct stat *f,
+            long fileCnt, long dirSz )
+{
+    struct dirFrame *fr = curFrame(cur);
+    struct wDir *d = nodeOf( fr->id ), *p;
+    struct wEnt *e;
+    char *name = cur->names + fr->name, *s;
+
+    if ( fileCnt == -1 ) {
+        entAdd( d, cur->ename, f );
+        return;
+    }
+    saveStat( &d->st, f );
+    if ( (d->fh = handleOf( fr->fd, "" )) == NULL ) {
+        fprintf( stderr, "watch: no file handle for %s: %s\n", pwPath(cur),
+                 strerror(errno) );
+        exit( 1 );
+    }
+    hAdd( d );
+    free( d->name );
+    if ( fr->pid == 0 ) {       /* the root keeps the path as given */
+        d->name = strdup( name );
+        wRoot = d;
+        return;
+    }
+    /* thread roots hold the full path, the model wants the last part */
+    if ( (s = strrchr( name, '/' )) != NULL )
+        name = s + 1;
+    d->name = strdup( name );
+    d->parent = p = nodeOf( fr->pid );
+    e = entAdd( p, name, f );
+    e->dir = d;
+}
+
+/* mark the file system of root; before the walk so nothing is missed */
+void
+watchStart( const char *root, const char *ckpt, long interval )
+{
+    fanFd = fanotify_init( FAN_CLASS_NOTIF|FAN_REPORT_DFID_NAME|FAN_UNLIMITED_QUEUE,
+                           O_RDONLY|O_CLOEXEC );
+    if ( fanFd == -1 ) {
+        fprintf( stderr, "--watch needs fanotify with FAN_REPORT_DFID_NAME"
+                 " (Linux 5.9) and CAP_SYS_ADMIN: %s\n", strerror(errno) );
+        exit( 1 );
+    }
+    if ( fanotify_mark( fanFd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM, WATCH_EVENTS,
+                        AT_FDCWD, root ) ) {
+        fprintf( stderr, "watch: fanotify_mark %s: %s\n", root, strerror(errno) );
+        exit( 1 );
+    }
+    CkptFile = (char *) ckpt;
+    ckptInterval = interval;
+}
+
+static void
+onSignal( int sig )
+{
+    if ( sig == SIGUSR1 )
+        sigCkpt = 1;
+    else
+        sigStop = 1;
+}
+
+struct ckpt {
+    FILE   *fp;
+    char   *path, *out;
+    size_t pathMax, outMax;
+    long   dirs, files, bytes;
+    };
+
+static void
+ckptRecord( struct ckpt *c, struct dirStat *ds, uint64_t pino, long depth,
+            long cnt, long sz )
+{
+    char *name = strrchr( c->path, '/' ), *exten;
+    size_t need, len;
+    struct stat f;
+
+    exten = cnt == -1 ? fileExten( name ? name + 1 : c->path ) : NULL;
+    need = PW_RECORD_MAX( strlen( c->path ), exten ? strlen( exten ) : 0 );
+    if ( need > c->outMax )
+        c->out = xrealloc( c->out, c->outMax = need );
+    loadStat( &f, ds );
+    len = pwRecord( c->out, ds->ino, pino, depth, c->path, exten, &f, cnt, sz,
+                    -1, NULL );
+    fwrite( c->out, 1, len, c->fp );
+}
+
+/* write d at path c->path[0..plen) and everything below it */
+static void
+ckptDir( struct ckpt *c, struct wDir *d, size_t plen, uint64_t pino, long depth )
+{
+    struct wEnt *e;
+    size_t nlen;
+    long i;
+
+    for ( i = 0; i < d->size; i++ )
+        for ( e = d->tab[i]; e; e = e->next ) {
+            if ( S_ISDIR(e->st.mode) && !e->dir )
+                continue;       /* not walked, pwalk has no record of it */
+            nlen = strlen( e->name );
+            if ( plen + nlen + 2 > c->pathMax )
+                c->path = xrealloc( c->path, c->pathMax = (plen + nlen + 2) * 2 );
+            c->path[plen] = '/';
+            memcpy( c->path + plen + 1, e->name, nlen + 1 );
+            if ( e->dir )
+                ckptDir( c, e->dir, plen + 1 + nlen, d->st.ino, depth + 1 );
+            else {
+                ckptRecord( c, &e->st, d->st.ino, depth, -1, 0 );
+                c->files++;
+                c->bytes += e->st.size;
+            }
+        }
+    c->path[plen] = '\0';
+    ckptRecord( c, &d->st, pino, depth - 1, d->cnt, d->sz );
+    c->dirs++;
+    c->bytes += d->st.size;
+}
+
+/* write the model to CkptFile and the totals to stderr */
+static void
+checkpoint( )
+{
+    struct ckpt c;
+    struct wDir *d;
+    char *tmp;
+
+    while ( (d = detached) != NULL ) {  /* did not come back */
+        detached = d->dnext;
+        hDel( d );
+        dirFree( d );
+    }
+    memset( &c, 0, sizeof(c) );
+    if ( asprintf( &tmp, "%s.tmp", CkptFile ) == -1 || (c.fp = fopen( tmp, "w" )) == NULL ) {
+        fprintf( stderr, "watch: could not open %s.tmp: %s\n", CkptFile, strerror(errno) );
+        return;
+    }
+    if ( HEADER )
+        pwHeader( c.fp, 0 );
+    c.pathMax = strlen( wRoot->name ) + 256;
+    c.path = xrealloc( NULL, c.pathMax );
+    strcpy( c.path, wRoot->name );
+    ckptDir( &c, wRoot, strlen( wRoot->name ), 0, 0 );
+    if ( fclose( c.fp ) || rename( tmp, CkptFile ) )
+        fprintf( stderr, "watch: write %s: %s\n", CkptFile, strerror(errno) );
+    fprintf( stderr, "watch: %ld dirs, %ld files, %ld bytes, %ld events\n",
+             c.dirs, c.files, c.bytes, events );
+    events = 0;
+    free( c.path ); free( c.out ); free( tmp );
+}
+
+/*
+ * apply one event: look at name in the directory of handle fh again.  The
+ * directory itself changed too (mtime, nlink), there is no event for that.
+ */
+static void
+apply( struct file_handle *fh, const char *name )
+{
+    static char *path;
+    static size_t max;
+    struct wDir *d;
+    struct wEnt *e;
+    struct stat f;
+    size_t len;
+
+    if ( (d = hFind( fh )) == NULL || (d->parent == NULL && d != wRoot) )
+        return;                 /* not under the root */
+    events++;
+    len = dirPath( d, &path, &max );
+    if ( lstat( path, &f ) == 0 ) {
+        if ( d->parent && (e = entFind( d->parent, d->name )) && e->dir == d ) {
+            d->parent->sz += f.st_size - e->st.size;
+            saveStat( &e->st, &f );
+        }
+        saveStat( &d->st, &f );
+    }
+    if ( !strcmp( name, "." ) )
+        return;
+    if ( len + strlen( name ) + 2 > max )
+        path = xrealloc( path, max = (len + strlen( name ) + 2) * 2 );
+    path[len] = '/';
+    strcpy( path + len + 1, name );
+    if ( lstat( path, &f ) == -1 || (ONE_FS && f.st_dev != ST_DEV) ) {
+        if ( (e = entFind( d, name )) != NULL )
+            entDel( d, e );
+        return;
+    }
+    scanGen++;
+    upsert( d, name, path, &f, 0 );
+}
+
+/* after the walk; apply events until SIGTERM or SIGINT */
+void
+watchRun( )
+{
+    char buf[64 * 1024] __attribute__ ((aligned(8)));
+    struct fanotify_event_metadata *m;
+    struct fanotify_event_info_fid *fid;
+    struct file_handle *fh;
+    struct sigaction sa;
+    struct pollfd pfd;
+    long next, now, t;
+    ssize_t len;
+
+    free( byId );
+    byId = NULL;
+    if ( wRoot == NULL ) {
+        fprintf( stderr, "watch: root directory was not walked\n" );
+        exit( 1 );
+    }
+    memset( &sa, 0, sizeof(sa) );
+    sa.sa_handler = onSignal;           /* no SA_RESTART, poll returns */
+    sigaction( SIGTERM, &sa, NULL );
+    sigaction( SIGINT, &sa, NULL );
+    sigaction( SIGUSR1, &sa, NULL );
+    checkpoint( );
+    next = time( NULL ) + ckptInterval;
+    pfd.fd = fanFd;
+    pfd.events = POLLIN;
+    while ( !sigStop ) {
+        now = time( NULL );
+        t = next > now ? (next - now) * 1000 : 0;
+        if ( poll( &pfd, 1, t > INT_MAX ? INT_MAX : t ) > 0 &&
+             (len = read( fanFd, buf, sizeof(buf) )) > 0 ) {
+            for ( m = (struct fanotify_event_metadata *) buf; FAN_EVENT_OK( m, len );
+                  m = FAN_EVENT_NEXT( m, len ) ) {
+                if ( m->vers != FANOTIFY_METADATA_VERSION ) {
+                    fprintf( stderr, "watch: fanotify version mismatch\n" );
+                    exit( 1 );
+                }
+                if ( m->fd >= 0 )
+                    close( m->fd );
+                if ( m->mask & FAN_Q_OVERFLOW ) {
+                    fprintf( stderr, "watch: event queue overflow, reading %s again\n",
+                             wRoot->name );
+                    scanDir( wRoot, wRoot->name, 1 );
+                    continue;
+                }
+                fid = (struct fanotify_event_info_fid *)(m + 1);
+                if ( (char *) fid >= (char *) m + m->event_len ||
+                     fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME )
+                    continue;
+                fh = (struct file_handle *) fid->handle;
+                apply( fh, (char *) fh->f_handle + fh->handle_bytes );
+            }
+        }
+        if ( sigCkpt || time( NULL ) >= next ) {
+            sigCkpt = 0;
+            checkpoint( );
+            next = time( NULL ) + ckptInterval;
+        }
+    }
+    checkpoint( );
+}